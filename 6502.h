@@ -8,7 +8,20 @@ ABOUT:
 
 	The 6502 uese little endian which means it starts with the least significant bit
 
+	With the D flag set ADC and SBC work on packed BCD values like the NMOS 6502. Result and flags
+	are taken from precomputed tables.
+
 API:
+	Every function is available in two flavours. One takes the vm_context as first parameter and
+	works only on that context. This way you can create as many contexts as you like and also run
+	them on different threads. The other one works on the internal context created by vm_create.
+
+	vm_context* vm_create_context();
+		Creates a new vm_context. Release it with vm_release(ctx).
+
+	void vm_release(vm_context* ctx);
+		Destroys a context created by vm_create_context.
+
 	vm_context* vm_create();
 		Creates the internal vm_context. You need to call it once to initialize the virtual machine.
 
@@ -20,6 +33,19 @@ API:
 	bool vm_save(const char* fileName);
 		This method will save the binary content to a file. 
 
+	void vm_save_state(const vm_context* ctx, std::vector<uint8_t>& data);
+		Stores the complete state of the context: registers, flags, the program counter, the stack
+		pointer, the cycles and all non empty pages of the memory. Pages are run length encoded
+		if that makes them smaller. Pages of devices are not stored.
+
+	bool vm_load_state(vm_context* ctx, const uint8_t* data, size_t size);
+		Restores a state written by vm_save_state. Pages which are not part of the state are cleared.
+		Returns false and leaves the context untouched if the data is not a valid state.
+
+	bool vm_save_state_file(vm_context* ctx, const char* fileName);
+	bool vm_load_state_file(vm_context* ctx, const char* fileName);
+		Same as above but using a file which is written and read in one go.
+
 	int vm_assemble_file(const char* fileName);
 		Loads a text file containing some code and will assemble it.
 
@@ -45,8 +71,232 @@ API:
 	void vm_run();
 		Will run the code at 0x600. Make sure you have either loaded or assembled some code before.
 
+	void vm_run_fast(vm_context* ctx);
+		Same as vm_run but uses a tight run loop with a single switch over the opcode byte and
+		the addressing mode resolved inline. The results are identical to vm_run but it does
+		not record trace records.
+
+	uint64_t vm_run_cycles(vm_context* ctx, uint64_t budget);
+		Runs from the current program counter until at least budget cycles have been used, the end of
+		the program is reached or a BRK is executed. Returns the number of cycles used. The total number
+		of cycles is available in the cycles member of the context. Indexed reads crossing a page take
+		one more cycle and taken branches one more or two more if they jump to another page.
+
+	void vm_run_jit(vm_context* ctx);
+		Same as vm_run but translates every block into x86-64 code on first use and runs the native
+		code afterwards. A, X, Y, SP and the flags stay in host registers inside the translated code
+		and blocks with a known target jump directly into each other. Instructions which are not
+		translated call vm_step. Stores into pages holding translated code go through vm_context::write
+		which invalidates the affected blocks. It needs Linux on x86-64 and uses vm_run_fast everywhere
+		else. With tracing enabled it uses vm_run.
+
+	void vm_jit_release(vm_context* ctx);
+		Frees the translated code. vm_release does this as well. Call it after writing code into mem
+		directly without vm_context::write.
+
+	bool vm_recompile(vm_context* ctx, const char* name, std::string& out);
+		Translates the program at 0x600 into a C++ translation unit. Every block becomes a function
+		and the unit defines void name(vm_context* ctx) which runs the program like vm_run. Addresses
+		which are not known at compile time are dispatched through a switch over all blocks and run
+		with vm_step if they do not start a block. Instructions which are not translated call vm_step
+		as well, so the unit has to be linked with the implementation. The translation assumes that
+		the program does not modify itself.
+
+	bool vm_recompile_file(vm_context* ctx, const char* name, const char* fileName);
+		Same as vm_recompile but writes the translation unit to a file.
+
 	void vm_reset();
-		Will reset the registers and flags and also the program counter to 0x600.
+		Will reset the registers and flags and also the program counter to 0x600. Pending
+		interrupts and scheduled events are dropped.
+
+	void vm_run_batch(const std::vector<vm_batch_job>& jobs, std::vector<vm_batch_result>& results, int numThreads);
+		Runs all jobs on numThreads worker threads and stores the final registers, flags and the requested
+		memory ranges of every job in results. Every worker uses its own private context, so this does not
+		touch the internal context. Idle workers steal jobs from the others. If numThreads is 0 one thread
+		per core is used. A binary longer than the memory behind 0x600 is cut off there.
+
+	void vm_trace_enable(vm_context* ctx, uint32_t capacity);
+		Enables tracing. vm_step will record every executed instruction into a ring buffer
+		holding the last capacity records. The capacity is rounded up to a power of two and limited
+		to VM_TRACE_MAX_CAPACITY. Tracing is disabled by default and costs nothing then.
+
+	void vm_trace_disable(vm_context* ctx);
+		Disables tracing and frees the ring buffer.
+
+	int vm_trace_format(vm_context* ctx, std::string& out);
+		Formats all recorded instructions oldest first and returns the number of records.
+
+	const char* vm_trace_last(vm_context* ctx);
+		Formats the last recorded instruction into the debug string of the context and returns it.
+
+	void vm_profile_enable(vm_context* ctx);
+		Enables the profiler. Every executed instruction increments the counter of its address in
+		profile, an array of 64K counters. vm_step, vm_run, vm_run_fast and vm_run_until_break count,
+		vm_run_jit uses vm_run while the profiler is enabled. The fast run loop takes its slow path for
+		every instruction then. The profiler is disabled by default and costs nothing then.
+
+	void vm_profile_disable(vm_context* ctx);
+		Disables the profiler and frees the counters.
+
+	void vm_profile_clear(vm_context* ctx);
+		Sets all counters back to 0.
+
+	int vm_profile_report(const vm_context* ctx, std::string& out, int max);
+		Appends a report to out. It lists the instructions executed per label of the assembled program
+		and the max hottest addresses sorted by their counts. Returns the number of addresses listed.
+		While the profiler is enabled vm_disassemble starts every line with the counter and adds the
+		labels.
+
+	void vm_call_graph_enable(vm_context* ctx);
+		Enables the call graph. JSR and the interrupts enter a subroutine, RTS and RTI return from it.
+		Every executed instruction is counted for the current call stack. Like the profiler it works
+		with vm_step, vm_run, vm_run_fast and vm_run_until_break, vm_run_jit uses vm_run then. Calls
+		nested deeper than 256 levels are counted for the subroutine at level 256.
+
+	void vm_call_graph_disable(vm_context* ctx);
+		Disables the call graph and frees it.
+
+	void vm_call_graph_clear(vm_context* ctx);
+		Sets all counts back to 0. The current call stack is kept.
+
+	int vm_call_graph_report(const vm_context* ctx, std::string& out);
+		Appends the inclusive and exclusive instruction counts and the number of calls of every
+		subroutine to out, sorted by the inclusive count. Subroutines are named by the label at their
+		address, code outside of all subroutines is main. Returns the number of subroutines.
+
+	void vm_call_graph_folded(const vm_context* ctx, std::string& out);
+		Appends one line per call stack to out. Every line lists the subroutines separated by ';' and
+		the instructions executed in the last one, the folded stack format of the flame graph tools.
+
+	bool vm_call_graph_save(vm_context* ctx, const char* fileName);
+		Same as vm_call_graph_folded but writes the lines to a file.
+
+	void vm_stats_reset(vm_context* ctx);
+		Sets all counters in stats back to 0. Only available with VM_STATS_SUPPORT. vm_assemble resets
+		the counters as well.
+
+	int vm_stats_format(const vm_context* ctx, std::string& out);
+		Appends the counters in stats and the executed opcodes sorted by their counts to out. Returns
+		the number of opcodes listed. Only available with VM_STATS_SUPPORT.
+
+	void vm_block_cache_enable(vm_context* ctx);
+		Enables the block cache. vm_run will decode every straight-line block up to the next branch,
+		jump or return once and then execute the predecoded records. Writes through vm_context::write
+		into a cached block invalidate it, so self-modifying code still works. Events and interrupts are
+		checked at the block boundaries only. vm_step never uses the cache.
+
+	void vm_block_cache_disable(vm_context* ctx);
+		Disables the block cache and frees all blocks.
+
+	void vm_block_cache_flush(vm_context* ctx);
+		Drops all cached blocks. Call it after writing code into mem directly without vm_context::write.
+
+	void vm_map_device(vm_context* ctx, uint8_t firstPage, int numPages, vm_device* device);
+		Maps a device to numPages pages of 256 bytes starting at firstPage. Every read and write of
+		these pages calls the read and write functions of the device instead of using mem. All other
+		pages stay plain RAM and only pay for a single table lookup. Instructions are always fetched
+		from RAM, so code can not run from a device page. The device is not copied and
+		has to stay alive while it is mapped. Mapping drops the code translated by vm_run_jit.
+
+	void vm_unmap_device(vm_context* ctx, uint8_t firstPage, int numPages);
+		Turns the pages back into RAM.
+
+	vm_context_snapshot* vm_snapshot(vm_context* ctx);
+		Takes an immutable snapshot of the memory, registers and flags of the context. Pages the context
+		still shares with the snapshot it was forked from are not copied but shared again.
+
+	vm_context* vm_fork(vm_context_snapshot* snapshot);
+		Creates a new context starting at the state of the snapshot. All pages of the memory are shared
+		with the snapshot and a page is only copied into the context when it is written for the first time.
+		Forking does not copy any memory, so thousands of contexts can start from the same state. The new
+		context maps the same devices. vm_run_jit copies all shared pages first. mem only holds the
+		pages already copied, so use read and write to access the memory of a forked context.
+		Release the context with vm_release.
+
+	void vm_snapshot_release(vm_context_snapshot* snapshot);
+		Releases the snapshot. The memory is freed once all contexts forked from it are released as well.
+
+	void vm_schedule(vm_context* ctx, uint64_t cycle, vm_event_func func, void* data);
+		Calls func once the cycles of the context have reached cycle. Events are kept in a priority
+		queue ordered by the cycle, so devices do not need to be polled after every instruction. The
+		run functions check a single cycle counter between instructions (vm_run_jit and the block
+		cache between blocks). vm_step and the recompiled code of vm_recompile do not handle events.
+
+	void vm_irq(vm_context* ctx);
+	void vm_nmi(vm_context* ctx);
+		Raises an interrupt request. Before the next instruction the program counter and the flags
+		are pushed and the program continues at the address stored at $FFFE (IRQ) or $FFFA (NMI).
+		An IRQ waits while the I flag is set. RTI returns from the handler. A BRK uses the IRQ vector
+		as well but only if it is set, otherwise BRK ends the program like before. The run functions
+		stop once the program counter leaves the program, so handlers have to be part of it.
+
+	void vm_dirty_clear(vm_context* ctx);
+		Every write into RAM marks the page of 256 bytes as dirty. Clears all marks, for example after
+		the memory has been set up.
+
+	bool vm_is_dirty(const vm_context* ctx, uint8_t page);
+		Returns true if the page has been written since the last clear or reset.
+
+	void vm_dirty_reset(vm_context* ctx, const uint8_t* image);
+		Copies the dirty pages from the 64K image back into the memory and clears all marks. Passing
+		nullptr fills the dirty pages with zeros. Pages which have not been written are not touched,
+		so resetting a context between two runs of the same program is cheap.
+
+	void vm_dirty_save(const vm_context* ctx, std::vector<uint8_t>& data);
+		Appends every dirty page to data as the page number followed by its 256 bytes.
+
+	bool vm_dirty_load(vm_context* ctx, const uint8_t* data, size_t size);
+		Writes the pages saved by vm_dirty_save back. Returns false if the data is truncated.
+
+	void vm_breakpoint_set(vm_context* ctx, uint16_t address);
+	void vm_breakpoint_clear(vm_context* ctx, uint16_t address);
+	void vm_breakpoint_clear_all(vm_context* ctx);
+	bool vm_is_breakpoint(const vm_context* ctx, uint16_t address);
+		Sets or clears a breakpoint. The breakpoints are kept in a bitmap of 64K bits which is only
+		allocated while at least one breakpoint is set.
+
+	vm_stop_reason vm_run_until_break(vm_context* ctx);
+		Runs the fast run loop from the current program counter until the end of the program, a BRK
+		or until the program counter reaches a breakpoint. The instruction at the breakpoint is not
+		executed, so calling it again continues from there. Without breakpoints it runs exactly like
+		vm_run_fast. With breakpoints every instruction takes the slow path of the run loop which
+		tests a single bit. vm_run_ex stops at breakpoints as well, the other run functions ignore them.
+
+	vm_stop_reason vm_run_ex(vm_context* ctx, const vm_run_options& options);
+		Runs from the current program counter until one of the conditions in options is met and
+		returns the reason. Started inside of the program it stops at its end like vm_run, started
+		anywhere else it only stops at a BRK, a breakpoint, a watchpoint or a condition. The limits
+		of instructions and cycles use the fast run loop. A target, stopOnReturn or a predicate are
+		checked after every instruction by stepping with vm_step. stopOnReturn stops after a RTS
+		returned from the code the run started in, JSR and RTS inside of it are matched.
+
+	int vm_watch_add(vm_context* ctx, uint16_t first, uint16_t last, int type, vm_watch_func func, void* data);
+		Adds a watchpoint for all addresses from first to last. type is WATCH_READ, WATCH_WRITE or
+		WATCH_ACCESS. Every matching access calls func with the address and the old and new value. If func
+		is nullptr the hit is stored in watchHit and the run functions stop after the instruction with
+		stopRequested set (vm_run_until_break returns STOP_WATCHPOINT, vm_run_jit stops at the end of
+		the block for reads). The pages of a watchpoint are marked in the page table, so only accesses to
+		these pages take the slow path. Pages of devices are not watched. Returns the id of the watchpoint.
+		Do not add or remove watchpoints inside of the callback.
+
+	void vm_watch_remove(vm_context* ctx, int id);
+	void vm_watch_clear_all(vm_context* ctx);
+		Removes one or all watchpoints.
+
+	bool vm_lockstep(vm_context* ctx, vm_step_func func, uint64_t maxInstructions, std::string& out);
+		Runs the program of the context with vm_step and with func side by side on two copies of the
+		context until the program counter leaves the program, func returns false or maxInstructions
+		have been executed. After every call of func vm_step catches up to the same cycles, then the registers,
+		flags, program counter, stack pointer, cycles and all written memory are compared. Returns
+		false at the first difference and appends the differences and the last instructions of vm_step
+		to out. maxInstructions of 0 means no limit. Pages of devices are not copied. The context
+		itself is not changed.
+
+	int vm_lockstep_random(vm_step_func func, int numPrograms, uint32_t seed, int numThreads, std::string& out);
+		Generates numPrograms random programs with random registers and memory and checks each one
+		with vm_lockstep on a pool of threads. Program i uses the seed seed + i, so a failing program
+		can be checked again alone. Returns the number of programs which differ and appends the
+		report of the first one to out.
 		
 DEFINES:
 	VM_IMPLEMENTATION
@@ -58,6 +308,12 @@ DEFINES:
 	VM_TEST_SUPPORT
 		This is only used internally to be able to unit test all methods. Do not use this define.
 
+	VM_STATS_SUPPORT
+		Adds stats to the context. vm_step, vm_run, vm_run_fast and vm_run_until_break count the
+		instructions per opcode, the branches taken and not taken, the reads and writes, the pushes
+		and pops and the max stack depth. The counts of vm_run_jit and recompiled code are incomplete.
+		Without the define the counters are compiled out. Define it for all files including the header.
+
 EXAMPLES:
 
 	Assemble some code:
@@ -124,6 +380,7 @@ LICENSE:
 #pragma once
 #include <stdint.h>
 #include <string>
+#include <vector>
 // for unit testing we define all methods to be public
 #if defined(VM_TEST_SUPPORT)
 #define PRIVATE 
@@ -131,6 +388,13 @@ LICENSE:
 #define PRIVATE static
 #endif
 
+// the statistics are only counted with VM_STATS_SUPPORT
+#if defined(VM_STATS_SUPPORT)
+#define VM_STATS(statement) statement
+#else
+#define VM_STATS(statement)
+#endif
+
 // -----------------------------------------------------
 // AddressingMode
 //
@@ -161,6 +425,7 @@ typedef enum vm_registers {
 	A, X, Y
 } vm_registers;
 
+// -----------------------------------------------------
 //  	N 	V 	- 	B 	D 	I 	Z 	C 	P Processor flags
 // -----------------------------------------------------
 // Flags
@@ -176,6 +441,163 @@ typedef enum vm_flags {
 	N
 } vm_flags;
 
+// -----------------------------------------------------
+// Trace record
+//
+// Compact binary record of one executed instruction. The
+// registers are captured after the instruction executed.
+// -----------------------------------------------------
+typedef struct vm_trace_record {
+	uint16_t pc;
+	uint16_t data;
+	uint8_t opcode;
+	uint8_t registers[3];
+	uint8_t sp;
+	uint8_t flags;
+} vm_trace_record;
+
+// -----------------------------------------------------
+// Trace buffer
+//
+// Ring buffer of trace records. The capacity is always
+// a power of two and at most VM_TRACE_MAX_CAPACITY.
+// count is the total number of records written so far.
+// -----------------------------------------------------
+const static uint32_t VM_TRACE_MAX_CAPACITY = 1u << 24;
+
+typedef struct vm_trace_buffer {
+	vm_trace_record* records;
+	uint32_t capacity;
+	uint32_t count;
+} vm_trace_buffer;
+
+struct vm_context;
+
+// -----------------------------------------------------
+// Label
+//
+// Label of the assembled program. vm_assemble stores
+// them in the order of their addresses.
+// -----------------------------------------------------
+typedef struct vm_label {
+	std::string name;
+	uint16_t pc;
+} vm_label;
+
+// -----------------------------------------------------
+// Call graph
+//
+// Opaque calling context tree of the subroutines. See
+// vm_call_graph_enable.
+// -----------------------------------------------------
+struct vm_call_graph;
+
+// -----------------------------------------------------
+// Block cache
+//
+// Opaque cache of predecoded basic blocks. See
+// vm_block_cache_enable.
+// -----------------------------------------------------
+struct vm_block_cache;
+
+void vm_block_cache_invalidate(vm_context* ctx, uint16_t address);
+
+// -----------------------------------------------------
+// JIT
+//
+// Opaque state of the JIT. See vm_run_jit.
+// -----------------------------------------------------
+struct vm_jit;
+
+void vm_jit_invalidate(vm_context* ctx, uint16_t address);
+
+// -----------------------------------------------------
+// Event scheduler
+//
+// Opaque queue of the events. See vm_schedule.
+// -----------------------------------------------------
+struct vm_scheduler;
+
+typedef void(*vm_event_func)(vm_context* ctx, void* data);
+
+// -----------------------------------------------------
+// Memory mapped device
+//
+// Handles all reads and writes of the pages it is
+// mapped to. See vm_map_device.
+// -----------------------------------------------------
+typedef struct vm_device {
+	uint8_t(*read)(vm_device* device, uint16_t address);
+	void(*write)(vm_device* device, uint16_t address, uint8_t value);
+	void* data;
+} vm_device;
+
+// -----------------------------------------------------
+// Page types
+// -----------------------------------------------------
+typedef enum vm_page_type {
+	RAM_PAGE,    // stored in mem
+	SHARED_PAGE, // read only page of a snapshot, copied into mem on the first write
+	DEVICE_PAGE, // handled by a device
+	WATCHED_PAGE // stored in mem, every access is checked against the watchpoints
+} vm_page_type;
+
+// -----------------------------------------------------
+// Watchpoints
+//
+// Opaque list of the watchpoints. See vm_watch_add.
+// -----------------------------------------------------
+struct vm_watch_list;
+
+typedef enum vm_watch_type {
+	WATCH_READ = 1,
+	WATCH_WRITE = 2,
+	WATCH_ACCESS = 3
+} vm_watch_type;
+
+typedef struct vm_watch_hit {
+	uint16_t address;
+	uint8_t oldValue;
+	uint8_t newValue; // same as oldValue for reads
+	bool write;
+} vm_watch_hit;
+
+typedef void(*vm_watch_func)(vm_context* ctx, const vm_watch_hit* hit, void* data);
+
+// -----------------------------------------------------
+// Snapshot
+//
+// Opaque immutable copy of a context. See vm_snapshot.
+// -----------------------------------------------------
+struct vm_context_snapshot;
+
+uint8_t vm_read_page(const vm_context* ctx, uint16_t address);
+
+void vm_write_page(vm_context* ctx, uint16_t address, uint8_t value);
+
+#if defined(VM_STATS_SUPPORT)
+// -----------------------------------------------------
+// Statistics
+//
+// Counters of the executed program. They are kept on
+// their own cache lines at the end of the context. See
+// VM_STATS_SUPPORT.
+// -----------------------------------------------------
+typedef struct alignas(64) vm_stats {
+	uint64_t instructions;
+	uint64_t branchesTaken;
+	uint64_t branchesNotTaken;
+	// all accesses through vm_context::read and write including the stack
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t pushes;
+	uint64_t pops;
+	uint32_t maxStackDepth;
+	// executions per opcode
+	uint64_t opcodes[256];
+} vm_stats;
+#endif
+
 // -----------------------------------------------------
 // The virtual machine vm_context
 // -----------------------------------------------------
@@ -184,33 +606,130 @@ typedef struct vm_context {
 	uint8_t registers[3];
 	uint16_t programCounter;
 	uint8_t mem[65536];
+	uint8_t pageTypes[256];
+	const uint8_t* sharedPages[256];
+	vm_device* devices[256];
+	vm_context_snapshot* snapshot;
+	uint64_t dirtyPages[4];
 	uint8_t sp;
 	uint8_t flags;
+	uint8_t result;
+	bool lazyFlags;
 	uint16_t numCommands;
 	uint16_t numBytes;
+	uint64_t cycles;
+	// the run loops call vm_dispatch_events once cycles reaches it
+	uint64_t nextEvent;
+	uint8_t pendingInterrupts;
 	char debug[256];
+	vm_trace_buffer* trace;
+	// executions per address, nullptr while the profiler is disabled
+	uint64_t* profile;
+	std::vector<vm_label> labels;
+	vm_call_graph* callGraph;
+	vm_block_cache* blockCache;
+	vm_jit* jit;
+	vm_scheduler* scheduler;
+	// one bit per address, nullptr without breakpoints
+	uint64_t* breakpoints;
+	uint32_t numBreakpoints;
+	vm_watch_list* watches;
+	// set by a watchpoint without callback, the run functions stop then
+	vm_watch_hit watchHit;
+	bool stopRequested;
+#if defined(VM_STATS_SUPPORT)
+	// mutable, so const reads are counted as well
+	mutable vm_stats stats;
+#endif
 
+	// N and Z are evaluated lazily. While lazyFlags is set
+	// both are taken from result and the bits in flags are stale.
 	void clearFlags() {
 		flags = 0;
+		lazyFlags = false;
+	}
+
+	void setResult(uint8_t v) {
+		result = v;
+		lazyFlags = true;
+	}
+
+	void syncFlags() {
+		if (lazyFlags) {
+			flags = getFlags();
+			lazyFlags = false;
+		}
+	}
+
+	uint8_t getFlags() const {
+		if (lazyFlags) {
+			return (flags & 0x7B) | (result & 0x80) | (result == 0 ? 0x04 : 0);
+		}
+		return flags;
+	}
+
+	void setFlags(uint8_t v) {
+		flags = v;
+		lazyFlags = false;
 	}
 
 	void setFlag(uint8_t idx) {
+		if (idx == vm_flags::Z || idx == vm_flags::N) {
+			syncFlags();
+		}
 		flags |= 1 << idx;
 	}
 
 	void clearFlag(uint8_t idx) {
+		if (idx == vm_flags::Z || idx == vm_flags::N) {
+			syncFlags();
+		}
 		flags &= ~(1 << idx);
 	}
 
 	bool isSet(uint8_t idx) const {
+		if (lazyFlags) {
+			if (idx == vm_flags::Z) {
+				return result == 0;
+			}
+			if (idx == vm_flags::N) {
+				return (result & 0x80) != 0;
+			}
+		}
 		int p = 1 << idx;
 		return (flags & p ) == p;
 	}
+	// one bit per page of 256 bytes
+	void markDirty(uint16_t idx) {
+		dirtyPages[idx >> 14] |= 1ull << ((idx >> 8) & 63);
+	}
+
+	// Only pages which are not RAM need the page table
 	void write(uint16_t idx, uint8_t v) {
+		VM_STATS(++stats.writes);
+		if (pageTypes[idx >> 8] != RAM_PAGE) {
+			vm_write_page(this, idx, v);
+			return;
+		}
+		writeRam(idx, v);
+	}
+
+	void writeRam(uint16_t idx, uint8_t v) {
 		mem[idx] = v;
+		markDirty(idx);
+		if (blockCache != nullptr) {
+			vm_block_cache_invalidate(this, idx);
+		}
+		if (jit != nullptr) {
+			vm_jit_invalidate(this, idx);
+		}
 	}
 
 	uint8_t read(uint16_t idx) const {
+		VM_STATS(++stats.reads);
+		if (pageTypes[idx >> 8] != RAM_PAGE) {
+			return vm_read_page(this, idx);
+		}
 		return mem[idx];
 	}
 
@@ -220,22 +739,183 @@ typedef struct vm_context {
 		return data;
 	}
 
+	// Instructions are always fetched from RAM, devices only
+	// see the reads and writes of the data.
+	uint8_t fetch(uint16_t idx) const {
+		const uint8_t* page = sharedPages[idx >> 8];
+		if (page != nullptr) {
+			return page[idx & 0xFF];
+		}
+		return mem[idx];
+	}
+
+	int fetchInt(uint16_t idx) const {
+		return fetch(idx) + (fetch(idx + 1) << 8);
+	}
+
 	void push(uint8_t v) {
-		mem[0x100 + sp] = v;
+		write(0x100 + sp, v);
 		--sp;
+		VM_STATS(++stats.pushes);
+		VM_STATS(if (0xFFu - sp > stats.maxStackDepth) stats.maxStackDepth = 0xFFu - sp);
 	}
 
 	uint8_t pop() {
+		VM_STATS(++stats.pops);
 		++sp;
-		uint8_t v = mem[0x100 + sp];		
+		uint8_t v = read(0x100 + sp);
 		return v;
 	}
 } vm_context;
 
+// -----------------------------------------------------
+// Memory block which is copied into memory before a
+// batch job runs
+// -----------------------------------------------------
+typedef struct vm_memory_block {
+	uint16_t address;
+	std::vector<uint8_t> data;
+} vm_memory_block;
+
+// -----------------------------------------------------
+// Memory range which is copied out of memory after a
+// batch job has finished
+// -----------------------------------------------------
+typedef struct vm_memory_range {
+	uint16_t address;
+	uint16_t length;
+} vm_memory_range;
+
+// -----------------------------------------------------
+// Batch job
+//
+// The binary is loaded at 0x600 and runs like vm_run until
+// the end of the program, a BRK or until maxInstructions
+// have been executed. 0 means no limit.
+// -----------------------------------------------------
+typedef struct vm_batch_job {
+	const uint8_t* binary;
+	uint16_t numBytes;
+	std::vector<vm_memory_block> memory;
+	uint64_t maxInstructions;
+	std::vector<vm_memory_range> ranges;
+} vm_batch_job;
+
+// -----------------------------------------------------
+// Batch result
+//
+// memory contains all requested ranges of the job one
+// after another.
+// -----------------------------------------------------
+typedef struct vm_batch_result {
+	uint8_t registers[3];
+	uint16_t programCounter;
+	uint8_t sp;
+	uint8_t flags;
+	uint64_t instructions;
+	std::vector<uint8_t> memory;
+} vm_batch_result;
+
+// -----------------------------------------------------
+// Stop reason
+//
+// Why a run function returned.
+// -----------------------------------------------------
+typedef enum vm_stop_reason {
+	STOP_END,          // program counter left the program
+	STOP_BRK,          // BRK without a handler
+	STOP_BREAKPOINT,   // program counter reached a breakpoint
+	STOP_WATCHPOINT,   // watchpoint without callback hit
+	STOP_INSTRUCTIONS, // instruction limit reached
+	STOP_CYCLES,       // cycle limit reached
+	STOP_TARGET,       // program counter reached the target of vm_run_options
+	STOP_RETURN,       // RTS returned from the code the run started in
+	STOP_PREDICATE     // predicate of vm_run_options returned true
+} vm_stop_reason;
+
+typedef bool(*vm_run_predicate)(const vm_context* ctx, void* data);
+
+// -----------------------------------------------------
+// Run options
+//
+// Conditions of vm_run_ex. A zero initialized struct
+// has no conditions besides the end of the program and
+// BRK.
+// -----------------------------------------------------
+typedef struct vm_run_options {
+	// 0 means no limit
+	uint64_t maxInstructions;
+	uint64_t maxCycles;
+	bool stopAtTarget;
+	uint16_t target;
+	bool stopOnReturn;
+	// called after every instruction, nullptr means no predicate
+	vm_run_predicate predicate;
+	void* data;
+} vm_run_options;
+
+// -----------------------------------------------------
+// Step function checked by vm_lockstep. It executes one
+// instruction or a block and returns false once the
+// program has ended. It has to count the cycles like
+// vm_step.
+// -----------------------------------------------------
+typedef bool(*vm_step_func)(vm_context* ctx);
 
 // ---------------------------------------------------------
 //  API
 // ---------------------------------------------------------
+vm_context* vm_create_context();
+
+void vm_release(vm_context* ctx);
+
+bool vm_load(vm_context* ctx, const char* fileName);
+
+bool vm_save(vm_context* ctx, const char* fileName);
+
+void vm_save_state(const vm_context* ctx, std::vector<uint8_t>& data);
+
+bool vm_load_state(vm_context* ctx, const uint8_t* data, size_t size);
+
+bool vm_save_state_file(vm_context* ctx, const char* fileName);
+
+bool vm_load_state_file(vm_context* ctx, const char* fileName);
+
+int vm_assemble_file(vm_context* ctx, const char* fileName);
+
+void vm_disassemble(vm_context* ctx, std::string& out);
+
+int vm_assemble(vm_context* ctx, const char* code);
+
+void vm_dump(vm_context* ctx, uint16_t pc, uint16_t num);
+
+void vm_dump_registers(vm_context* ctx);
+
+void vm_dump_memory(vm_context* ctx, uint16_t pc, uint16_t num);
+
+bool vm_step(vm_context* ctx);
+
+void vm_run(vm_context* ctx);
+
+void vm_run_fast(vm_context* ctx);
+
+uint64_t vm_run_cycles(vm_context* ctx, uint64_t budget);
+
+void vm_run_jit(vm_context* ctx);
+
+void vm_jit_release(vm_context* ctx);
+
+bool vm_recompile(vm_context* ctx, const char* name, std::string& out);
+
+bool vm_recompile_file(vm_context* ctx, const char* name, const char* fileName);
+
+void vm_reset(vm_context* ctx);
+
+void vm_run_batch(const std::vector<vm_batch_job>& jobs, std::vector<vm_batch_result>& results, int numThreads);
+
+// ---------------------------------------------------------
+//  API working on the internal context
+// ---------------------------------------------------------
 vm_context* vm_create();
 
 void vm_release();
@@ -244,6 +924,10 @@ bool vm_load(const char* fileName);
 
 bool vm_save(const char* fileName);
 
+bool vm_save_state_file(const char* fileName);
+
+bool vm_load_state_file(const char* fileName);
+
 int vm_assemble_file(const char* fileName);
 
 void vm_disassemble(std::string& out);
@@ -260,14 +944,123 @@ bool vm_step();
 
 void vm_run();
 
+bool vm_recompile_file(const char* name, const char* fileName);
+
 void vm_reset();
 
+void vm_trace_enable(vm_context* ctx, uint32_t capacity);
+
+void vm_trace_disable(vm_context* ctx);
+
+int vm_trace_format(vm_context* ctx, std::string& out);
+
+const char* vm_trace_last(vm_context* ctx);
+
+void vm_profile_enable(vm_context* ctx);
+
+void vm_profile_disable(vm_context* ctx);
+
+void vm_profile_clear(vm_context* ctx);
+
+int vm_profile_report(const vm_context* ctx, std::string& out, int max);
+
+void vm_call_graph_enable(vm_context* ctx);
+
+void vm_call_graph_disable(vm_context* ctx);
+
+void vm_call_graph_clear(vm_context* ctx);
+
+int vm_call_graph_report(const vm_context* ctx, std::string& out);
+
+void vm_call_graph_folded(const vm_context* ctx, std::string& out);
+
+bool vm_call_graph_save(vm_context* ctx, const char* fileName);
+
+#if defined(VM_STATS_SUPPORT)
+void vm_stats_reset(vm_context* ctx);
+
+int vm_stats_format(const vm_context* ctx, std::string& out);
+#endif
+
+void vm_block_cache_enable(vm_context* ctx);
+
+void vm_block_cache_disable(vm_context* ctx);
+
+void vm_block_cache_flush(vm_context* ctx);
+
+void vm_map_device(vm_context* ctx, uint8_t firstPage, int numPages, vm_device* device);
+
+void vm_unmap_device(vm_context* ctx, uint8_t firstPage, int numPages);
+
+vm_context_snapshot* vm_snapshot(vm_context* ctx);
+
+vm_context* vm_fork(vm_context_snapshot* snapshot);
+
+void vm_snapshot_release(vm_context_snapshot* snapshot);
+
+void vm_schedule(vm_context* ctx, uint64_t cycle, vm_event_func func, void* data);
+
+void vm_irq(vm_context* ctx);
+
+void vm_nmi(vm_context* ctx);
+
+void vm_dirty_clear(vm_context* ctx);
+
+bool vm_is_dirty(const vm_context* ctx, uint8_t page);
+
+void vm_dirty_reset(vm_context* ctx, const uint8_t* image);
+
+void vm_dirty_save(const vm_context* ctx, std::vector<uint8_t>& data);
+
+bool vm_dirty_load(vm_context* ctx, const uint8_t* data, size_t size);
+
+void vm_breakpoint_set(vm_context* ctx, uint16_t address);
+
+void vm_breakpoint_clear(vm_context* ctx, uint16_t address);
+
+void vm_breakpoint_clear_all(vm_context* ctx);
+
+bool vm_is_breakpoint(const vm_context* ctx, uint16_t address);
+
+vm_stop_reason vm_run_until_break(vm_context* ctx);
+
+vm_stop_reason vm_run_ex(vm_context* ctx, const vm_run_options& options);
+
+void vm_breakpoint_set(uint16_t address);
+
+vm_stop_reason vm_run_until_break();
+
+vm_stop_reason vm_run_ex(const vm_run_options& options);
+
+int vm_watch_add(vm_context* ctx, uint16_t first, uint16_t last, int type, vm_watch_func func, void* data);
+
+void vm_watch_remove(vm_context* ctx, int id);
+
+void vm_watch_clear_all(vm_context* ctx);
+
+bool vm_lockstep(vm_context* ctx, vm_step_func func, uint64_t maxInstructions, std::string& out);
+
+int vm_lockstep_random(vm_step_func func, int numPrograms, uint32_t seed, int numThreads, std::string& out);
+
 
 #if defined(VM_IMPLEMENTATION)
 
 #include <stdio.h>
-#include <vector>
+#include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <queue>
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define VM_JIT_SUPPORTED
+#include <sys/mman.h>
+#include <map>
+#endif
 
 static vm_context* _internal_ctx = nullptr;
 
@@ -308,72 +1101,757 @@ PRIVATE bool vm_is_bit_set(uint8_t flags, uint8_t idx) {
 typedef void(*commandFunc)(vm_context*, int, vm_addressing_mode);
 
 // -----------------------------------------------------
-// create internal context
+// Call graph
+//
+// Calling context tree. Node 0 is main, every other
+// node is a subroutine called from its parent. JSR and
+// the interrupts move to a child of the current node,
+// RTS and RTI back to its parent. The nodes count the
+// instructions executed while they are current.
 // -----------------------------------------------------
-vm_context* vm_create() {
-	if (_internal_ctx == nullptr) {
-		_internal_ctx = new vm_context;
-		for (int i = 0; i < 65536; ++i) {
-			_internal_ctx->mem[i] = 0;
-		}
-		_internal_ctx->registers[vm_registers::A] = 0;
-		_internal_ctx->registers[vm_registers::X] = 0;
-		_internal_ctx->registers[vm_registers::Y] = 0;
-		for (int i = 0; i < 7; ++i) {
-			_internal_ctx->clearFlag(i);
-		}
-		_internal_ctx->numCommands = 0;
-		_internal_ctx->numBytes = 0;
-		_internal_ctx->programCounter = 0x600;
-		_internal_ctx->sp = 255;
+const static int VM_CALL_GRAPH_MAX_DEPTH = 256;
+
+typedef struct vm_call_node {
+	uint16_t address;
+	int parent;
+	int firstChild;
+	int nextSibling;
+	int depth;
+	uint64_t count;
+	uint64_t calls;
+} vm_call_node;
+
+struct vm_call_graph {
+	std::vector<vm_call_node> nodes;
+	int current;
+	// calls below VM_CALL_GRAPH_MAX_DEPTH, they stay in the current node
+	int overflow;
+};
+
+PRIVATE int vm_call_graph_add(vm_call_graph* graph, int parent, uint16_t address) {
+	vm_call_node node = { address, parent, -1, -1, 0, 0, 0 };
+	if (parent >= 0) {
+		node.depth = graph->nodes[parent].depth + 1;
+		node.nextSibling = graph->nodes[parent].firstChild;
+		graph->nodes[parent].firstChild = (int)graph->nodes.size();
 	}
-	return _internal_ctx;
+	graph->nodes.push_back(node);
+	return (int)graph->nodes.size() - 1;
+}
+
+PRIVATE void vm_call_graph_enter(vm_call_graph* graph, uint16_t address) {
+	int current = graph->current;
+	if (graph->nodes[current].depth >= VM_CALL_GRAPH_MAX_DEPTH) {
+		++graph->overflow;
+		return;
+	}
+	int child = graph->nodes[current].firstChild;
+	while (child >= 0 && graph->nodes[child].address != address) {
+		child = graph->nodes[child].nextSibling;
+	}
+	if (child < 0) {
+		child = vm_call_graph_add(graph, current, address);
+	}
+	++graph->nodes[child].calls;
+	graph->current = child;
+}
+
+// a RTS in main, e.g. after the stack was changed, stays in main
+PRIVATE void vm_call_graph_leave(vm_call_graph* graph) {
+	if (graph->overflow > 0) {
+		--graph->overflow;
+	}
+	else if (graph->current != 0) {
+		graph->current = graph->nodes[graph->current].parent;
+	}
+}
+
+PRIVATE void vm_call_graph_count(vm_call_graph* graph) {
+	++graph->nodes[graph->current].count;
 }
 
 // -----------------------------------------------------
-// create internal context
+// Interrupts and events
+//
+// Pending interrupts and the first scheduled event are
+// folded into nextEvent, so the run loops only have to
+// compare the cycles against it.
 // -----------------------------------------------------
-void vm_reset() {
-	if (_internal_ctx != nullptr) {
-		_internal_ctx->registers[vm_registers::A] = 0;
-		_internal_ctx->registers[vm_registers::X] = 0;
-		_internal_ctx->registers[vm_registers::Y] = 0;
-		for (int i = 0; i < 7; ++i) {
-			_internal_ctx->clearFlag(i);
+const static uint16_t VM_NMI_VECTOR = 0xFFFA;
+const static uint16_t VM_IRQ_VECTOR = 0xFFFE;
+const static uint8_t VM_PENDING_IRQ = 1;
+const static uint8_t VM_PENDING_NMI = 2;
+
+typedef struct vm_event {
+	uint64_t cycle;
+	// keeps events of the same cycle in the order they were scheduled
+	uint64_t order;
+	vm_event_func func;
+	void* data;
+
+	// std::priority_queue puts the largest element first
+	bool operator<(const vm_event& other) const {
+		if (cycle != other.cycle) {
+			return cycle > other.cycle;
 		}
-		_internal_ctx->programCounter = 0x600;
-		_internal_ctx->sp = 255;
+		return order > other.order;
+	}
+} vm_event;
+
+typedef struct vm_scheduler {
+	std::priority_queue<vm_event> events;
+	uint64_t order;
+} vm_scheduler;
+
+// a masked IRQ waits until CLI, PLP or RTI clear the I flag
+PRIVATE void vm_update_next_event(vm_context* ctx) {
+	bool irq = (ctx->pendingInterrupts & VM_PENDING_IRQ) != 0 && !ctx->isSet(vm_flags::I);
+	if ((ctx->pendingInterrupts & VM_PENDING_NMI) != 0 || irq) {
+		ctx->nextEvent = 0;
+	}
+	else if (ctx->scheduler != nullptr && !ctx->scheduler->events.empty()) {
+		ctx->nextEvent = ctx->scheduler->events.top().cycle;
+	}
+	else {
+		ctx->nextEvent = UINT64_MAX;
 	}
 }
 
 // -----------------------------------------------------
-// release internal context
+// schedule event
 // -----------------------------------------------------
-void vm_release() {
-	if (_internal_ctx != nullptr) {
-		delete _internal_ctx;
-		_internal_ctx = nullptr;
+void vm_schedule(vm_context* ctx, uint64_t cycle, vm_event_func func, void* data) {
+	if (ctx->scheduler == nullptr) {
+		ctx->scheduler = new vm_scheduler;
+		ctx->scheduler->order = 0;
+	}
+	vm_event event = { cycle, ctx->scheduler->order++, func, data };
+	ctx->scheduler->events.push(event);
+	if (cycle < ctx->nextEvent) {
+		ctx->nextEvent = cycle;
 	}
 }
 
-PRIVATE uint8_t low_value(int value) {
-	return value & 255;
+// -----------------------------------------------------
+// raise IRQ
+// -----------------------------------------------------
+void vm_irq(vm_context* ctx) {
+	ctx->pendingInterrupts |= VM_PENDING_IRQ;
+	ctx->nextEvent = 0;
 }
 
-PRIVATE uint8_t high_value(int value) {
-	return (value >> 8) & 255;
+// -----------------------------------------------------
+// raise NMI
+// -----------------------------------------------------
+void vm_nmi(vm_context* ctx) {
+	ctx->pendingInterrupts |= VM_PENDING_NMI;
+	ctx->nextEvent = 0;
 }
 
 // -----------------------------------------------------
-// set program counter
+// push the return address and the flags and continue at
+// the address stored in the vector
 // -----------------------------------------------------
-PRIVATE void vm_set_program_counter(vm_context* ctx, uint8_t relativeAddress) {
+PRIVATE void vm_interrupt(vm_context* ctx, uint16_t vector, uint16_t returnAddress, bool brk) {
+	ctx->push(returnAddress >> 8);
+	ctx->push(returnAddress & 0xFF);
+	uint8_t flags = ctx->getFlags();
+	if (brk) {
+		flags |= 1 << vm_flags::B;
+	}
+	else {
+		flags &= ~(1 << vm_flags::B);
+	}
+	ctx->push(flags);
+	ctx->setFlag(vm_flags::I);
+	ctx->programCounter = ctx->readInt(vector);
+	if (ctx->callGraph != nullptr) {
+		vm_call_graph_enter(ctx->callGraph, ctx->programCounter);
+	}
+}
+
+// -----------------------------------------------------
+// probe the IRQ vector for a BRK handler. This is no
+// access of the program, so it skips devices and
+// watchpoints.
+// -----------------------------------------------------
+PRIVATE bool vm_has_brk_handler(const vm_context* ctx) {
+	return ctx->fetchInt(VM_IRQ_VECTOR) != 0;
+}
+
+// -----------------------------------------------------
+// called by the run loops once nextEvent is reached.
+// Fires all due events in the order of their cycles and
+// enters the handler of a pending interrupt.
+// -----------------------------------------------------
+PRIVATE void vm_dispatch_events(vm_context* ctx) {
+	vm_scheduler* scheduler = ctx->scheduler;
+	while (scheduler != nullptr && !scheduler->events.empty() && scheduler->events.top().cycle <= ctx->cycles) {
+		vm_event event = scheduler->events.top();
+		scheduler->events.pop();
+		(*event.func)(ctx, event.data);
+	}
+	if ((ctx->pendingInterrupts & VM_PENDING_NMI) != 0) {
+		ctx->pendingInterrupts &= ~VM_PENDING_NMI;
+		vm_interrupt(ctx, VM_NMI_VECTOR, ctx->programCounter, false);
+		ctx->cycles += 7;
+	}
+	else if ((ctx->pendingInterrupts & VM_PENDING_IRQ) != 0 && !ctx->isSet(vm_flags::I)) {
+		ctx->pendingInterrupts &= ~VM_PENDING_IRQ;
+		vm_interrupt(ctx, VM_IRQ_VECTOR, ctx->programCounter, false);
+		ctx->cycles += 7;
+	}
+	vm_update_next_event(ctx);
+}
+
+// -----------------------------------------------------
+// create new context
+// -----------------------------------------------------
+PRIVATE vm_context* vm_alloc_context() {
+	vm_context* ctx = new vm_context;
+	memset(ctx->pageTypes, RAM_PAGE, sizeof(ctx->pageTypes));
+	memset(ctx->sharedPages, 0, sizeof(ctx->sharedPages));
+	memset(ctx->devices, 0, sizeof(ctx->devices));
+	ctx->snapshot = nullptr;
+	memset(ctx->dirtyPages, 0, sizeof(ctx->dirtyPages));
+	ctx->registers[vm_registers::A] = 0;
+	ctx->registers[vm_registers::X] = 0;
+	ctx->registers[vm_registers::Y] = 0;
+	ctx->clearFlags();
+	ctx->result = 0;
+	ctx->numCommands = 0;
+	ctx->numBytes = 0;
+	ctx->programCounter = 0x600;
+	ctx->sp = 255;
+	ctx->cycles = 0;
+	ctx->trace = nullptr;
+	ctx->profile = nullptr;
+	ctx->callGraph = nullptr;
+	ctx->blockCache = nullptr;
+	ctx->jit = nullptr;
+	ctx->scheduler = nullptr;
+	ctx->nextEvent = UINT64_MAX;
+	ctx->pendingInterrupts = 0;
+	ctx->breakpoints = nullptr;
+	ctx->numBreakpoints = 0;
+	ctx->watches = nullptr;
+	ctx->stopRequested = false;
+	VM_STATS(vm_stats_reset(ctx));
+	return ctx;
+}
+
+vm_context* vm_create_context() {
+	vm_context* ctx = vm_alloc_context();
+	memset(ctx->mem, 0, sizeof(ctx->mem));
+	return ctx;
+}
+
+// -----------------------------------------------------
+// create internal context
+// -----------------------------------------------------
+vm_context* vm_create() {
+	if (_internal_ctx == nullptr) {
+		_internal_ctx = vm_create_context();
+	}
+	return _internal_ctx;
+}
+
+// -----------------------------------------------------
+// Watchpoints
+//
+// pages counts the watchpoints touching every page. RAM
+// pages with at least one of them are WATCHED_PAGE, so
+// only their accesses leave the fast path of read and
+// write.
+// -----------------------------------------------------
+typedef struct vm_watchpoint {
+	int id;
+	uint16_t first;
+	uint16_t last;
+	int type;
+	vm_watch_func func;
+	void* data;
+} vm_watchpoint;
+
+struct vm_watch_list {
+	std::vector<vm_watchpoint> watches;
+	uint16_t pages[256];
+	int nextId;
+};
+
+// type of a page which is stored in mem
+PRIVATE vm_page_type vm_ram_page_type(const vm_context* ctx, int page) {
+	if (ctx->watches != nullptr && ctx->watches->pages[page] != 0) {
+		return WATCHED_PAGE;
+	}
+	return RAM_PAGE;
+}
+
+// -----------------------------------------------------
+// check access against all watchpoints. Hits without a
+// callback stop the run loops through nextEvent.
+// -----------------------------------------------------
+PRIVATE void vm_watch_check(vm_context* ctx, uint16_t address, uint8_t oldValue, uint8_t newValue, int type) {
+	const std::vector<vm_watchpoint>& watches = ctx->watches->watches;
+	for (size_t i = 0; i < watches.size(); ++i) {
+		const vm_watchpoint& watch = watches[i];
+		if ((watch.type & type) != 0 && address >= watch.first && address <= watch.last) {
+			vm_watch_hit hit = { address, oldValue, newValue, type == WATCH_WRITE };
+			if (watch.func != nullptr) {
+				(*watch.func)(ctx, &hit, watch.data);
+			}
+			else {
+				ctx->watchHit = hit;
+				ctx->stopRequested = true;
+				ctx->nextEvent = 0;
+			}
+		}
+	}
+}
+
+// -----------------------------------------------------
+// map device to pages
+// -----------------------------------------------------
+void vm_map_device(vm_context* ctx, uint8_t firstPage, int numPages, vm_device* device) {
+	for (int i = 0; i < numPages && firstPage + i < 256; ++i) {
+		int page = firstPage + i;
+		ctx->devices[page] = device;
+		if (device != nullptr) {
+			ctx->pageTypes[page] = DEVICE_PAGE;
+		}
+		else {
+			ctx->pageTypes[page] = ctx->sharedPages[page] != nullptr ? SHARED_PAGE : vm_ram_page_type(ctx, page);
+		}
+	}
+	// translated code accesses RAM pages directly
+	vm_jit_release(ctx);
+}
+
+// -----------------------------------------------------
+// turn pages back into RAM
+// -----------------------------------------------------
+void vm_unmap_device(vm_context* ctx, uint8_t firstPage, int numPages) {
+	vm_map_device(ctx, firstPage, numPages, nullptr);
+}
+
+// -----------------------------------------------------
+// Snapshot
+//
+// pages points at the memory of every page. Pages which
+// were still shared by the context point into the parent
+// snapshot, all others into data. The devices are not
+// copied, only the mapping is.
+// -----------------------------------------------------
+struct vm_context_snapshot {
+	std::atomic<int> refs;
+	vm_context_snapshot* parent;
+	const uint8_t* pages[256];
+	uint8_t* data;
+	vm_device* devices[256];
+	uint8_t registers[3];
+	uint16_t programCounter;
+	uint8_t sp;
+	uint8_t flags;
+	uint16_t numCommands;
+	uint16_t numBytes;
+	uint64_t cycles;
+};
+
+// -----------------------------------------------------
+// copy a shared page into mem
+// -----------------------------------------------------
+PRIVATE void vm_unshare_page(vm_context* ctx, uint8_t page) {
+	memcpy(ctx->mem + (page << 8), ctx->sharedPages[page], 256);
+	ctx->sharedPages[page] = nullptr;
+	ctx->pageTypes[page] = ctx->devices[page] != nullptr ? DEVICE_PAGE : vm_ram_page_type(ctx, page);
+}
+
+// -----------------------------------------------------
+// read from a page which is not RAM
+// -----------------------------------------------------
+uint8_t vm_read_page(const vm_context* ctx, uint16_t address) {
+	uint8_t page = address >> 8;
+	if (ctx->pageTypes[page] == DEVICE_PAGE) {
+		return ctx->devices[page]->read(ctx->devices[page], address);
+	}
+	if (ctx->pageTypes[page] == WATCHED_PAGE) {
+		uint8_t v = ctx->mem[address];
+		// read is only const for the callers, a hit changes the context
+		vm_watch_check(const_cast<vm_context*>(ctx), address, v, v, WATCH_READ);
+		return v;
+	}
+	return ctx->sharedPages[page][address & 0xFF];
+}
+
+// -----------------------------------------------------
+// write to a page which is not RAM. A shared page is
+// copied first.
+// -----------------------------------------------------
+void vm_write_page(vm_context* ctx, uint16_t address, uint8_t value) {
+	uint8_t page = address >> 8;
+	if (ctx->pageTypes[page] == DEVICE_PAGE) {
+		ctx->devices[page]->write(ctx->devices[page], address, value);
+		return;
+	}
+	if (ctx->pageTypes[page] == WATCHED_PAGE) {
+		uint8_t old = ctx->mem[address];
+		ctx->writeRam(address, value);
+		vm_watch_check(ctx, address, old, value, WATCH_WRITE);
+		return;
+	}
+	vm_unshare_page(ctx, page);
+	ctx->write(address, value);
+}
+
+// -----------------------------------------------------
+// copy all shared pages into mem and drop the snapshot
+// -----------------------------------------------------
+PRIVATE void vm_unshare(vm_context* ctx) {
+	if (ctx->snapshot == nullptr) {
+		return;
+	}
+	for (int i = 0; i < 256; ++i) {
+		if (ctx->sharedPages[i] != nullptr) {
+			vm_unshare_page(ctx, i);
+		}
+	}
+	vm_snapshot_release(ctx->snapshot);
+	ctx->snapshot = nullptr;
+}
+
+// -----------------------------------------------------
+// take snapshot. Only the pages owned by the context are
+// copied.
+// -----------------------------------------------------
+vm_context_snapshot* vm_snapshot(vm_context* ctx) {
+	vm_context_snapshot* snapshot = new vm_context_snapshot;
+	snapshot->refs = 1;
+	int owned = 0;
+	for (int i = 0; i < 256; ++i) {
+		if (ctx->sharedPages[i] == nullptr) {
+			++owned;
+		}
+	}
+	snapshot->data = new uint8_t[owned * 256];
+	snapshot->parent = nullptr;
+	if (owned < 256) {
+		snapshot->parent = ctx->snapshot;
+		++snapshot->parent->refs;
+	}
+	uint8_t* data = snapshot->data;
+	for (int i = 0; i < 256; ++i) {
+		if (ctx->sharedPages[i] != nullptr) {
+			snapshot->pages[i] = ctx->sharedPages[i];
+		}
+		else {
+			memcpy(data, ctx->mem + (i << 8), 256);
+			snapshot->pages[i] = data;
+			data += 256;
+		}
+	}
+	memcpy(snapshot->devices, ctx->devices, sizeof(snapshot->devices));
+	memcpy(snapshot->registers, ctx->registers, sizeof(snapshot->registers));
+	snapshot->programCounter = ctx->programCounter;
+	snapshot->sp = ctx->sp;
+	snapshot->flags = ctx->getFlags();
+	snapshot->numCommands = ctx->numCommands;
+	snapshot->numBytes = ctx->numBytes;
+	snapshot->cycles = ctx->cycles;
+	return snapshot;
+}
+
+// -----------------------------------------------------
+// create a context sharing all pages with the snapshot
+// -----------------------------------------------------
+vm_context* vm_fork(vm_context_snapshot* snapshot) {
+	vm_context* ctx = vm_alloc_context();
+	ctx->snapshot = snapshot;
+	++snapshot->refs;
+	memcpy(ctx->sharedPages, snapshot->pages, sizeof(ctx->sharedPages));
+	memcpy(ctx->devices, snapshot->devices, sizeof(ctx->devices));
+	for (int i = 0; i < 256; ++i) {
+		ctx->pageTypes[i] = ctx->devices[i] != nullptr ? DEVICE_PAGE : SHARED_PAGE;
+	}
+	memcpy(ctx->registers, snapshot->registers, sizeof(ctx->registers));
+	ctx->programCounter = snapshot->programCounter;
+	ctx->sp = snapshot->sp;
+	ctx->setFlags(snapshot->flags);
+	ctx->numCommands = snapshot->numCommands;
+	ctx->numBytes = snapshot->numBytes;
+	ctx->cycles = snapshot->cycles;
+	return ctx;
+}
+
+// -----------------------------------------------------
+// release snapshot. It is freed together with all parents
+// nobody else holds on to.
+// -----------------------------------------------------
+void vm_snapshot_release(vm_context_snapshot* snapshot) {
+	while (snapshot != nullptr && --snapshot->refs == 0) {
+		vm_context_snapshot* parent = snapshot->parent;
+		delete[] snapshot->data;
+		delete snapshot;
+		snapshot = parent;
+	}
+}
+
+// -----------------------------------------------------
+// clear dirty pages
+// -----------------------------------------------------
+void vm_dirty_clear(vm_context* ctx) {
+	memset(ctx->dirtyPages, 0, sizeof(ctx->dirtyPages));
+}
+
+// -----------------------------------------------------
+// is page dirty
+// -----------------------------------------------------
+bool vm_is_dirty(const vm_context* ctx, uint8_t page) {
+	return (ctx->dirtyPages[page >> 6] & (1ull << (page & 63))) != 0;
+}
+
+// -----------------------------------------------------
+// collect the numbers of all dirty pages. Returns the
+// number of pages.
+// -----------------------------------------------------
+PRIVATE int vm_dirty_list(const vm_context* ctx, uint8_t* pages) {
+	int num = 0;
+	for (int w = 0; w < 4; ++w) {
+		uint64_t bits = ctx->dirtyPages[w];
+		for (int i = w * 64; bits != 0; ++i, bits >>= 1) {
+			if (bits & 1) {
+				pages[num++] = i;
+			}
+		}
+	}
+	return num;
+}
+
+const static uint8_t VM_EMPTY_PAGE[256] = {};
+
+// -----------------------------------------------------
+// reset dirty pages to the image. With cached code only
+// the bytes which differ are written and invalidated.
+// -----------------------------------------------------
+void vm_dirty_reset(vm_context* ctx, const uint8_t* image) {
+	bool cached = ctx->blockCache != nullptr || ctx->jit != nullptr;
+	uint8_t pages[256];
+	int num = vm_dirty_list(ctx, pages);
+	for (int n = 0; n < num; ++n) {
+		int i = pages[n];
+		uint8_t* page = ctx->mem + (i << 8);
+		const uint8_t* src = image != nullptr ? image + (i << 8) : VM_EMPTY_PAGE;
+		if (!cached) {
+			memcpy(page, src, 256);
+			continue;
+		}
+		for (int j = 0; j < 256; j += 8) {
+			if (memcmp(page + j, src + j, 8) == 0) {
+				continue;
+			}
+			for (int k = j; k < j + 8; ++k) {
+				if (page[k] != src[k]) {
+					page[k] = src[k];
+					if (ctx->blockCache != nullptr) {
+						vm_block_cache_invalidate(ctx, (i << 8) + k);
+					}
+					if (ctx->jit != nullptr) {
+						vm_jit_invalidate(ctx, (i << 8) + k);
+					}
+				}
+			}
+		}
+	}
+	vm_dirty_clear(ctx);
+}
+
+// -----------------------------------------------------
+// save dirty pages
+// -----------------------------------------------------
+void vm_dirty_save(const vm_context* ctx, std::vector<uint8_t>& data) {
+	uint8_t pages[256];
+	int num = vm_dirty_list(ctx, pages);
+	for (int n = 0; n < num; ++n) {
+		const uint8_t* page = ctx->mem + (pages[n] << 8);
+		data.push_back(pages[n]);
+		data.insert(data.end(), page, page + 256);
+	}
+}
+
+// -----------------------------------------------------
+// load pages saved by vm_dirty_save
+// -----------------------------------------------------
+bool vm_dirty_load(vm_context* ctx, const uint8_t* data, size_t size) {
+	size_t pos = 0;
+	while (pos < size) {
+		if (size - pos < 257) {
+			return false;
+		}
+		uint16_t address = data[pos] << 8;
+		for (int j = 0; j < 256; ++j) {
+			ctx->write(address + j, data[pos + 1 + j]);
+		}
+		pos += 257;
+	}
+	return true;
+}
+
+// -----------------------------------------------------
+// add watchpoint. Shared pages are copied, so the page
+// table can mark them.
+// -----------------------------------------------------
+int vm_watch_add(vm_context* ctx, uint16_t first, uint16_t last, int type, vm_watch_func func, void* data) {
+	if (ctx->watches == nullptr) {
+		ctx->watches = new vm_watch_list;
+		memset(ctx->watches->pages, 0, sizeof(ctx->watches->pages));
+		ctx->watches->nextId = 0;
+	}
+	if (last < first) {
+		uint16_t tmp = first;
+		first = last;
+		last = tmp;
+	}
+	vm_watchpoint watch = { ctx->watches->nextId++, first, last, type, func, data };
+	ctx->watches->watches.push_back(watch);
+	for (int i = first >> 8; i <= last >> 8; ++i) {
+		++ctx->watches->pages[i];
+		if (ctx->pageTypes[i] == SHARED_PAGE) {
+			vm_unshare_page(ctx, i);
+		}
+		else if (ctx->pageTypes[i] == RAM_PAGE) {
+			ctx->pageTypes[i] = WATCHED_PAGE;
+		}
+	}
+	// translated code accesses RAM pages directly
+	vm_jit_release(ctx);
+	return watch.id;
+}
+
+// -----------------------------------------------------
+// remove watchpoint
+// -----------------------------------------------------
+void vm_watch_remove(vm_context* ctx, int id) {
+	if (ctx->watches == nullptr) {
+		return;
+	}
+	std::vector<vm_watchpoint>& watches = ctx->watches->watches;
+	for (size_t i = 0; i < watches.size(); ++i) {
+		if (watches[i].id == id) {
+			for (int p = watches[i].first >> 8; p <= watches[i].last >> 8; ++p) {
+				if (--ctx->watches->pages[p] == 0 && ctx->pageTypes[p] == WATCHED_PAGE) {
+					ctx->pageTypes[p] = RAM_PAGE;
+				}
+			}
+			watches.erase(watches.begin() + i);
+			vm_jit_release(ctx);
+			return;
+		}
+	}
+}
+
+// -----------------------------------------------------
+// remove all watchpoints
+// -----------------------------------------------------
+void vm_watch_clear_all(vm_context* ctx) {
+	if (ctx->watches == nullptr) {
+		return;
+	}
+	for (int i = 0; i < 256; ++i) {
+		if (ctx->pageTypes[i] == WATCHED_PAGE) {
+			ctx->pageTypes[i] = RAM_PAGE;
+		}
+	}
+	delete ctx->watches;
+	ctx->watches = nullptr;
+	vm_jit_release(ctx);
+}
+
+// -----------------------------------------------------
+// reset context
+// -----------------------------------------------------
+void vm_reset(vm_context* ctx) {
+	ctx->registers[vm_registers::A] = 0;
+	ctx->registers[vm_registers::X] = 0;
+	ctx->registers[vm_registers::Y] = 0;
+	for (int i = 0; i < 7; ++i) {
+		ctx->clearFlag(i);
+	}
+	ctx->programCounter = 0x600;
+	ctx->sp = 255;
+	ctx->cycles = 0;
+	// pending interrupts and events belong to the old run
+	delete ctx->scheduler;
+	ctx->scheduler = nullptr;
+	ctx->pendingInterrupts = 0;
+	ctx->stopRequested = false;
+	vm_update_next_event(ctx);
+}
+
+// -----------------------------------------------------
+// reset internal context
+// -----------------------------------------------------
+void vm_reset() {
+	if (_internal_ctx != nullptr) {
+		vm_reset(_internal_ctx);
+	}
+}
+
+// -----------------------------------------------------
+// release context
+// -----------------------------------------------------
+void vm_release(vm_context* ctx) {
+	vm_trace_disable(ctx);
+	vm_profile_disable(ctx);
+	vm_call_graph_disable(ctx);
+	vm_block_cache_disable(ctx);
+	vm_jit_release(ctx);
+	vm_snapshot_release(ctx->snapshot);
+	delete ctx->scheduler;
+	delete[] ctx->breakpoints;
+	delete ctx->watches;
+	delete ctx;
+}
+
+// -----------------------------------------------------
+// release internal context
+// -----------------------------------------------------
+void vm_release() {
+	if (_internal_ctx != nullptr) {
+		vm_release(_internal_ctx);
+		_internal_ctx = nullptr;
+	}
+}
+
+PRIVATE uint8_t low_value(int value) {
+	return value & 255;
+}
+
+PRIVATE uint8_t high_value(int value) {
+	return (value >> 8) & 255;
+}
+
+// -----------------------------------------------------
+// set program counter to a relative address
+// -----------------------------------------------------
+PRIVATE uint16_t vm_relative_target(uint16_t pc, uint8_t relativeAddress) {
 	uint8_t adr = relativeAddress;
 	++adr;
 	if (adr > 127) {
 		adr = 255 - adr;
 	}
-	ctx->programCounter -= adr;
+	return pc - adr;
+}
+
+PRIVATE void vm_set_program_counter(vm_context* ctx, uint8_t relativeAddress) {
+	ctx->programCounter = vm_relative_target(ctx->programCounter, relativeAddress);
+	VM_STATS(++ctx->stats.branchesTaken);
+}
+
+// -----------------------------------------------------
+// continue after a branch that is not taken
+// -----------------------------------------------------
+PRIVATE void vm_skip_branch(vm_context* ctx) {
+	ctx->programCounter += 2;
+	VM_STATS(++ctx->stats.branchesNotTaken);
 }
 
 // -----------------------------------------------------
@@ -400,6 +1878,14 @@ PRIVATE void vm_set_negative_flag(vm_context* ctx, int data) {
 	}
 }
 
+// -----------------------------------------------------
+// set zero and negative flag from a result byte. Both are
+// only computed when a branch or a flag query needs them.
+// -----------------------------------------------------
+PRIVATE void vm_set_zn_flags(vm_context* ctx, uint8_t data) {
+	ctx->setResult(data);
+}
+
 // -----------------------------------------------------
 // set overflow flag
 // -----------------------------------------------------
@@ -432,8 +1918,7 @@ PRIVATE void vm_op_lda(vm_context* ctx, int data, vm_addressing_mode mode) {
 	else {
 		ctx->registers[vm_registers::A] = ctx->read(data);
 	}
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::A]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::A]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::A]);
 }
 
 // ------------------------------------------
@@ -446,8 +1931,7 @@ PRIVATE void vm_op_ldx(vm_context* ctx, int data, vm_addressing_mode mode) {
 	else {
 		ctx->registers[vm_registers::X] = ctx->read(data);
 	}
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::X]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::X]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::X]);
 }
 
 // ------------------------------------------
@@ -460,8 +1944,7 @@ PRIVATE void vm_op_ldy(vm_context* ctx, int data, vm_addressing_mode mode) {
 	else {
 		ctx->registers[vm_registers::Y] = ctx->read(data);
 	}
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::Y]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::Y]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::Y]);
 }
 
 // ------------------------------------------
@@ -491,8 +1974,7 @@ PRIVATE void vm_op_sta(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------
 PRIVATE void vm_op_tax(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->registers[vm_registers::X] = ctx->registers[vm_registers::A];
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::X]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::X]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::X]);
 }
 
 // ------------------------------------------
@@ -500,8 +1982,7 @@ PRIVATE void vm_op_tax(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------
 PRIVATE void vm_op_tay(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->registers[vm_registers::Y] = ctx->registers[vm_registers::A];
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::Y]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::Y]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::Y]);
 }
 
 // ------------------------------------------
@@ -509,8 +1990,7 @@ PRIVATE void vm_op_tay(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------
 PRIVATE void vm_op_tya(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->registers[vm_registers::A] = ctx->registers[vm_registers::Y];
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::A]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::A]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::A]);
 }
 
 // ------------------------------------------
@@ -518,8 +1998,7 @@ PRIVATE void vm_op_tya(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------
 PRIVATE void vm_op_txa(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->registers[vm_registers::A] = ctx->registers[vm_registers::X];
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::A]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::A]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::A]);
 }
 
 // ------------------------------------------------------------------------------------
@@ -527,8 +2006,7 @@ PRIVATE void vm_op_txa(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------------------------------------------------
 PRIVATE void vm_op_inx(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->registers[vm_registers::X] += 1;
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::X]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::X]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::X]);
 }
 
 // ------------------------------------------------------------------------------------
@@ -536,8 +2014,7 @@ PRIVATE void vm_op_inx(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------------------------------------------------
 PRIVATE void vm_op_iny(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->registers[vm_registers::Y] += 1;
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::Y]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::Y]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::Y]);
 }
 
 // ------------------------------------------------------------------------------------
@@ -552,57 +2029,182 @@ PRIVATE void vm_op_inc(vm_context* ctx, int data, vm_addressing_mode mode) {
 }
 
 // ------------------------------------------
-// ADC
+// decimal ADC like the NMOS 6502. Z is taken
+// from the binary sum, N and V before the
+// high digit is adjusted.
 // ------------------------------------------
-PRIVATE void vm_op_adc(vm_context* ctx, int data, vm_addressing_mode mode) {
-	if (ctx->isSet(vm_flags::C)) {
-		++data;
+PRIVATE uint16_t vm_bcd_add(int a, int m, int c) {
+	int binary = a + m + c;
+	int lo = (a & 0x0F) + (m & 0x0F) + c;
+	if (lo >= 0x0A) {
+		lo = ((lo + 0x06) & 0x0F) + 0x10;
 	}
-	int tmp = ctx->registers[vm_registers::A] + data;
-	if (tmp > 255) {
-		ctx->setFlag(vm_flags::C);
+	int sum = (a & 0xF0) + (m & 0xF0) + lo;
+	int sign = (int8_t)(a & 0xF0) + (int8_t)(m & 0xF0) + lo;
+	if (sum >= 0xA0) {
+		sum += 0x60;
 	}
-	ctx->registers[vm_registers::A] = (tmp & 0xFF);
-	vm_set_zero_flag(ctx, tmp);
-	vm_set_overflow_flag(ctx, tmp);
-}
-
-// ------------------------------------------------------------------------------------
-// SBC  This instruction subtracts the contents of a memory location to the accumulator 
-//		together with the not of the carry bit. If overflow occurs the carry bit is clear, 
-//		this enables multiple byte subtraction to be performed.
-// ------------------------------------------------------------------------------------
-PRIVATE void vm_op_sbc(vm_context* ctx, int data, vm_addressing_mode mode) {
-	if (ctx->isSet(vm_flags::C)) {
-		--data;
+	int flags = 0;
+	if (sum >= 0x100) {
+		flags |= 1 << vm_flags::C;
 	}
-	int tmp = ctx->registers[vm_registers::A] - data;
-	if (tmp > 255) {
-		ctx->setFlag(vm_flags::C);
+	if ((binary & 0xFF) == 0) {
+		flags |= 1 << vm_flags::Z;
 	}
-	ctx->registers[vm_registers::A] = (tmp & 0xFF);
-	vm_set_zero_flag(ctx, tmp);
-	vm_set_overflow_flag(ctx, tmp);
+	if (sign & 0x80) {
+		flags |= 1 << vm_flags::N;
+	}
+	if (sign < -128 || sign > 127) {
+		flags |= 1 << vm_flags::V;
+	}
+	return (uint16_t)((sum & 0xFF) | (flags << 8));
 }
 
 // ------------------------------------------
-// CPX
+// decimal SBC like the NMOS 6502. All flags
+// are taken from the binary difference.
 // ------------------------------------------
-PRIVATE void vm_op_cpx(vm_context* ctx, int data, vm_addressing_mode mode) {
-	if (ctx->registers[vm_registers::X] == data) {
-		ctx->setFlag(vm_flags::Z);
+PRIVATE uint16_t vm_bcd_sub(int a, int m, int c) {
+	int borrow = 1 - c;
+	int binary = a - m - borrow;
+	int lo = (a & 0x0F) - (m & 0x0F) - borrow;
+	if (lo < 0) {
+		lo = ((lo - 0x06) & 0x0F) - 0x10;
 	}
-	else {
-		ctx->clearFlag(vm_flags::Z);
+	int diff = (a & 0xF0) - (m & 0xF0) + lo;
+	if (diff < 0) {
+		diff -= 0x60;
 	}
-	if (ctx->registers[vm_registers::X] >= data) {
-		ctx->setFlag(vm_flags::C);
+	int flags = 0;
+	if (binary >= 0) {
+		flags |= 1 << vm_flags::C;
 	}
-	else {
-		ctx->clearFlag(vm_flags::C);
+	if ((binary & 0xFF) == 0) {
+		flags |= 1 << vm_flags::Z;
 	}
-	// FIXME: negative flag handling
-}
+	if (binary & 0x80) {
+		flags |= 1 << vm_flags::N;
+	}
+	if ((a ^ m) & (a ^ binary) & 0x80) {
+		flags |= 1 << vm_flags::V;
+	}
+	return (uint16_t)((diff & 0xFF) | (flags << 8));
+}
+
+const static uint8_t VM_BCD_FLAGS = (1 << vm_flags::C) | (1 << vm_flags::Z) | (1 << vm_flags::V) | (1 << vm_flags::N);
+
+// -----------------------------------------------------
+// Decimal mode tables
+//
+// Result and flags of ADC and SBC with the D flag set
+// indexed by carry, accumulator and operand. The low
+// byte is the result and the high byte holds C, Z, V
+// and N. It is built on the first decimal ADC or SBC
+// so the decimal mode is a single indexed load like
+// the binary mode.
+// -----------------------------------------------------
+typedef struct vm_bcd_table {
+
+	uint16_t adc[2][256][256];
+	uint16_t sbc[2][256][256];
+
+	vm_bcd_table() {
+		for (int c = 0; c < 2; ++c) {
+			for (int a = 0; a < 256; ++a) {
+				for (int m = 0; m < 256; ++m) {
+					adc[c][a][m] = vm_bcd_add(a, m, c);
+					sbc[c][a][m] = vm_bcd_sub(a, m, c);
+				}
+			}
+		}
+	}
+} vm_bcd_table;
+
+PRIVATE const vm_bcd_table* vm_bcd_tables() {
+	static const vm_bcd_table* tables = new vm_bcd_table;
+	return tables;
+}
+
+// ------------------------------------------
+// operand of ADC and SBC. Memory modes read
+// the value at the address.
+// ------------------------------------------
+PRIVATE uint8_t vm_arithmetic_operand(vm_context* ctx, int data, vm_addressing_mode mode) {
+	return mode == IMMEDIDATE ? (uint8_t)data : ctx->read(data);
+}
+
+// ------------------------------------------
+// store the result and flags of a decimal
+// table entry
+// ------------------------------------------
+PRIVATE void vm_bcd_apply(vm_context* ctx, const uint16_t (*table)[256][256], uint8_t m) {
+	uint16_t entry = table[ctx->isSet(vm_flags::C) ? 1 : 0][ctx->registers[vm_registers::A]][m];
+	ctx->registers[vm_registers::A] = entry & 0xFF;
+	ctx->setFlags((ctx->getFlags() & ~VM_BCD_FLAGS) | (entry >> 8));
+}
+
+// ------------------------------------------
+// ADC
+// ------------------------------------------
+PRIVATE void vm_op_adc(vm_context* ctx, int data, vm_addressing_mode mode) {
+	int m = vm_arithmetic_operand(ctx, data, mode);
+	if (ctx->isSet(vm_flags::D)) {
+		vm_bcd_apply(ctx, vm_bcd_tables()->adc, m);
+		return;
+	}
+	if (ctx->isSet(vm_flags::C)) {
+		++m;
+	}
+	int tmp = ctx->registers[vm_registers::A] + m;
+	if (tmp > 255) {
+		ctx->setFlag(vm_flags::C);
+	}
+	ctx->registers[vm_registers::A] = (tmp & 0xFF);
+	vm_set_zero_flag(ctx, tmp);
+	vm_set_overflow_flag(ctx, tmp);
+}
+
+// ------------------------------------------------------------------------------------
+// SBC  This instruction subtracts the contents of a memory location to the accumulator 
+//		together with the not of the carry bit. If overflow occurs the carry bit is clear, 
+//		this enables multiple byte subtraction to be performed.
+// ------------------------------------------------------------------------------------
+PRIVATE void vm_op_sbc(vm_context* ctx, int data, vm_addressing_mode mode) {
+	int m = vm_arithmetic_operand(ctx, data, mode);
+	if (ctx->isSet(vm_flags::D)) {
+		vm_bcd_apply(ctx, vm_bcd_tables()->sbc, m);
+		return;
+	}
+	if (ctx->isSet(vm_flags::C)) {
+		--m;
+	}
+	int tmp = ctx->registers[vm_registers::A] - m;
+	if (tmp > 255) {
+		ctx->setFlag(vm_flags::C);
+	}
+	ctx->registers[vm_registers::A] = (tmp & 0xFF);
+	vm_set_zero_flag(ctx, tmp);
+	vm_set_overflow_flag(ctx, tmp);
+}
+
+// ------------------------------------------
+// CPX
+// ------------------------------------------
+PRIVATE void vm_op_cpx(vm_context* ctx, int data, vm_addressing_mode mode) {
+	if (ctx->registers[vm_registers::X] == data) {
+		ctx->setFlag(vm_flags::Z);
+	}
+	else {
+		ctx->clearFlag(vm_flags::Z);
+	}
+	if (ctx->registers[vm_registers::X] >= data) {
+		ctx->setFlag(vm_flags::C);
+	}
+	else {
+		ctx->clearFlag(vm_flags::C);
+	}
+	// FIXME: negative flag handling
+}
 
 // ------------------------------------------
 // CPY
@@ -648,8 +2250,7 @@ PRIVATE void vm_op_cmp(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------------------------------------------------
 PRIVATE void vm_op_dex(vm_context* ctx, int data, vm_addressing_mode mode) {
 	--ctx->registers[vm_registers::X];
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::X]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::X]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::X]);
 }
 
 // ------------------------------------------------------------------------------------
@@ -658,8 +2259,7 @@ PRIVATE void vm_op_dex(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------------------------------------------------
 PRIVATE void vm_op_dey(vm_context* ctx, int pc, vm_addressing_mode mode) {
 	--ctx->registers[vm_registers::Y];
-	vm_set_zero_flag(ctx, ctx->registers[vm_registers::Y]);
-	vm_set_negative_flag(ctx, ctx->registers[vm_registers::Y]);
+	vm_set_zn_flags(ctx, ctx->registers[vm_registers::Y]);
 }
 
 // ------------------------------------------------------------------------------------
@@ -673,7 +2273,21 @@ PRIVATE void vm_op_dec(vm_context* ctx, int data, vm_addressing_mode mode) {
 	vm_set_negative_flag(ctx, v);
 }
 
+// ------------------------------------------------------------------------------------------------------------------------------
+// BRK  Pushes the address after the padding byte and the flags with B set and continues at the IRQ vector.
+//		Without a handler at the vector BRK ends the program.
+// ------------------------------------------------------------------------------------------------------------------------------
+PRIVATE void vm_brk(vm_context* ctx, bool handler) {
+	if (handler) {
+		vm_interrupt(ctx, VM_IRQ_VECTOR, ctx->programCounter + 2, true);
+	}
+	else {
+		ctx->programCounter += 1;
+	}
+}
+
 PRIVATE void brk(vm_context* ctx, int pc, vm_addressing_mode mode) {
+	vm_brk(ctx, vm_has_brk_handler(ctx));
 }
 
 // ------------------------------------------
@@ -684,7 +2298,7 @@ PRIVATE void vm_op_bne(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -696,7 +2310,7 @@ PRIVATE void vm_op_beq(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -708,7 +2322,7 @@ PRIVATE void vm_op_bpl(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -720,7 +2334,7 @@ PRIVATE void vm_op_bvc(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -732,7 +2346,7 @@ PRIVATE void vm_op_bvs(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -744,7 +2358,7 @@ PRIVATE void vm_op_bcc(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -756,7 +2370,7 @@ PRIVATE void vm_op_bcs(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -768,7 +2382,7 @@ PRIVATE void vm_op_bmi(vm_context* ctx, int data, vm_addressing_mode mode) {
 		vm_set_program_counter(ctx, data);
 	}
 	else {
-		ctx->programCounter += 2;
+		vm_skip_branch(ctx);
 	}
 }
 
@@ -791,6 +2405,9 @@ PRIVATE void vm_op_cld(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------
 PRIVATE void vm_op_cli(vm_context* ctx, int data, vm_addressing_mode mode) {
 	ctx->clearFlag(vm_flags::I);
+	if (ctx->pendingInterrupts != 0) {
+		vm_update_next_event(ctx);
+	}
 }
 
 // ------------------------------------------
@@ -847,8 +2464,7 @@ PRIVATE void vm_op_ora(vm_context* ctx, int data, vm_addressing_mode mode) {
 	uint8_t v = ctx->read(data);
 	uint8_t a = ctx->registers[vm_registers::A];
 	uint8_t r = v | a;
-	vm_set_zero_flag(ctx, r);
-	vm_set_negative_flag(ctx, r);
+	vm_set_zn_flags(ctx, r);
 }
 
 // ------------------------------------------
@@ -864,8 +2480,7 @@ PRIVATE void vm_op_eor(vm_context* ctx, int data, vm_addressing_mode mode) {
 			r |= x;
 		}
 	}
-	vm_set_zero_flag(ctx, r);
-	vm_set_negative_flag(ctx, r);
+	vm_set_zn_flags(ctx, r);
 }
 
 // ------------------------------------------
@@ -879,9 +2494,14 @@ PRIVATE void vm_op_jmp(vm_context* ctx, int data, vm_addressing_mode mode) {
 // JSR
 // ------------------------------------------
 PRIVATE void vm_op_jsr(vm_context* ctx, int data, vm_addressing_mode mode) {
-	ctx->push(high_value(ctx->programCounter));
-	ctx->push(low_value(ctx->programCounter));
+	// like the 6502 push the address of the last byte of the JSR
+	uint16_t last = ctx->programCounter + 2;
+	ctx->push(high_value(last));
+	ctx->push(low_value(last));
 	ctx->programCounter = data;
+	if (ctx->callGraph != nullptr) {
+		vm_call_graph_enter(ctx->callGraph, data);
+	}
 }
 
 // ------------------------------------------
@@ -890,7 +2510,10 @@ PRIVATE void vm_op_jsr(vm_context* ctx, int data, vm_addressing_mode mode) {
 PRIVATE void vm_op_rts(vm_context* ctx, int data, vm_addressing_mode mode) {
 	uint8_t low = ctx->pop();
 	uint8_t high = ctx->pop();
-	ctx->programCounter = low + (high << 8);
+	ctx->programCounter = low + (high << 8) + 1;
+	if (ctx->callGraph != nullptr) {
+		vm_call_graph_leave(ctx->callGraph);
+	}
 }
 
 // ------------------------------------------------------------------------------------------------------------------------------
@@ -907,7 +2530,7 @@ PRIVATE void vm_op_and(vm_context* ctx, int data, vm_addressing_mode mode) {
 // PHP  Pushes a copy of the status flags on to the stack.
 // ------------------------------------------------------------------------------------------------------------------------------
 PRIVATE void vm_op_php(vm_context* ctx, int data, vm_addressing_mode mode) {
-	ctx->push(ctx->flags);
+	ctx->push(ctx->getFlags());
 }
 
 // ------------------------------------------------------------------------------------------------------------------------------
@@ -915,7 +2538,10 @@ PRIVATE void vm_op_php(vm_context* ctx, int data, vm_addressing_mode mode) {
 //		The flags will take on new states as determined by the value pulled.
 // ------------------------------------------------------------------------------------------------------------------------------
 PRIVATE void vm_op_plp(vm_context* ctx, int data, vm_addressing_mode mode) {
-	ctx->flags = ctx->pop();
+	ctx->setFlags(ctx->pop());
+	if (ctx->pendingInterrupts != 0) {
+		vm_update_next_event(ctx);
+	}
 }
 
 // ------------------------------------------------------------------------------------------------------------------------------
@@ -1070,13 +2696,19 @@ PRIVATE void vm_op_tsx(vm_context* ctx, int data, vm_addressing_mode mode) {
 // ------------------------------------------------------------------------------------------------------------------------------
 // RTI  The RTI instruction is used at the end of an interrupt processing routine. 
 //		It pulls the processor flags from the stack followed by the program counter.
+//		An interrupt pushes the high byte first, so the low byte is pulled first.
 // ------------------------------------------------------------------------------------------------------------------------------
 PRIVATE void vm_op_rti(vm_context* ctx, int data, vm_addressing_mode mode) {
-	ctx->flags = ctx->pop();
-	// FIXME: correct order???
+	ctx->setFlags(ctx->pop() & ~(1 << vm_flags::B));
 	uint8_t low = ctx->pop();
 	uint8_t high = ctx->pop();
 	ctx->programCounter = low + (high << 8);
+	if (ctx->callGraph != nullptr) {
+		vm_call_graph_leave(ctx->callGraph);
+	}
+	if (ctx->pendingInterrupts != 0) {
+		vm_update_next_event(ctx);
+	}
 }
 // -----------------------------------------------------
 // Command
@@ -1092,7 +2724,6 @@ typedef struct vm_command {
 	}
 } vm_command;
 
-// TODO: missing commands: RTI 
 // -----------------------------------------------------
 // Array of all supported commands with function pointer
 // and a bitset of supported addressing modes
@@ -1108,7 +2739,7 @@ const static vm_command VM_COMMANDS[] = {
 	{ "BMI", true , &vm_op_bmi, 1 << RELATIVE_ADR },
 	{ "BNE", true , &vm_op_bne, 1 << RELATIVE_ADR },
 	{ "BPL", true , &vm_op_bpl, 1 << RELATIVE_ADR },
-	{ "BRK", false, &brk, 0 },
+	{ "BRK", true , &brk, 0 },
 	{ "BVC", true , &vm_op_bvc, 1 << RELATIVE_ADR },
 	{ "BVS", true , &vm_op_bvs, 1 << RELATIVE_ADR },
 	{ "CLC", false, &vm_op_clc, 0 },
@@ -1139,7 +2770,7 @@ const static vm_command VM_COMMANDS[] = {
 	{ "PLP", false, &vm_op_plp, 0 },
 	{ "ROL", false, &vm_op_rol, 1 << ACCUMULATOR | 1 << ZERO_PAGE | 1 << ZERO_PAGE_X | 1 << ABSOLUTE_ADR | 1 << ABSOLUTE_X },
 	{ "ROR", false, &vm_op_ror, 1 << ACCUMULATOR | 1 << ZERO_PAGE | 1 << ZERO_PAGE_X | 1 << ABSOLUTE_ADR | 1 << ABSOLUTE_X },
-	{ "RTI", false, &vm_op_rti, 0 },
+	{ "RTI", true , &vm_op_rti, 0 },
 	{ "RTS", true , &vm_op_rts, 0 },
 	{ "SBC", false, &vm_op_sbc, 1 << IMMEDIDATE | 1 << ZERO_PAGE | 1 << ZERO_PAGE_X | 1 << ABSOLUTE_ADR | 1 << ABSOLUTE_X | 1 << ABSOLUTE_Y | 1 << INDIRECT_X | 1 << INDIRECT_Y },
 	{ "SEC", false, &vm_op_sec, 0 },
@@ -1180,179 +2811,244 @@ PRIVATE int find_command(const char* text) {
 // The number of bytes of data for every addressing
 // mode
 // -----------------------------------------------------
-// NONE,IMMEDIDATE,ABSOLUTE_ADR,ABSOLUTE_X,ABSOLUTE_Y,ZERO_PAGE,ZERO_PAGE_X,ZERO_PAGE_Y,INDIRECT_X,INDIRECT_Y,RELATIVE_ADR
+// NONE,IMMEDIDATE,ABSOLUTE_ADR,ABSOLUTE_X,ABSOLUTE_Y,ZERO_PAGE,ZERO_PAGE_X,ZERO_PAGE_Y,INDIRECT_ADR,INDIRECT_X,INDIRECT_Y,RELATIVE_ADR,JMP_ABSOLUTE,JMP_INDIRECT,ACCUMULATOR
 const static int VM_DATA_SIZE[] = {
-	0, 1, 2, 2, 2, 1, 1, 1, 2, 2, 1, 2, 2, 0
+	0, 1, 2, 2, 2, 1, 1, 1, 2, 1, 1, 1, 2, 2, 0
 };
 
 	
 
 // -----------------------------------------------------
 // Command mapping
+//
+// cycles is the number of cycles the command takes.
+// pageCross marks commands taking one more cycle when
+// the indexed address crosses a page boundary.
 // -----------------------------------------------------
 typedef struct vm_command_mapping {
 	vm_opcode op_code;
 	vm_addressing_mode mode;
 	uint8_t hex;
+	uint8_t cycles;
+	bool pageCross;
 } vm_command_mapping;
 
-const static vm_command_mapping NO_OP = vm_command_mapping{ EOL, NONE, 0xFF };
-
 // -----------------------------------------------------
 // Array of all comand mappings
 // -----------------------------------------------------
 const static vm_command_mapping VM_COMMAND_MAPPING[] = {
-	{ ADC, IMMEDIDATE,   0x69 },
-	{ ADC, ZERO_PAGE,    0x65 },
-	{ ADC, ZERO_PAGE_X,  0x75 },
-	{ ADC, ABSOLUTE_ADR, 0x6D },
-	{ ADC, ABSOLUTE_X,   0x7D },
-	{ ADC, ABSOLUTE_Y,   0x79 },
-	{ ADC, INDIRECT_X,   0x61 },
-	{ ADC, INDIRECT_Y,   0x71 },
-	{ ASL, ACCUMULATOR,  0x0A },
-	{ ASL, ZERO_PAGE,    0x06 },
-	{ ASL, ZERO_PAGE_X,  0x16 },
-	{ ASL, ABSOLUTE_ADR, 0x0E },
-	{ ASL, ABSOLUTE_X,   0x1E },
-	{ AND, IMMEDIDATE,   0x29 },
-	{ AND, ZERO_PAGE,    0x25 },
-	{ AND, ZERO_PAGE_X,  0x35 },
-	{ AND, ABSOLUTE_ADR, 0x2D },
-	{ AND, ABSOLUTE_X,   0x3D },
-	{ AND, ABSOLUTE_Y,   0x39 },
-	{ AND, INDIRECT_X,   0x21 },
-	{ ADC, INDIRECT_Y,   0x31 },
-	{ BIT, ABSOLUTE_ADR, 0x2C },
-	{ BIT, ZERO_PAGE,    0x24 },
-	{ BMI, RELATIVE_ADR, 0x30 },
-	{ BNE, RELATIVE_ADR, 0xD0 },
-	{ BNE, RELATIVE_ADR, 0xD0 },
-	{ BPL, RELATIVE_ADR, 0x10 },
-	{ BRK, NONE,         0x00 },
-	{ BVC, RELATIVE_ADR, 0x50 },
-	{ BVS, RELATIVE_ADR, 0x70 },
-	{ CLC, NONE,         0x18 },
-	{ CLD, NONE,         0xD8 },
-	{ CLI, NONE,         0x58 },
-	{ CLV, NONE,         0xB8 },
-	{ CMP, IMMEDIDATE,   0xC9 },
-	{ CMP, ZERO_PAGE,    0xC5 },
-	{ CMP, ZERO_PAGE_X,  0xD5 },
-	{ CMP, ABSOLUTE_ADR, 0xCD },
-	{ CMP, ABSOLUTE_X,   0xDD },
-	{ CMP, ABSOLUTE_Y,   0xD9 },
-	{ CMP, INDIRECT_X,   0xC1 },
-	{ CMP, INDIRECT_Y,   0xD1 },
-	{ CPX, IMMEDIDATE,   0xE0 },
-	{ CPX, ZERO_PAGE,    0xE4 },
-	{ CPX, ABSOLUTE_ADR, 0xEC },
-	{ CPY, IMMEDIDATE,   0xC0 },
-	{ CPY, ZERO_PAGE,    0xC4 },
-	{ CPY, ABSOLUTE_ADR, 0xCC },
-	{ DEC, ZERO_PAGE,    0xC6 },
-	{ DEC, ZERO_PAGE_X,  0xD6 },
-	{ DEC, ABSOLUTE_ADR, 0xCE },
-	{ DEC, ABSOLUTE_X,   0xDE },
-	{ DEX, NONE,         0xCA },
-	{ DEY, NONE,         0x88 },
-	{ EOR, IMMEDIDATE,   0x49 },
-	{ EOR, ZERO_PAGE,    0x45 },
-	{ EOR, ZERO_PAGE_X,  0x55 },
-	{ EOR, ABSOLUTE_ADR, 0x4D },
-	{ EOR, ABSOLUTE_X,   0x5D },
-	{ EOR, ABSOLUTE_Y,   0x59 },
-	{ EOR, INDIRECT_X,   0x41 },
-	{ EOR, INDIRECT_Y,   0x51 },
-	{ INC, ZERO_PAGE,    0xE6 },
-	{ INC, ZERO_PAGE_X,  0xF6 },
-	{ INC, ABSOLUTE_ADR, 0xEE },
-	{ INC, ABSOLUTE_X,   0xFE },
-	{ INX, NONE,         0xE8 },
-	{ INY, NONE,         0xC8 },
-	{ JMP, JMP_ABSOLUTE, 0x4C },
-	{ JMP, JMP_INDIRECT, 0x6C },
-	{ JSR, JMP_ABSOLUTE, 0x20 },
-	{ LDA, IMMEDIDATE,   0xA9 },
-	{ LDA, ZERO_PAGE,    0xA5 },
-	{ LDA, ZERO_PAGE_X,  0xB5 },
-	{ LDA, ABSOLUTE_ADR, 0xAD },
-	{ LDA, ABSOLUTE_X,   0xBD },
-	{ LDA, ABSOLUTE_Y,   0xB9 },
-	{ LDA, INDIRECT_X,   0xA1 },
-	{ LDA, INDIRECT_Y,   0xB1 },
-	{ LDX, IMMEDIDATE,   0xA2 },
-	{ LDX, ZERO_PAGE,    0xA6 },
-	{ LDX, ZERO_PAGE_Y,  0xB6 },
-	{ LDX, ABSOLUTE_ADR, 0xAE },
-	{ LDX, ABSOLUTE_Y,   0xBE },
-	{ LDY, IMMEDIDATE,   0xA0 },
-	{ LDY, ZERO_PAGE,    0xA4 },
-	{ LDY, ZERO_PAGE_X,  0xB4 },
-	{ LDY, ABSOLUTE_ADR, 0xAC },
-	{ LDY, ABSOLUTE_X,   0xBC },
-	{ LSR, ACCUMULATOR,  0x4A },
-	{ LSR, ZERO_PAGE,    0x46 },
-	{ LSR, ZERO_PAGE_X,  0x56 },
-	{ LSR, ABSOLUTE_ADR, 0x4E },
-	{ LSR, ABSOLUTE_X,   0x5E },
-	{ ORA, IMMEDIDATE,   0x09 },
-	{ ORA, ZERO_PAGE,    0x05 },
-	{ ORA, ZERO_PAGE_X,  0x15 },
-	{ ORA, ABSOLUTE_ADR, 0x0D },
-	{ ORA, ABSOLUTE_X,   0x1D },
-	{ ORA, ABSOLUTE_Y,   0x19 },
-	{ ORA, INDIRECT_X,   0x01 },
-	{ ORA, INDIRECT_Y,   0x11 },
-	{ PHA, NONE,         0x48 },
-	{ PHP, NONE,         0x08 },
-	{ PLA, NONE,         0x68 },
-	{ PLP, NONE,         0x28 },
-	{ ROL, ACCUMULATOR,  0x2A },
-	{ ROL, ZERO_PAGE,    0x26 },
-	{ ROL, ZERO_PAGE_X,  0x36 },
-	{ ROL, ABSOLUTE_ADR, 0x2E },
-	{ ROL, ABSOLUTE_X,   0x3E },
-	{ ROR, ACCUMULATOR,  0x6A },
-	{ ROR, ZERO_PAGE,    0x66 },
-	{ ROR, ZERO_PAGE_X,  0x76 },
-	{ ROR, ABSOLUTE_ADR, 0x6E },
-	{ ROR, ABSOLUTE_X,   0x7E },
-	{ RTI, NONE,         0x40 },
-	{ RTS, NONE,         0x60 },
-	{ SBC, IMMEDIDATE,   0xE9 },
-	{ SBC, ZERO_PAGE,    0xE5 },
-	{ SBC, ZERO_PAGE_X,  0xF5 },
-	{ SBC, ABSOLUTE_ADR, 0xED },
-	{ SBC, ABSOLUTE_X,   0xFD },
-	{ SBC, ABSOLUTE_Y,   0xF9 },
-	{ SBC, INDIRECT_X,   0xE1 },
-	{ SBC, INDIRECT_Y,   0xF1 },
-	{ SEC, NONE,         0x38 },
-	{ SED, NONE,         0xF8 },
-	{ SEI, NONE,         0x78 },
-	{ STA, ZERO_PAGE,    0x85 },
-	{ STA, ZERO_PAGE_X,  0x95 },
-	{ STA, ABSOLUTE_ADR, 0x8D },
-	{ STA, ABSOLUTE_X,   0x9D },
-	{ STA, ABSOLUTE_Y,   0x99 },
-	{ STA, INDIRECT_X,   0x81 },
-	{ STA, INDIRECT_Y,   0x91 },
-	{ STX, ZERO_PAGE,    0x86 },
-	{ STX, ZERO_PAGE_Y,  0x96 },
-	{ STX, ABSOLUTE_ADR, 0x8E },
-	{ STY, ZERO_PAGE,    0x84 },
-	{ STY, ZERO_PAGE_X,  0x94 },
-	{ STY, ABSOLUTE_ADR, 0x8C },
-	{ TAX, NONE,         0xAA },
-	{ TAY, NONE,         0xA8 },
-	{ TSX, NONE,         0xBA },
-	{ TXA, NONE,         0x8A },
-	{ TXS, NONE,         0x9A },
-	{ TYA, NONE,         0x98 },
-	{ EOL, NONE,         0xFF },
+	{ ADC, IMMEDIDATE,   0x69, 2, false },
+	{ ADC, ZERO_PAGE,    0x65, 3, false },
+	{ ADC, ZERO_PAGE_X,  0x75, 4, false },
+	{ ADC, ABSOLUTE_ADR, 0x6D, 4, false },
+	{ ADC, ABSOLUTE_X,   0x7D, 4, true  },
+	{ ADC, ABSOLUTE_Y,   0x79, 4, true  },
+	{ ADC, INDIRECT_X,   0x61, 6, false },
+	{ ADC, INDIRECT_Y,   0x71, 5, true  },
+	{ ASL, ACCUMULATOR,  0x0A, 2, false },
+	{ ASL, ZERO_PAGE,    0x06, 5, false },
+	{ ASL, ZERO_PAGE_X,  0x16, 6, false },
+	{ ASL, ABSOLUTE_ADR, 0x0E, 6, false },
+	{ ASL, ABSOLUTE_X,   0x1E, 7, false },
+	{ AND, IMMEDIDATE,   0x29, 2, false },
+	{ AND, ZERO_PAGE,    0x25, 3, false },
+	{ AND, ZERO_PAGE_X,  0x35, 4, false },
+	{ AND, ABSOLUTE_ADR, 0x2D, 4, false },
+	{ AND, ABSOLUTE_X,   0x3D, 4, true  },
+	{ AND, ABSOLUTE_Y,   0x39, 4, true  },
+	{ AND, INDIRECT_X,   0x21, 6, false },
+	{ AND, INDIRECT_Y,   0x31, 5, true  },
+	{ BCC, RELATIVE_ADR, 0x90, 2, false },
+	{ BCS, RELATIVE_ADR, 0xB0, 2, false },
+	{ BEQ, RELATIVE_ADR, 0xF0, 2, false },
+	{ BIT, ABSOLUTE_ADR, 0x2C, 4, false },
+	{ BIT, ZERO_PAGE,    0x24, 3, false },
+	{ BMI, RELATIVE_ADR, 0x30, 2, false },
+	{ BNE, RELATIVE_ADR, 0xD0, 2, false },
+	{ BPL, RELATIVE_ADR, 0x10, 2, false },
+	{ BRK, NONE,         0x00, 7, false },
+	{ BVC, RELATIVE_ADR, 0x50, 2, false },
+	{ BVS, RELATIVE_ADR, 0x70, 2, false },
+	{ CLC, NONE,         0x18, 2, false },
+	{ CLD, NONE,         0xD8, 2, false },
+	{ CLI, NONE,         0x58, 2, false },
+	{ CLV, NONE,         0xB8, 2, false },
+	{ CMP, IMMEDIDATE,   0xC9, 2, false },
+	{ CMP, ZERO_PAGE,    0xC5, 3, false },
+	{ CMP, ZERO_PAGE_X,  0xD5, 4, false },
+	{ CMP, ABSOLUTE_ADR, 0xCD, 4, false },
+	{ CMP, ABSOLUTE_X,   0xDD, 4, true  },
+	{ CMP, ABSOLUTE_Y,   0xD9, 4, true  },
+	{ CMP, INDIRECT_X,   0xC1, 6, false },
+	{ CMP, INDIRECT_Y,   0xD1, 5, true  },
+	{ CPX, IMMEDIDATE,   0xE0, 2, false },
+	{ CPX, ZERO_PAGE,    0xE4, 3, false },
+	{ CPX, ABSOLUTE_ADR, 0xEC, 4, false },
+	{ CPY, IMMEDIDATE,   0xC0, 2, false },
+	{ CPY, ZERO_PAGE,    0xC4, 3, false },
+	{ CPY, ABSOLUTE_ADR, 0xCC, 4, false },
+	{ DEC, ZERO_PAGE,    0xC6, 5, false },
+	{ DEC, ZERO_PAGE_X,  0xD6, 6, false },
+	{ DEC, ABSOLUTE_ADR, 0xCE, 6, false },
+	{ DEC, ABSOLUTE_X,   0xDE, 7, false },
+	{ DEX, NONE,         0xCA, 2, false },
+	{ DEY, NONE,         0x88, 2, false },
+	{ EOR, IMMEDIDATE,   0x49, 2, false },
+	{ EOR, ZERO_PAGE,    0x45, 3, false },
+	{ EOR, ZERO_PAGE_X,  0x55, 4, false },
+	{ EOR, ABSOLUTE_ADR, 0x4D, 4, false },
+	{ EOR, ABSOLUTE_X,   0x5D, 4, true  },
+	{ EOR, ABSOLUTE_Y,   0x59, 4, true  },
+	{ EOR, INDIRECT_X,   0x41, 6, false },
+	{ EOR, INDIRECT_Y,   0x51, 5, true  },
+	{ INC, ZERO_PAGE,    0xE6, 5, false },
+	{ INC, ZERO_PAGE_X,  0xF6, 6, false },
+	{ INC, ABSOLUTE_ADR, 0xEE, 6, false },
+	{ INC, ABSOLUTE_X,   0xFE, 7, false },
+	{ INX, NONE,         0xE8, 2, false },
+	{ INY, NONE,         0xC8, 2, false },
+	{ JMP, JMP_ABSOLUTE, 0x4C, 3, false },
+	{ JMP, JMP_INDIRECT, 0x6C, 5, false },
+	{ JSR, JMP_ABSOLUTE, 0x20, 6, false },
+	{ LDA, IMMEDIDATE,   0xA9, 2, false },
+	{ LDA, ZERO_PAGE,    0xA5, 3, false },
+	{ LDA, ZERO_PAGE_X,  0xB5, 4, false },
+	{ LDA, ABSOLUTE_ADR, 0xAD, 4, false },
+	{ LDA, ABSOLUTE_X,   0xBD, 4, true  },
+	{ LDA, ABSOLUTE_Y,   0xB9, 4, true  },
+	{ LDA, INDIRECT_X,   0xA1, 6, false },
+	{ LDA, INDIRECT_Y,   0xB1, 5, true  },
+	{ LDX, IMMEDIDATE,   0xA2, 2, false },
+	{ LDX, ZERO_PAGE,    0xA6, 3, false },
+	{ LDX, ZERO_PAGE_Y,  0xB6, 4, false },
+	{ LDX, ABSOLUTE_ADR, 0xAE, 4, false },
+	{ LDX, ABSOLUTE_Y,   0xBE, 4, true  },
+	{ LDY, IMMEDIDATE,   0xA0, 2, false },
+	{ LDY, ZERO_PAGE,    0xA4, 3, false },
+	{ LDY, ZERO_PAGE_X,  0xB4, 4, false },
+	{ LDY, ABSOLUTE_ADR, 0xAC, 4, false },
+	{ LDY, ABSOLUTE_X,   0xBC, 4, true  },
+	{ LSR, ACCUMULATOR,  0x4A, 2, false },
+	{ LSR, ZERO_PAGE,    0x46, 5, false },
+	{ LSR, ZERO_PAGE_X,  0x56, 6, false },
+	{ LSR, ABSOLUTE_ADR, 0x4E, 6, false },
+	{ LSR, ABSOLUTE_X,   0x5E, 7, false },
+	{ NOP, NONE,         0xEA, 2, false },
+	{ ORA, IMMEDIDATE,   0x09, 2, false },
+	{ ORA, ZERO_PAGE,    0x05, 3, false },
+	{ ORA, ZERO_PAGE_X,  0x15, 4, false },
+	{ ORA, ABSOLUTE_ADR, 0x0D, 4, false },
+	{ ORA, ABSOLUTE_X,   0x1D, 4, true  },
+	{ ORA, ABSOLUTE_Y,   0x19, 4, true  },
+	{ ORA, INDIRECT_X,   0x01, 6, false },
+	{ ORA, INDIRECT_Y,   0x11, 5, true  },
+	{ PHA, NONE,         0x48, 3, false },
+	{ PHP, NONE,         0x08, 3, false },
+	{ PLA, NONE,         0x68, 4, false },
+	{ PLP, NONE,         0x28, 4, false },
+	{ ROL, ACCUMULATOR,  0x2A, 2, false },
+	{ ROL, ZERO_PAGE,    0x26, 5, false },
+	{ ROL, ZERO_PAGE_X,  0x36, 6, false },
+	{ ROL, ABSOLUTE_ADR, 0x2E, 6, false },
+	{ ROL, ABSOLUTE_X,   0x3E, 7, false },
+	{ ROR, ACCUMULATOR,  0x6A, 2, false },
+	{ ROR, ZERO_PAGE,    0x66, 5, false },
+	{ ROR, ZERO_PAGE_X,  0x76, 6, false },
+	{ ROR, ABSOLUTE_ADR, 0x6E, 6, false },
+	{ ROR, ABSOLUTE_X,   0x7E, 7, false },
+	{ RTI, NONE,         0x40, 6, false },
+	{ RTS, NONE,         0x60, 6, false },
+	{ SBC, IMMEDIDATE,   0xE9, 2, false },
+	{ SBC, ZERO_PAGE,    0xE5, 3, false },
+	{ SBC, ZERO_PAGE_X,  0xF5, 4, false },
+	{ SBC, ABSOLUTE_ADR, 0xED, 4, false },
+	{ SBC, ABSOLUTE_X,   0xFD, 4, true  },
+	{ SBC, ABSOLUTE_Y,   0xF9, 4, true  },
+	{ SBC, INDIRECT_X,   0xE1, 6, false },
+	{ SBC, INDIRECT_Y,   0xF1, 5, true  },
+	{ SEC, NONE,         0x38, 2, false },
+	{ SED, NONE,         0xF8, 2, false },
+	{ SEI, NONE,         0x78, 2, false },
+	{ STA, ZERO_PAGE,    0x85, 3, false },
+	{ STA, ZERO_PAGE_X,  0x95, 4, false },
+	{ STA, ABSOLUTE_ADR, 0x8D, 4, false },
+	{ STA, ABSOLUTE_X,   0x9D, 5, false },
+	{ STA, ABSOLUTE_Y,   0x99, 5, false },
+	{ STA, INDIRECT_X,   0x81, 6, false },
+	{ STA, INDIRECT_Y,   0x91, 6, false },
+	{ STX, ZERO_PAGE,    0x86, 3, false },
+	{ STX, ZERO_PAGE_Y,  0x96, 4, false },
+	{ STX, ABSOLUTE_ADR, 0x8E, 4, false },
+	{ STY, ZERO_PAGE,    0x84, 3, false },
+	{ STY, ZERO_PAGE_X,  0x94, 4, false },
+	{ STY, ABSOLUTE_ADR, 0x8C, 4, false },
+	{ TAX, NONE,         0xAA, 2, false },
+	{ TAY, NONE,         0xA8, 2, false },
+	{ TSX, NONE,         0xBA, 2, false },
+	{ TXA, NONE,         0x8A, 2, false },
+	{ TXS, NONE,         0x9A, 2, false },
+	{ TYA, NONE,         0x98, 2, false },
+	{ EOL, NONE,         0xFF, 0, false },
 };
 
+// -----------------------------------------------------
+// Decode entry
+//
+// Everything vm_step needs to know about an opcode byte
+// -----------------------------------------------------
+typedef struct vm_decode_entry {
+	vm_opcode op_code;
+	vm_addressing_mode mode;
+	uint8_t dataSize;
+	uint8_t cycles;
+	bool pageCross;
+	bool modifyPC;
+	commandFunc function;
+} vm_decode_entry;
+
+// -----------------------------------------------------
+// Decode table
+//
+// Dense table indexed by the opcode byte. It is built
+// once from VM_COMMAND_MAPPING so decoding an opcode is
+// a single indexed load. Unknown opcodes map to EOL and
+// will be executed as NOP.
+// -----------------------------------------------------
+typedef struct vm_decode_table {
+
+	vm_decode_entry entries[256];
+
+	vm_decode_table() {
+		for (int i = 0; i < 256; ++i) {
+			entries[i] = vm_decode_entry{ EOL, NONE, 0, 2, false, false, &vm_op_nop };
+		}
+		int i = 0;
+		vm_command_mapping m = VM_COMMAND_MAPPING[i];
+		while (m.op_code != EOL) {
+			const vm_command& cmd = VM_COMMANDS[m.op_code];
+			entries[m.hex] = vm_decode_entry{ m.op_code, m.mode, (uint8_t)VM_DATA_SIZE[m.mode], m.cycles, m.pageCross, cmd.modifyPC, cmd.function };
+			++i;
+			m = VM_COMMAND_MAPPING[i];
+		}
+	}
+
+	const vm_decode_entry& operator[](uint8_t hex) const {
+		return entries[hex];
+	}
+} vm_decode_table;
+
+const static vm_decode_table VM_DECODE_TABLE;
+
+// -----------------------------------------------------
+// get command name
+// -----------------------------------------------------
+PRIVATE const char* get_command_name(vm_opcode op_code) {
+	if (op_code < EOL) {
+		return VM_COMMANDS[op_code].name;
+	}
+	return "???";
+}
+
 const uint32_t FNV_Prime = 0x01000193; //   16777619
 const uint32_t FNV_Seed = 0x811C9DC5; // 2166136261
 
@@ -1370,13 +3066,16 @@ typedef struct vm_token {
 
 	enum TokenType { EMPTY, NUMBER, STRING, DOLLAR, HASHTAG, OPEN_BRACKET, CLOSE_BRACKET, COMMA, X, Y, SEPARATOR, COMMAND,ACCUMULATOR };
 
-	vm_token(TokenType t) : type(t), value(0), hash(0) {}
-	vm_token(TokenType t, int v) : type(t), value(v), hash(0) {}
+	vm_token(TokenType t) : type(t), value(0), hash(0), text(nullptr), length(0) {}
+	vm_token(TokenType t, int v) : type(t), value(v), hash(0), text(nullptr), length(0) {}
 
 	TokenType type;
 	int value;
 	uint32_t hash;
 	int line;
+	// name of a label, points into the code
+	const char* text;
+	int length;
 } vm_token;
 
 typedef std::vector<vm_token> TokenList;
@@ -1522,6 +3221,8 @@ PRIVATE bool vm_tokenize(const char* text,TokenList& tokens) {
 				}
 				else {
 					token.hash = fnv1a(identifier, p - identifier);
+					token.text = identifier;
+					token.length = p - identifier;
 				}
 			}
 		}
@@ -1605,22 +3306,6 @@ PRIVATE uint8_t get_hex_value(const vm_token& token, vm_addressing_mode mode) {
 	return 0xEA;
 }
 
-// -----------------------------------------------------------------
-// get command mapping
-// -----------------------------------------------------------------
-PRIVATE vm_command_mapping get_command_mapping(uint8_t hex) {
-	int i = 0;
-	vm_command_mapping m = VM_COMMAND_MAPPING[i];
-	while (m.op_code != EOL) {
-		if (m.hex == hex) {
-			return m;
-		}
-		++i;
-		m = VM_COMMAND_MAPPING[i];
-	}
-	return NO_OP;
-}
-
 // ------------------------------------------
 // translate addressing mode
 // ------------------------------------------
@@ -1698,33 +3383,49 @@ PRIVATE vm_addressing_mode get_addressing_mode(const TokenList& tokens, uint16_t
 // -----------------------------------------------------------------
 // disassemble memory
 // -----------------------------------------------------------------
-void vm_disassemble(std::string& out) {
-	if (_internal_ctx != nullptr) {
-		int pc = 0x600;
-		int end = pc + _internal_ctx->numBytes;
-		char buffer[128];
-		while (pc < end) {
-			uint8_t hex = _internal_ctx->read(pc);
-			const vm_command_mapping& mapping = get_command_mapping(hex);
-			const vm_command& cmd = VM_COMMANDS[mapping.op_code];
-			switch (mapping.mode) {
-				case NONE: sprintf_s(buffer, "%s\r\n", cmd.name); break;
-				case IMMEDIDATE: sprintf_s(buffer,"%s #$%02X\r\n", cmd.name, _internal_ctx->read(pc + 1)); break;
-				case ABSOLUTE_ADR: sprintf_s(buffer, "%s $%04X\r\n", cmd.name, _internal_ctx->readInt(pc + 1)); break;
-				case ABSOLUTE_X: sprintf_s(buffer, "%s $%04X,X\r\n", cmd.name, _internal_ctx->readInt(pc + 1)); break;
-				case ABSOLUTE_Y: sprintf_s(buffer, "%s $%04X,Y\r\n", cmd.name, _internal_ctx->readInt(pc + 1)); break;
-				case ZERO_PAGE: sprintf_s(buffer, "%s $%02X\r\n", cmd.name, _internal_ctx->read(pc + 1)); break;
-				case ZERO_PAGE_X: sprintf_s(buffer, "%s $%02X,X\r\n", cmd.name, _internal_ctx->read(pc + 1)); break;
-				case ZERO_PAGE_Y: sprintf_s(buffer, "%s $%02X,Y\r\n", cmd.name, _internal_ctx->read(pc + 1)); break;
-				case INDIRECT_X: sprintf_s(buffer, "%s $(%04X),X\r\n", cmd.name, _internal_ctx->readInt(pc + 1)); break;
-				case INDIRECT_Y: sprintf_s(buffer, "%s $(%04X),Y\r\n", cmd.name, _internal_ctx->readInt(pc + 1)); break;
-				case RELATIVE_ADR: sprintf_s(buffer, "%s $%02X\r\n", cmd.name, _internal_ctx->read(pc + 1)); break;
-				case ACCUMULATOR: sprintf_s(buffer, "%s A\r\n", cmd.name); break;
-				default: sprintf_s(buffer, "???\r\n"); break;
+void vm_disassemble(vm_context* ctx, std::string& out) {
+	int pc = 0x600;
+	int end = pc + ctx->numBytes;
+	char buffer[128];
+	size_t label = 0;
+	while (pc < end) {
+		if (ctx->profile != nullptr) {
+			while (label < ctx->labels.size() && ctx->labels[label].pc <= pc) {
+				out += ctx->labels[label++].name + ":\r\n";
 			}
+			sprintf_s(buffer, "%12llu  ", (unsigned long long)ctx->profile[pc]);
 			out += buffer;
-			pc += VM_DATA_SIZE[mapping.mode] + 1;
 		}
+		const vm_decode_entry& entry = VM_DECODE_TABLE[ctx->read(pc)];
+		const char* name = get_command_name(entry.op_code);
+		switch (entry.mode) {
+			case NONE: sprintf_s(buffer, "%s\r\n", name); break;
+			case IMMEDIDATE: sprintf_s(buffer,"%s #$%02X\r\n", name, ctx->read(pc + 1)); break;
+			case ABSOLUTE_ADR: sprintf_s(buffer, "%s $%04X\r\n", name, ctx->readInt(pc + 1)); break;
+			case ABSOLUTE_X: sprintf_s(buffer, "%s $%04X,X\r\n", name, ctx->readInt(pc + 1)); break;
+			case ABSOLUTE_Y: sprintf_s(buffer, "%s $%04X,Y\r\n", name, ctx->readInt(pc + 1)); break;
+			case ZERO_PAGE: sprintf_s(buffer, "%s $%02X\r\n", name, ctx->read(pc + 1)); break;
+			case ZERO_PAGE_X: sprintf_s(buffer, "%s $%02X,X\r\n", name, ctx->read(pc + 1)); break;
+			case ZERO_PAGE_Y: sprintf_s(buffer, "%s $%02X,Y\r\n", name, ctx->read(pc + 1)); break;
+			case INDIRECT_X: sprintf_s(buffer, "%s ($%02X,X)\r\n", name, ctx->read(pc + 1)); break;
+			case INDIRECT_Y: sprintf_s(buffer, "%s ($%02X),Y\r\n", name, ctx->read(pc + 1)); break;
+			case RELATIVE_ADR: sprintf_s(buffer, "%s $%02X\r\n", name, ctx->read(pc + 1)); break;
+			case JMP_ABSOLUTE: sprintf_s(buffer, "%s $%04X\r\n", name, ctx->readInt(pc + 1)); break;
+			case JMP_INDIRECT: sprintf_s(buffer, "%s ($%04X)\r\n", name, ctx->readInt(pc + 1)); break;
+			case ACCUMULATOR: sprintf_s(buffer, "%s A\r\n", name); break;
+			default: sprintf_s(buffer, "???\r\n"); break;
+		}
+		out += buffer;
+		pc += entry.dataSize + 1;
+	}
+}
+
+// -----------------------------------------------------------------
+// disassemble memory
+// -----------------------------------------------------------------
+void vm_disassemble(std::string& out) {
+	if (_internal_ctx != nullptr) {
+		vm_disassemble(_internal_ctx, out);
 	}
 }
 	
@@ -1745,6 +3446,7 @@ PRIVATE int assemble(const TokenList& tokens, vm_context* ctx, uint16_t* numComm
 	uint16_t pc = 0x600;
 	std::vector<vm_label_definition> definitions;
 	std::vector<vm_label_definition> branches;
+	ctx->labels.clear();
 	for (size_t i = 0; i < tokens.size(); ++i) {
 		const vm_token& t = tokens[i];
 		//vm_log("%d = %s (line: %d)", i, translate_token_tpye(t), t.line);
@@ -1801,6 +3503,8 @@ PRIVATE int assemble(const TokenList& tokens, vm_context* ctx, uint16_t* numComm
 				def.pc = pc;
 				def.op_code = t.value;
 				definitions.push_back(def);
+				vm_label label = { std::string(t.text, t.length), pc };
+				ctx->labels.push_back(label);
 			}
 		}
 	}
@@ -1824,31 +3528,56 @@ PRIVATE int assemble(const TokenList& tokens, vm_context* ctx, uint16_t* numComm
 			}
 		}
 	}
+	VM_STATS(vm_stats_reset(ctx));
 	return pc - 0x600;
 }
 
 // ---------------------------------------------------------
 //  assemble file
 // ---------------------------------------------------------
-int vm_assemble_file(const char* fileName) {
-	if (_internal_ctx != nullptr) {
-		std::vector<vm_token> tokens;
-		const char* code = read_file(fileName);
-		if (code != 0) {
-			TokenList tokens;
-			if (vm_tokenize(code, tokens)) {
-				_internal_ctx->numBytes = assemble(tokens, _internal_ctx, &_internal_ctx->numCommands);
-				sprintf_s(_internal_ctx->debug, "Code successfully assembled - commands: %d bytes: %d", _internal_ctx->numCommands, _internal_ctx->numBytes);
-				return _internal_ctx->numBytes;
-			}
-			else {
-				sprintf_s(_internal_ctx->debug, "Cannot compile code");
-			}
-			delete[] code;
+int vm_assemble_file(vm_context* ctx, const char* fileName) {
+	std::vector<vm_token> tokens;
+	const char* code = read_file(fileName);
+	if (code != 0) {
+		TokenList tokens;
+		if (vm_tokenize(code, tokens)) {
+			ctx->numBytes = assemble(tokens, ctx, &ctx->numCommands);
+			sprintf_s(ctx->debug, "Code successfully assembled - commands: %d bytes: %d", ctx->numCommands, ctx->numBytes);
+			return ctx->numBytes;
 		}
 		else {
-			sprintf_s(_internal_ctx->debug, "Cannot laod file: '%s'", fileName);
+			sprintf_s(ctx->debug, "Cannot compile code");
 		}
+		delete[] code;
+	}
+	else {
+		sprintf_s(ctx->debug, "Cannot laod file: '%s'", fileName);
+	}
+	return 0;
+}
+
+// ---------------------------------------------------------
+//  assemble file
+// ---------------------------------------------------------
+int vm_assemble_file(const char* fileName) {
+	if (_internal_ctx != nullptr) {
+		return vm_assemble_file(_internal_ctx, fileName);
+	}
+	return 0;
+}
+
+// ---------------------------------------------------------
+//  assemble 
+// ---------------------------------------------------------
+int vm_assemble(vm_context* ctx, const char* code) {
+	TokenList tokens;
+	if (vm_tokenize(code,tokens)) {
+		ctx->numBytes = assemble(tokens, ctx, &ctx->numCommands);
+		sprintf_s(ctx->debug, "Code successfully assembled - commands: %d bytes: %d", ctx->numCommands, ctx->numBytes);
+		return ctx->numBytes;
+	}
+	else {
+		sprintf_s(ctx->debug, "Cannot compile code");
 	}
 	return 0;
 }
@@ -1858,15 +3587,7 @@ int vm_assemble_file(const char* fileName) {
 // ---------------------------------------------------------
 int vm_assemble(const char* code) {
 	if (_internal_ctx != nullptr) {
-		TokenList tokens;
-		if (vm_tokenize(code,tokens)) {
-			_internal_ctx->numBytes = assemble(tokens, _internal_ctx, &_internal_ctx->numCommands);
-			sprintf_s(_internal_ctx->debug, "Code successfully assembled - commands: %d bytes: %d", _internal_ctx->numCommands, _internal_ctx->numBytes);
-			return _internal_ctx->numBytes;
-		}
-		else {
-			sprintf_s(_internal_ctx->debug, "Cannot compile code");
-		}
+		return vm_assemble(_internal_ctx, code);
 	}
 	return 0;
 }
@@ -1874,6 +3595,14 @@ int vm_assemble(const char* code) {
 // -------------------------------------------------------- -
 //  dump registers and memory
 // ---------------------------------------------------------
+void vm_dump(vm_context* ctx, uint16_t pc, uint16_t num) {
+	vm_dump_registers(ctx);
+	vm_dump_memory(ctx, pc, num);
+}
+
+// ---------------------------------------------------------
+//  dump registers and memory
+// ---------------------------------------------------------
 void vm_dump(uint16_t pc, uint16_t num) {
 	vm_dump_registers();
 	vm_dump_memory(pc, num);
@@ -1882,182 +3611,3412 @@ void vm_dump(uint16_t pc, uint16_t num) {
 // ---------------------------------------------------------
 //  dump registers 
 // ---------------------------------------------------------
-void vm_dump_registers() {
-	if (_internal_ctx != nullptr) {
-		printf("------------- Dump -------------\n");
-		printf("A=$%02X ", _internal_ctx->registers[vm_registers::A]);
-		printf("X=$%02X ", _internal_ctx->registers[vm_registers::X]);
-		printf("Y=$%02X\n", _internal_ctx->registers[vm_registers::Y]);
-		printf("PC=$%04X ", _internal_ctx->programCounter);
-		printf("SP=$%02X\n", _internal_ctx->sp);
-		printf("CZIDBVN\n");
-		for (int i = 1; i < 8; ++i) {
-			if (_internal_ctx->isSet(i)) {
-				printf("1");
-			}
-			else {
-				printf("0");
-			}
+void vm_dump_registers(vm_context* ctx) {
+	printf("------------- Dump -------------\n");
+	printf("A=$%02X ", ctx->registers[vm_registers::A]);
+	printf("X=$%02X ", ctx->registers[vm_registers::X]);
+	printf("Y=$%02X\n", ctx->registers[vm_registers::Y]);
+	printf("PC=$%04X ", ctx->programCounter);
+	printf("SP=$%02X\n", ctx->sp);
+	printf("CZIDBVN\n");
+	for (int i = 1; i < 8; ++i) {
+		if (ctx->isSet(i)) {
+			printf("1");
+		}
+		else {
+			printf("0");
 		}
-		printf("\n");
 	}
+	printf("\n");
 }
 
 // ---------------------------------------------------------
-//  memory dump
+//  dump registers 
 // ---------------------------------------------------------
-void vm_dump_memory(uint16_t pc, uint16_t num) {
+void vm_dump_registers() {
 	if (_internal_ctx != nullptr) {
-		printf("---------- Memory dump -----------");
-		for (size_t i = 0; i < num; ++i) {
-			if (i % 8 == 0) {
-				printf("\n%04X : ", (pc + i));
-			}
-			printf("%02X ", _internal_ctx->read(pc + i));
-		}
-		printf("\n");
+		vm_dump_registers(_internal_ctx);
 	}
 }
 
 // ---------------------------------------------------------
-// get current data based on addressing mode
+//  memory dump
 // ---------------------------------------------------------
-PRIVATE int get_data(vm_context* ctx, const vm_addressing_mode& mode) {
-	int data = 0;
-	if (mode == IMMEDIDATE) {
-		data = ctx->read(ctx->programCounter + 1);
-	}
-	else if (mode == ABSOLUTE_ADR) {
-		uint8_t upper = ctx->read(ctx->programCounter + 2);
-		data = ctx->read(ctx->programCounter + 1) + (upper << 8);
-	}
-	else if (mode == ABSOLUTE_X) {
-		uint8_t upper = ctx->read(ctx->programCounter + 2);
-		data = ctx->read(ctx->programCounter + 1) + (upper << 8) + ctx->registers[vm_registers::X];
-	}
-	else if (mode == ABSOLUTE_Y) {
-		uint8_t upper = ctx->read(ctx->programCounter + 2);
-		data = ctx->read(ctx->programCounter + 1) + (upper << 8) + ctx->registers[vm_registers::Y];
-	}
-	else if (mode == ZERO_PAGE) {
-		data = ctx->read(ctx->programCounter + 1);
-	}
-	else if (mode == ZERO_PAGE_X) {
-		int tmp = ctx->read(ctx->programCounter + 1) + ctx->registers[vm_registers::X];
-		if (tmp > 255) {
-			tmp = abs(256 - tmp);
-		}
-		data = tmp;
-	}
-	else if (mode == ZERO_PAGE_Y) {
-		int tmp = ctx->read(ctx->programCounter + 1) + ctx->registers[vm_registers::Y];
-		if (tmp > 255) {
-			tmp = abs(256 - tmp);
+void vm_dump_memory(vm_context* ctx, uint16_t pc, uint16_t num) {
+	printf("---------- Memory dump -----------");
+	for (size_t i = 0; i < num; ++i) {
+		if (i % 8 == 0) {
+			printf("\n%04X : ", (unsigned int)(uint16_t)(pc + i));
 		}
-		data = tmp;
-	}
-	else if (mode == RELATIVE_ADR) {
-		data = ctx->read(ctx->programCounter + 1);
+		printf("%02X ", ctx->read(pc + i));
 	}
-	else if (mode == JMP_ABSOLUTE) {
-		data = ctx->readInt(ctx->programCounter + 1);
-	}
-	else if (mode == JMP_INDIRECT) {
-		data = ctx->readInt(ctx->readInt(ctx->programCounter + 1));
-	}
-	else if (mode == ACCUMULATOR) {
-		data = -1;
-	}
-	return data;
+	printf("\n");
 }
 
 // ---------------------------------------------------------
-//  internal execute single step
+//  memory dump
 // ---------------------------------------------------------
-PRIVATE bool vm_step() {
+void vm_dump_memory(uint16_t pc, uint16_t num) {
 	if (_internal_ctx != nullptr) {
-		// FIXME: check if we still have a valid PC
-		uint8_t cmdIdx = _internal_ctx->read(_internal_ctx->programCounter);
-		const vm_command_mapping& mapping = get_command_mapping(cmdIdx);
-		const vm_command& cmd = VM_COMMANDS[mapping.op_code];
-		vm_addressing_mode mode = mapping.mode;
-		int data = get_data(_internal_ctx, mode);
-		int add = VM_DATA_SIZE[mode] + 1;
-		(*cmd.function)(_internal_ctx, data, mode);
-		sprintf_s(_internal_ctx->debug,"%04X %s (%02X) data: %04X mode: %s add: %d\n", _internal_ctx->programCounter, cmd.name, cmdIdx, data, translate_addressing_mode(mode), add);
-		if (!cmd.modifyPC) {
-			_internal_ctx->programCounter += add;
-		}
-		if (mapping.op_code == BRK) {
-			return false;
-		}
-		return true;
+		vm_dump_memory(_internal_ctx, pc, num);
 	}
-	return false;
 }
 
 // ---------------------------------------------------------
-//  run program
+//  enable tracing
 // ---------------------------------------------------------
-void vm_run() {
-	if (_internal_ctx != nullptr) {
-		_internal_ctx->programCounter = 0x600;
-		int end = _internal_ctx->programCounter + _internal_ctx->numBytes;
-		bool running = true;
-		while (running) {
-			running = vm_step();
-			if (_internal_ctx->programCounter >= end) {
-				running = false;
-			}
-		}
-	}
+void vm_trace_enable(vm_context* ctx, uint32_t capacity) {
+	vm_trace_disable(ctx);
+	if (capacity > VM_TRACE_MAX_CAPACITY) {
+		capacity = VM_TRACE_MAX_CAPACITY;
+	}
+	uint32_t size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	vm_trace_buffer* trace = new vm_trace_buffer;
+	trace->records = new vm_trace_record[size];
+	trace->capacity = size;
+	trace->count = 0;
+	ctx->trace = trace;
 }
 
 // ---------------------------------------------------------
-//  load binary file
+//  disable tracing
 // ---------------------------------------------------------
-bool vm_load(const char* fileName) {
-	if (_internal_ctx != nullptr) {
-		int pc = 0x600;
-		FILE* fp = fopen(fileName, "rb");
-		if (fp) {
-			fread(&_internal_ctx->numBytes, sizeof(int), 1, fp);
-			fread(&_internal_ctx->numCommands, sizeof(int), 1, fp);
-			for (int i = 0; i < _internal_ctx->numBytes; ++i) {
-				uint8_t v;
-				fread(&v, sizeof(uint8_t), 1, fp);
-				_internal_ctx->write(pc + i, v);
-			}
-			fclose(fp);
-			sprintf_s(_internal_ctx->debug, "File '%s' loaded bytes: %d commands: %d\n", fileName, _internal_ctx->numBytes, _internal_ctx->numCommands);
-			return true;
-		}
-		sprintf_s(_internal_ctx->debug, "File '%s' not found", fileName);
+void vm_trace_disable(vm_context* ctx) {
+	if (ctx->trace != nullptr) {
+		delete[] ctx->trace->records;
+		delete ctx->trace;
+		ctx->trace = nullptr;
 	}
-	return false;
 }
 
 // ---------------------------------------------------------
-//  save binary file
+//  internal record one executed instruction
 // ---------------------------------------------------------
-bool vm_save(const char* fileName) {
-	if (_internal_ctx != nullptr) {
-		FILE* fp = fopen(fileName, "wb");
-		if (fp) {
-			int pc = 0x600;
-			fwrite(&_internal_ctx->numBytes, sizeof(int), 1, fp);
-			fwrite(&_internal_ctx->numCommands, sizeof(int), 1, fp);
-			for (int i = 0; i < _internal_ctx->numBytes; ++i) {
-				uint8_t v = _internal_ctx->read(pc + i);
-				fwrite(&v, sizeof(uint8_t), 1, fp);
-			}
-			fclose(fp);
-			sprintf_s(_internal_ctx->debug, "File %s written with %d num bytes", fileName, _internal_ctx->numBytes);
-			return true;
-		}
-	}
-	sprintf_s(_internal_ctx->debug, "Cannot write file %s", fileName);
-	return false;
+PRIVATE void vm_trace_record_step(vm_context* ctx, uint16_t pc, uint8_t opcode, int data) {
+	vm_trace_buffer* trace = ctx->trace;
+	vm_trace_record& r = trace->records[trace->count & (trace->capacity - 1)];
+	r.pc = pc;
+	r.data = data;
+	r.opcode = opcode;
+	r.registers[vm_registers::A] = ctx->registers[vm_registers::A];
+	r.registers[vm_registers::X] = ctx->registers[vm_registers::X];
+	r.registers[vm_registers::Y] = ctx->registers[vm_registers::Y];
+	r.sp = ctx->sp;
+	r.flags = ctx->getFlags();
+	++trace->count;
+}
+
+// ---------------------------------------------------------
+//  internal format one trace record
+// ---------------------------------------------------------
+PRIVATE void vm_trace_format_record(const vm_trace_record& r, char* buffer, size_t size) {
+	const vm_decode_entry& entry = VM_DECODE_TABLE[r.opcode];
+	sprintf_s(buffer, size, "%04X %s (%02X) data: %04X mode: %s A=$%02X X=$%02X Y=$%02X SP=$%02X P=$%02X\n",
+		r.pc, get_command_name(entry.op_code), r.opcode, r.data, translate_addressing_mode(entry.mode),
+		r.registers[vm_registers::A], r.registers[vm_registers::X], r.registers[vm_registers::Y], r.sp, r.flags);
+}
+
+// ---------------------------------------------------------
+//  format all recorded instructions oldest first
+// ---------------------------------------------------------
+int vm_trace_format(vm_context* ctx, std::string& out) {
+	if (ctx->trace == nullptr) {
+		return 0;
+	}
+	const vm_trace_buffer* trace = ctx->trace;
+	uint32_t num = trace->count < trace->capacity ? trace->count : trace->capacity;
+	char buffer[128];
+	for (uint32_t i = trace->count - num; i != trace->count; ++i) {
+		vm_trace_format_record(trace->records[i & (trace->capacity - 1)], buffer, sizeof(buffer));
+		out += buffer;
+	}
+	return num;
+}
+
+// ---------------------------------------------------------
+//  format the last recorded instruction into debug
+// ---------------------------------------------------------
+const char* vm_trace_last(vm_context* ctx) {
+	ctx->debug[0] = '\0';
+	if (ctx->trace != nullptr && ctx->trace->count > 0) {
+		const vm_trace_buffer* trace = ctx->trace;
+		vm_trace_format_record(trace->records[(trace->count - 1) & (trace->capacity - 1)], ctx->debug, sizeof(ctx->debug));
+	}
+	return ctx->debug;
+}
+
+// ---------------------------------------------------------
+//  enable profiler
+// ---------------------------------------------------------
+void vm_profile_enable(vm_context* ctx) {
+	if (ctx->profile == nullptr) {
+		ctx->profile = new uint64_t[65536];
+		vm_profile_clear(ctx);
+	}
+}
+
+// ---------------------------------------------------------
+//  disable profiler
+// ---------------------------------------------------------
+void vm_profile_disable(vm_context* ctx) {
+	delete[] ctx->profile;
+	ctx->profile = nullptr;
+}
+
+// ---------------------------------------------------------
+//  clear profiler
+// ---------------------------------------------------------
+void vm_profile_clear(vm_context* ctx) {
+	if (ctx->profile != nullptr) {
+		memset(ctx->profile, 0, 65536 * sizeof(uint64_t));
+	}
+}
+
+// ---------------------------------------------------------
+//  internal index of the label containing the address
+//  plus one. 0 means the address is before all labels.
+// ---------------------------------------------------------
+PRIVATE int vm_profile_label(const vm_context* ctx, uint16_t address) {
+	int idx = 0;
+	while (idx < (int)ctx->labels.size() && ctx->labels[idx].pc <= address) {
+		++idx;
+	}
+	return idx;
+}
+
+// ---------------------------------------------------------
+//  internal entry of the report. Sorted by count with the
+//  largest count first.
+// ---------------------------------------------------------
+typedef struct vm_profile_entry {
+	uint64_t count;
+	int index;
+
+	bool operator<(const vm_profile_entry& other) const {
+		if (count != other.count) {
+			return count > other.count;
+		}
+		return index < other.index;
+	}
+} vm_profile_entry;
+
+// ---------------------------------------------------------
+//  report labels and hottest addresses
+// ---------------------------------------------------------
+int vm_profile_report(const vm_context* ctx, std::string& out, int max) {
+	if (ctx->profile == nullptr) {
+		return 0;
+	}
+	std::vector<vm_profile_entry> labels(ctx->labels.size() + 1);
+	for (size_t i = 0; i < labels.size(); ++i) {
+		labels[i].count = 0;
+		labels[i].index = (int)i;
+	}
+	std::vector<vm_profile_entry> addresses;
+	uint64_t total = 0;
+	for (int i = 0; i < 65536; ++i) {
+		if (ctx->profile[i] != 0) {
+			vm_profile_entry entry = { ctx->profile[i], i };
+			addresses.push_back(entry);
+			labels[vm_profile_label(ctx, i)].count += ctx->profile[i];
+			total += ctx->profile[i];
+		}
+	}
+	std::sort(labels.begin(), labels.end());
+	std::sort(addresses.begin(), addresses.end());
+	double scale = total > 0 ? 100.0 / total : 0.0;
+	char buffer[256];
+	sprintf_s(buffer, "%12s %7s  %s\n", "count", "%", "label");
+	out += buffer;
+	for (size_t i = 0; i < labels.size() && labels[i].count > 0; ++i) {
+		const char* name = labels[i].index > 0 ? ctx->labels[labels[i].index - 1].name.c_str() : "-";
+		sprintf_s(buffer, "%12llu %7.2f  %s\n", (unsigned long long)labels[i].count, labels[i].count * scale, name);
+		out += buffer;
+	}
+	sprintf_s(buffer, "%12s %7s  %s\n", "count", "%", "address");
+	out += buffer;
+	int num = max < (int)addresses.size() ? max : (int)addresses.size();
+	for (int i = 0; i < num; ++i) {
+		uint16_t pc = addresses[i].index;
+		int label = vm_profile_label(ctx, pc);
+		const char* name = get_command_name(VM_DECODE_TABLE[ctx->fetch(pc)].op_code);
+		if (label > 0) {
+			const vm_label& l = ctx->labels[label - 1];
+			sprintf_s(buffer, "%12llu %7.2f  $%04X %s+%d %s\n", (unsigned long long)addresses[i].count, addresses[i].count * scale, pc, l.name.c_str(), pc - l.pc, name);
+		}
+		else {
+			sprintf_s(buffer, "%12llu %7.2f  $%04X %s\n", (unsigned long long)addresses[i].count, addresses[i].count * scale, pc, name);
+		}
+		out += buffer;
+	}
+	return num;
+}
+
+// ---------------------------------------------------------
+//  enable call graph
+// ---------------------------------------------------------
+void vm_call_graph_enable(vm_context* ctx) {
+	if (ctx->callGraph == nullptr) {
+		ctx->callGraph = new vm_call_graph;
+		ctx->callGraph->current = vm_call_graph_add(ctx->callGraph, -1, ctx->programCounter);
+		ctx->callGraph->overflow = 0;
+	}
+}
+
+// ---------------------------------------------------------
+//  disable call graph
+// ---------------------------------------------------------
+void vm_call_graph_disable(vm_context* ctx) {
+	delete ctx->callGraph;
+	ctx->callGraph = nullptr;
+}
+
+// ---------------------------------------------------------
+//  clear call graph
+// ---------------------------------------------------------
+void vm_call_graph_clear(vm_context* ctx) {
+	if (ctx->callGraph != nullptr) {
+		for (size_t i = 0; i < ctx->callGraph->nodes.size(); ++i) {
+			ctx->callGraph->nodes[i].count = 0;
+			ctx->callGraph->nodes[i].calls = 0;
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  internal name of a node. Subroutines use the label at
+//  their address or the address itself.
+// ---------------------------------------------------------
+PRIVATE std::string vm_call_graph_name(const vm_context* ctx, int node) {
+	if (node == 0) {
+		return "main";
+	}
+	uint16_t address = ctx->callGraph->nodes[node].address;
+	for (size_t i = 0; i < ctx->labels.size(); ++i) {
+		if (ctx->labels[i].pc == address) {
+			return ctx->labels[i].name;
+		}
+	}
+	char buffer[8];
+	sprintf_s(buffer, "$%04X", address);
+	return buffer;
+}
+
+// ---------------------------------------------------------
+//  report inclusive and exclusive counts per subroutine
+// ---------------------------------------------------------
+int vm_call_graph_report(const vm_context* ctx, std::string& out) {
+	if (ctx->callGraph == nullptr) {
+		return 0;
+	}
+	const std::vector<vm_call_node>& nodes = ctx->callGraph->nodes;
+	// children are always added after their parent
+	std::vector<uint64_t> inclusive(nodes.size());
+	for (size_t i = nodes.size(); i-- > 0;) {
+		inclusive[i] += nodes[i].count;
+		if (nodes[i].parent >= 0) {
+			inclusive[nodes[i].parent] += inclusive[i];
+		}
+	}
+	// main plus one entry per subroutine address
+	std::vector<int> subroutines(65536, -1);
+	std::vector<int> names;
+	std::vector<vm_profile_entry> entries;
+	std::vector<uint64_t> exclusive;
+	std::vector<uint64_t> calls;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		int idx = i == 0 ? -1 : subroutines[nodes[i].address];
+		if (idx < 0) {
+			idx = (int)entries.size();
+			vm_profile_entry entry = { 0, idx };
+			entries.push_back(entry);
+			names.push_back((int)i);
+			exclusive.push_back(0);
+			calls.push_back(0);
+			if (i > 0) {
+				subroutines[nodes[i].address] = idx;
+			}
+		}
+		// a recursive call is already part of the outer call
+		bool recursive = false;
+		for (int p = nodes[i].parent; p > 0 && !recursive; p = nodes[p].parent) {
+			recursive = nodes[p].address == nodes[i].address;
+		}
+		if (!recursive) {
+			entries[idx].count += inclusive[i];
+		}
+		exclusive[idx] += nodes[i].count;
+		calls[idx] += nodes[i].calls;
+	}
+	std::sort(entries.begin(), entries.end());
+	char buffer[256];
+	sprintf_s(buffer, "%12s %12s %10s  %s\n", "inclusive", "exclusive", "calls", "subroutine");
+	out += buffer;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		int idx = entries[i].index;
+		std::string name = vm_call_graph_name(ctx, names[idx]);
+		sprintf_s(buffer, "%12llu %12llu %10llu  %s\n", (unsigned long long)entries[i].count, (unsigned long long)exclusive[idx], (unsigned long long)calls[idx], name.c_str());
+		out += buffer;
+	}
+	return (int)entries.size() - 1;
+}
+
+// ---------------------------------------------------------
+//  folded call stacks
+// ---------------------------------------------------------
+void vm_call_graph_folded(const vm_context* ctx, std::string& out) {
+	if (ctx->callGraph == nullptr) {
+		return;
+	}
+	const std::vector<vm_call_node>& nodes = ctx->callGraph->nodes;
+	std::vector<std::string> names(nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		names[i] = vm_call_graph_name(ctx, (int)i);
+	}
+	char buffer[32];
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		if (nodes[i].count == 0) {
+			continue;
+		}
+		std::string stack = names[i];
+		for (int p = nodes[i].parent; p >= 0; p = nodes[p].parent) {
+			stack = names[p] + ";" + stack;
+		}
+		sprintf_s(buffer, " %llu\n", (unsigned long long)nodes[i].count);
+		out += stack;
+		out += buffer;
+	}
+}
+
+// ---------------------------------------------------------
+//  write folded call stacks to a file
+// ---------------------------------------------------------
+bool vm_call_graph_save(vm_context* ctx, const char* fileName) {
+	std::string stacks;
+	vm_call_graph_folded(ctx, stacks);
+	FILE* fp = fopen(fileName, "wb");
+	if (fp) {
+		fwrite(stacks.c_str(), 1, stacks.size(), fp);
+		fclose(fp);
+		return true;
+	}
+	sprintf_s(ctx->debug, "Cannot write file '%s'", fileName);
+	return false;
+}
+
+
+#if defined(VM_STATS_SUPPORT)
+// ---------------------------------------------------------
+//  reset statistics
+// ---------------------------------------------------------
+void vm_stats_reset(vm_context* ctx) {
+	memset(&ctx->stats, 0, sizeof(vm_stats));
+}
+
+// ---------------------------------------------------------
+//  format statistics
+// ---------------------------------------------------------
+int vm_stats_format(const vm_context* ctx, std::string& out) {
+	const vm_stats& stats = ctx->stats;
+	char buffer[256];
+	sprintf_s(buffer, "instructions       %12llu\n", (unsigned long long)stats.instructions);
+	out += buffer;
+	sprintf_s(buffer, "branches taken     %12llu\n", (unsigned long long)stats.branchesTaken);
+	out += buffer;
+	sprintf_s(buffer, "branches not taken %12llu\n", (unsigned long long)stats.branchesNotTaken);
+	out += buffer;
+	sprintf_s(buffer, "reads              %12llu\n", (unsigned long long)stats.reads);
+	out += buffer;
+	sprintf_s(buffer, "writes             %12llu\n", (unsigned long long)stats.writes);
+	out += buffer;
+	sprintf_s(buffer, "pushes             %12llu\n", (unsigned long long)stats.pushes);
+	out += buffer;
+	sprintf_s(buffer, "pops               %12llu\n", (unsigned long long)stats.pops);
+	out += buffer;
+	sprintf_s(buffer, "max stack depth    %12u\n", stats.maxStackDepth);
+	out += buffer;
+	std::vector<vm_profile_entry> opcodes;
+	for (int i = 0; i < 256; ++i) {
+		if (stats.opcodes[i] != 0) {
+			vm_profile_entry entry = { stats.opcodes[i], i };
+			opcodes.push_back(entry);
+		}
+	}
+	std::sort(opcodes.begin(), opcodes.end());
+	sprintf_s(buffer, "%12s  %s\n", "count", "opcode");
+	out += buffer;
+	for (size_t i = 0; i < opcodes.size(); ++i) {
+		const char* name = get_command_name(VM_DECODE_TABLE[opcodes[i].index].op_code);
+		sprintf_s(buffer, "%12llu  $%02X %s\n", (unsigned long long)opcodes[i].count, opcodes[i].index, name);
+		out += buffer;
+	}
+	return (int)opcodes.size();
+}
+#endif
+// ---------------------------------------------------------
+// address stored at zp for (zp,X) and (zp),Y. The pointer
+// wraps around inside the zero page.
+// ---------------------------------------------------------
+PRIVATE inline int vm_indirect_address(const vm_context* ctx, uint8_t zp) {
+	return ctx->read(zp) + (ctx->read((uint8_t)(zp + 1)) << 8);
+}
+
+// ---------------------------------------------------------
+// get current data based on addressing mode
+// ---------------------------------------------------------
+PRIVATE int get_data(vm_context* ctx, const vm_addressing_mode& mode) {
+	int data = 0;
+	if (mode == IMMEDIDATE) {
+		data = ctx->fetch(ctx->programCounter + 1);
+	}
+	else if (mode == ABSOLUTE_ADR) {
+		uint8_t upper = ctx->fetch(ctx->programCounter + 2);
+		data = ctx->fetch(ctx->programCounter + 1) + (upper << 8);
+	}
+	else if (mode == ABSOLUTE_X) {
+		uint8_t upper = ctx->fetch(ctx->programCounter + 2);
+		data = ctx->fetch(ctx->programCounter + 1) + (upper << 8) + ctx->registers[vm_registers::X];
+	}
+	else if (mode == ABSOLUTE_Y) {
+		uint8_t upper = ctx->fetch(ctx->programCounter + 2);
+		data = ctx->fetch(ctx->programCounter + 1) + (upper << 8) + ctx->registers[vm_registers::Y];
+	}
+	else if (mode == ZERO_PAGE) {
+		data = ctx->fetch(ctx->programCounter + 1);
+	}
+	else if (mode == ZERO_PAGE_X) {
+		int tmp = ctx->fetch(ctx->programCounter + 1) + ctx->registers[vm_registers::X];
+		if (tmp > 255) {
+			tmp = abs(256 - tmp);
+		}
+		data = tmp;
+	}
+	else if (mode == ZERO_PAGE_Y) {
+		int tmp = ctx->fetch(ctx->programCounter + 1) + ctx->registers[vm_registers::Y];
+		if (tmp > 255) {
+			tmp = abs(256 - tmp);
+		}
+		data = tmp;
+	}
+	else if (mode == RELATIVE_ADR) {
+		data = ctx->fetch(ctx->programCounter + 1);
+	}
+	else if (mode == JMP_ABSOLUTE) {
+		data = ctx->fetchInt(ctx->programCounter + 1);
+	}
+	else if (mode == JMP_INDIRECT) {
+		data = ctx->readInt(ctx->fetchInt(ctx->programCounter + 1));
+	}
+	else if (mode == INDIRECT_X) {
+		data = vm_indirect_address(ctx, (uint8_t)(ctx->fetch(ctx->programCounter + 1) + ctx->registers[vm_registers::X]));
+	}
+	else if (mode == INDIRECT_Y) {
+		data = (vm_indirect_address(ctx, ctx->fetch(ctx->programCounter + 1)) + ctx->registers[vm_registers::Y]) & 0xFFFF;
+	}
+	else if (mode == ACCUMULATOR) {
+		data = -1;
+	}
+	return data;
+}
+
+// ---------------------------------------------------------
+//  additional cycle if an indexed address crosses a page
+// ---------------------------------------------------------
+PRIVATE inline int vm_page_penalty(const vm_context* ctx, uint16_t pc, vm_addressing_mode mode, int data) {
+	if (mode == ABSOLUTE_X || mode == ABSOLUTE_Y) {
+		int base = ctx->fetch(pc + 1) + (ctx->fetch(pc + 2) << 8);
+		return ((base ^ data) & 0xFF00) != 0 ? 1 : 0;
+	}
+	if (mode == INDIRECT_Y) {
+		int base = (data - ctx->registers[vm_registers::Y]) & 0xFFFF;
+		return ((base ^ data) & 0xFF00) != 0 ? 1 : 0;
+	}
+	return 0;
+}
+
+// ---------------------------------------------------------
+//  additional cycles of a branch. One if the branch was
+//  taken and two if it jumps to another page.
+// ---------------------------------------------------------
+PRIVATE inline int vm_branch_penalty(uint16_t next, uint16_t target) {
+	if (target == next) {
+		return 0;
+	}
+	return ((next ^ target) & 0xFF00) != 0 ? 2 : 1;
+}
+
+// ---------------------------------------------------------
+//  flag tested by a branch and if it branches when set
+// ---------------------------------------------------------
+PRIVATE void vm_branch_condition(vm_opcode op, int* flag, bool* set) {
+	switch (op) {
+		case BNE: *flag = vm_flags::Z; *set = false; break;
+		case BEQ: *flag = vm_flags::Z; *set = true; break;
+		case BPL: *flag = vm_flags::N; *set = false; break;
+		case BMI: *flag = vm_flags::N; *set = true; break;
+		case BVC: *flag = vm_flags::V; *set = false; break;
+		case BVS: *flag = vm_flags::V; *set = true; break;
+		case BCC: *flag = vm_flags::C; *set = false; break;
+		default: *flag = vm_flags::C; *set = true; break;
+	}
+}
+
+// ---------------------------------------------------------
+//  execute single step
+// ---------------------------------------------------------
+bool vm_step(vm_context* ctx) {
+	// FIXME: check if we still have a valid PC
+	uint8_t cmdIdx = ctx->fetch(ctx->programCounter);
+	const vm_decode_entry& entry = VM_DECODE_TABLE[cmdIdx];
+	vm_addressing_mode mode = entry.mode;
+	int data = get_data(ctx, mode);
+	int add = entry.dataSize + 1;
+	uint16_t pc = ctx->programCounter;
+	int cycles = entry.cycles;
+	if (entry.pageCross) {
+		cycles += vm_page_penalty(ctx, pc, mode, data);
+	}
+	if (ctx->profile != nullptr) {
+		++ctx->profile[pc];
+	}
+	if (ctx->callGraph != nullptr) {
+		vm_call_graph_count(ctx->callGraph);
+	}
+	VM_STATS(++ctx->stats.instructions);
+	VM_STATS(++ctx->stats.opcodes[cmdIdx]);
+	// without a handler BRK ends the program
+	bool running = true;
+	if (entry.op_code == BRK) {
+		running = vm_has_brk_handler(ctx);
+		vm_brk(ctx, running);
+	}
+	else {
+		(*entry.function)(ctx, data, mode);
+	}
+	if (mode == RELATIVE_ADR) {
+		cycles += vm_branch_penalty(pc + 2, ctx->programCounter);
+	}
+	ctx->cycles += cycles;
+	if (ctx->trace != nullptr) {
+		vm_trace_record_step(ctx, pc, cmdIdx, data);
+	}
+	if (!entry.modifyPC) {
+		ctx->programCounter += add;
+	}
+	return running;
+}
+
+// ---------------------------------------------------------
+//  internal execute single step
+// ---------------------------------------------------------
+bool vm_step() {
+	if (_internal_ctx != nullptr) {
+		return vm_step(_internal_ctx);
+	}
+	return false;
+}
+
+// ---------------------------------------------------------
+// Block cache
+//
+// A block is a straight-line run of instructions ending
+// at the next branch, jump, return or BRK. Every op has the
+// handler and the operand resolved as far as possible. Only
+// the index registers and the JMP indirect pointer are
+// added at runtime.
+// ---------------------------------------------------------
+const static int VM_BLOCK_MAX_OPS = 64;
+
+typedef struct vm_block_op {
+	commandFunc function;
+	vm_addressing_mode mode;
+	int data;
+	uint8_t opcode;
+	uint8_t size;
+	uint8_t cycles;
+	bool pageCross;
+	bool modifyPC;
+} vm_block_op;
+
+typedef struct vm_block {
+	uint16_t start;
+	int end;
+	std::vector<vm_block_op> ops;
+} vm_block;
+
+// ---------------------------------------------------------
+// blocks holds the block starting at every address. pages
+// holds the start addresses of all blocks covering a page.
+// Invalidated blocks are kept in retired until the run
+// loop does not use them anymore. generation changes on
+// every invalidation.
+// ---------------------------------------------------------
+struct vm_block_cache {
+	std::vector<vm_block*> blocks;
+	std::vector<uint16_t> pages[256];
+	std::vector<vm_block*> retired;
+	uint32_t generation;
+};
+
+// ---------------------------------------------------------
+//  enable block cache
+// ---------------------------------------------------------
+void vm_block_cache_enable(vm_context* ctx) {
+	if (ctx->blockCache == nullptr) {
+		ctx->blockCache = new vm_block_cache;
+		ctx->blockCache->blocks.resize(65536, nullptr);
+		ctx->blockCache->generation = 0;
+	}
+}
+
+// ---------------------------------------------------------
+//  free all retired blocks
+// ---------------------------------------------------------
+PRIVATE void vm_block_cache_release_retired(vm_block_cache* cache) {
+	for (size_t i = 0; i < cache->retired.size(); ++i) {
+		delete cache->retired[i];
+	}
+	cache->retired.clear();
+}
+
+// ---------------------------------------------------------
+//  flush block cache
+// ---------------------------------------------------------
+void vm_block_cache_flush(vm_context* ctx) {
+	vm_block_cache* cache = ctx->blockCache;
+	if (cache != nullptr) {
+		for (size_t i = 0; i < cache->blocks.size(); ++i) {
+			if (cache->blocks[i] != nullptr) {
+				cache->retired.push_back(cache->blocks[i]);
+				cache->blocks[i] = nullptr;
+			}
+		}
+		for (int i = 0; i < 256; ++i) {
+			cache->pages[i].clear();
+		}
+		++cache->generation;
+	}
+}
+
+// ---------------------------------------------------------
+//  disable block cache
+// ---------------------------------------------------------
+void vm_block_cache_disable(vm_context* ctx) {
+	if (ctx->blockCache != nullptr) {
+		vm_block_cache_flush(ctx);
+		vm_block_cache_release_retired(ctx->blockCache);
+		delete ctx->blockCache;
+		ctx->blockCache = nullptr;
+	}
+}
+
+// ---------------------------------------------------------
+//  remove block from cache
+// ---------------------------------------------------------
+PRIVATE void vm_block_cache_remove(vm_block_cache* cache, vm_block* block) {
+	int last = (block->end - 1) >> 8;
+	for (int p = block->start >> 8; p <= last && p < 256; ++p) {
+		std::vector<uint16_t>& page = cache->pages[p];
+		for (size_t i = 0; i < page.size(); ++i) {
+			if (page[i] == block->start) {
+				page.erase(page.begin() + i);
+				break;
+			}
+		}
+	}
+	cache->blocks[block->start] = nullptr;
+	cache->retired.push_back(block);
+	++cache->generation;
+}
+
+// ---------------------------------------------------------
+//  invalidate all blocks covering the address
+// ---------------------------------------------------------
+void vm_block_cache_invalidate(vm_context* ctx, uint16_t address) {
+	vm_block_cache* cache = ctx->blockCache;
+	std::vector<uint16_t>& page = cache->pages[address >> 8];
+	size_t i = 0;
+	while (i < page.size()) {
+		vm_block* block = cache->blocks[page[i]];
+		if (address >= block->start && address < block->end) {
+			// removes page[i] so the next block moves to i
+			vm_block_cache_remove(cache, block);
+		}
+		else {
+			++i;
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  operand of an op as far as it is known at decode time
+// ---------------------------------------------------------
+PRIVATE int vm_block_operand(const vm_context* ctx, uint16_t pc, vm_addressing_mode mode) {
+	switch (mode) {
+		case IMMEDIDATE: case ZERO_PAGE: case ZERO_PAGE_X: case ZERO_PAGE_Y: case RELATIVE_ADR: case INDIRECT_X: case INDIRECT_Y:
+			return ctx->fetch(pc + 1);
+		case ABSOLUTE_ADR: case ABSOLUTE_X: case ABSOLUTE_Y: case JMP_ABSOLUTE: case JMP_INDIRECT:
+			return ctx->fetchInt(pc + 1);
+		case ACCUMULATOR:
+			return -1;
+		default:
+			return 0;
+	}
+}
+
+// ---------------------------------------------------------
+//  resolve the remaining part of the operand. This matches
+//  get_data.
+// ---------------------------------------------------------
+PRIVATE inline int vm_block_data(const vm_context* ctx, const vm_block_op& op) {
+	int tmp = 0;
+	switch (op.mode) {
+		case ABSOLUTE_X:
+			return op.data + ctx->registers[vm_registers::X];
+		case ABSOLUTE_Y:
+			return op.data + ctx->registers[vm_registers::Y];
+		case ZERO_PAGE_X:
+			tmp = op.data + ctx->registers[vm_registers::X];
+			return tmp > 255 ? abs(256 - tmp) : tmp;
+		case ZERO_PAGE_Y:
+			tmp = op.data + ctx->registers[vm_registers::Y];
+			return tmp > 255 ? abs(256 - tmp) : tmp;
+		case JMP_INDIRECT:
+			return ctx->readInt(op.data);
+		case INDIRECT_X:
+			return vm_indirect_address(ctx, (uint8_t)(op.data + ctx->registers[vm_registers::X]));
+		case INDIRECT_Y:
+			return (vm_indirect_address(ctx, (uint8_t)op.data) + ctx->registers[vm_registers::Y]) & 0xFFFF;
+		default:
+			return op.data;
+	}
+}
+
+// ---------------------------------------------------------
+//  decode the block starting at pc and add it to the cache
+// ---------------------------------------------------------
+PRIVATE vm_block* vm_block_decode(vm_context* ctx, uint16_t pc, int end) {
+	vm_block_cache* cache = ctx->blockCache;
+	vm_block* block = new vm_block;
+	block->start = pc;
+	int current = pc;
+	bool decoding = true;
+	while (decoding) {
+		uint8_t hex = ctx->fetch(current);
+		const vm_decode_entry& entry = VM_DECODE_TABLE[hex];
+		vm_block_op op;
+		op.function = entry.function;
+		op.mode = entry.mode;
+		op.data = vm_block_operand(ctx, current, entry.mode);
+		op.opcode = hex;
+		op.size = entry.dataSize + 1;
+		op.cycles = entry.cycles;
+		op.pageCross = entry.pageCross;
+		op.modifyPC = entry.modifyPC;
+		block->ops.push_back(op);
+		current += op.size;
+		if (entry.modifyPC || entry.mode == RELATIVE_ADR || entry.op_code == BRK || entry.op_code == RTI) {
+			decoding = false;
+		}
+		if (current >= end || current > 0xFFFF || (int)block->ops.size() >= VM_BLOCK_MAX_OPS) {
+			decoding = false;
+		}
+	}
+	block->end = current;
+	int last = (block->end - 1) >> 8;
+	for (int p = block->start >> 8; p <= last && p < 256; ++p) {
+		cache->pages[p].push_back(block->start);
+	}
+	cache->blocks[pc] = block;
+	return block;
+}
+
+// ---------------------------------------------------------
+//  run loop using the block cache. Executes the
+//  instructions like vm_step but without decoding them
+//  again. Events and interrupts are only checked at the
+//  block boundaries, so they may be taken a few
+//  instructions later than with vm_step.
+// ---------------------------------------------------------
+PRIVATE void vm_run_blocks(vm_context* ctx) {
+	vm_block_cache* cache = ctx->blockCache;
+	int end = 0x600 + ctx->numBytes;
+	bool running = ctx->programCounter < end;
+	while (running) {
+		if (ctx->cycles >= ctx->nextEvent) {
+			vm_dispatch_events(ctx);
+			if (ctx->programCounter >= end || ctx->stopRequested) {
+				break;
+			}
+		}
+		vm_block* block = cache->blocks[ctx->programCounter];
+		if (block == nullptr) {
+			block = vm_block_decode(ctx, ctx->programCounter, end);
+		}
+		uint32_t generation = cache->generation;
+		for (size_t i = 0; i < block->ops.size(); ++i) {
+			const vm_block_op& op = block->ops[i];
+			uint16_t pc = ctx->programCounter;
+			int data = vm_block_data(ctx, op);
+			int cycles = op.cycles;
+			if (op.pageCross) {
+				cycles += vm_page_penalty(ctx, pc, op.mode, data);
+			}
+			bool stop = op.opcode == 0x00 && !vm_has_brk_handler(ctx);
+			if (ctx->profile != nullptr) {
+				++ctx->profile[pc];
+			}
+			if (ctx->callGraph != nullptr) {
+				vm_call_graph_count(ctx->callGraph);
+			}
+			VM_STATS(++ctx->stats.instructions);
+			VM_STATS(++ctx->stats.opcodes[op.opcode]);
+			if (op.opcode == 0x00) {
+				vm_brk(ctx, !stop);
+			}
+			else {
+				(*op.function)(ctx, data, op.mode);
+			}
+			if (op.mode == RELATIVE_ADR) {
+				cycles += vm_branch_penalty(pc + 2, ctx->programCounter);
+			}
+			ctx->cycles += cycles;
+			if (ctx->trace != nullptr) {
+				vm_trace_record_step(ctx, pc, op.opcode, data);
+			}
+			if (!op.modifyPC) {
+				ctx->programCounter += op.size;
+			}
+			if (stop || ctx->programCounter >= end || ctx->stopRequested) {
+				running = false;
+				break;
+			}
+			// the block might have been overwritten
+			if (cache->generation != generation) {
+				break;
+			}
+		}
+		vm_block_cache_release_retired(cache);
+	}
+}
+
+// ---------------------------------------------------------
+//  run program
+// ---------------------------------------------------------
+void vm_run(vm_context* ctx) {
+	ctx->programCounter = 0x600;
+	ctx->stopRequested = false;
+	if (ctx->blockCache != nullptr) {
+		vm_run_blocks(ctx);
+		return;
+	}
+	int end = ctx->programCounter + ctx->numBytes;
+	bool running = true;
+	while (running) {
+		running = vm_step(ctx);
+		if (running && ctx->cycles >= ctx->nextEvent) {
+			vm_dispatch_events(ctx);
+			running = !ctx->stopRequested;
+		}
+		if (ctx->programCounter >= end) {
+			running = false;
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  run program
+// ---------------------------------------------------------
+void vm_run() {
+	if (_internal_ctx != nullptr) {
+		vm_run(_internal_ctx);
+	}
+}
+
+// ---------------------------------------------------------
+//  internal get data for the fast run loop. The mode is
+//  always a constant so the compiler folds the switch away.
+// ---------------------------------------------------------
+PRIVATE inline int vm_fast_data(const vm_context* ctx, uint16_t pc, vm_addressing_mode mode) {
+	switch (mode) {
+		case IMMEDIDATE: case ZERO_PAGE: case RELATIVE_ADR:
+			return ctx->mem[(uint16_t)(pc + 1)];
+		case ABSOLUTE_ADR: case JMP_ABSOLUTE:
+			return ctx->mem[(uint16_t)(pc + 1)] + (ctx->mem[(uint16_t)(pc + 2)] << 8);
+		case ABSOLUTE_X:
+			return ctx->mem[(uint16_t)(pc + 1)] + (ctx->mem[(uint16_t)(pc + 2)] << 8) + ctx->registers[vm_registers::X];
+		case ABSOLUTE_Y:
+			return ctx->mem[(uint16_t)(pc + 1)] + (ctx->mem[(uint16_t)(pc + 2)] << 8) + ctx->registers[vm_registers::Y];
+		case ZERO_PAGE_X:
+			return (ctx->mem[(uint16_t)(pc + 1)] + ctx->registers[vm_registers::X]) & 0xFF;
+		case ZERO_PAGE_Y:
+			return (ctx->mem[(uint16_t)(pc + 1)] + ctx->registers[vm_registers::Y]) & 0xFF;
+		case JMP_INDIRECT:
+			return ctx->readInt(ctx->fetchInt(pc + 1));
+		case INDIRECT_X:
+			return vm_indirect_address(ctx, (uint8_t)(ctx->mem[(uint16_t)(pc + 1)] + ctx->registers[vm_registers::X]));
+		case INDIRECT_Y:
+			return (vm_indirect_address(ctx, ctx->mem[(uint16_t)(pc + 1)]) + ctx->registers[vm_registers::Y]) & 0xFFFF;
+		case ACCUMULATOR:
+			return -1;
+		default:
+			return 0;
+	}
+}
+
+// ---------------------------------------------------------
+//  The fast loop reads the instructions from mem directly.
+//  All pages from codeStart up to the end of the program
+//  are kept private, so only jumps below codeStart need to
+//  copy more pages. Returns the new codeStart.
+// ---------------------------------------------------------
+PRIVATE int vm_unshare_code(vm_context* ctx, int start, int end) {
+	int last = end + 1 > 0xFFFF ? 0xFF : (end + 1) >> 8;
+	for (int i = start >> 8; i <= last; ++i) {
+		if (ctx->sharedPages[i] != nullptr) {
+			vm_unshare_page(ctx, i);
+		}
+	}
+	return start & 0xFF00;
+}
+
+// ---------------------------------------------------------
+//  Size of the code the fast loop runs without checks. It
+//  is 0 with breakpoints, the profiler or the call graph.
+// ---------------------------------------------------------
+PRIVATE uint32_t vm_fast_code_size(const vm_context* ctx, const uint64_t* breakpoints, int end, int codeStart) {
+	if (breakpoints != nullptr || ctx->profile != nullptr || ctx->callGraph != nullptr) {
+		return 0;
+	}
+	return end - codeStart;
+}
+
+// ---------------------------------------------------------
+//  Every opcode gets its own case with the addressing mode
+//  resolved inline. The cycles are taken from the decode
+//  table. Commands that modify the program counter need the
+//  context to be in sync before and after the call.
+// ---------------------------------------------------------
+#define VM_FAST_OP(hex, func, mode) case hex: func(ctx, vm_fast_data(ctx, pc, mode), mode); pc += VM_DATA_SIZE[mode] + 1; cyc += VM_DECODE_TABLE[hex].cycles; break;
+#define VM_FAST_READ(hex, func, mode) case hex: { int data = vm_fast_data(ctx, pc, mode); cyc += VM_DECODE_TABLE[hex].cycles + vm_page_penalty(ctx, pc, mode, data); func(ctx, data, mode); pc += VM_DATA_SIZE[mode] + 1; } break;
+#define VM_FAST_JUMP(hex, func, mode) case hex: ctx->programCounter = pc; func(ctx, vm_fast_data(ctx, pc, mode), mode); pc = ctx->programCounter; cyc += VM_DECODE_TABLE[hex].cycles; break;
+#define VM_FAST_BRANCH(hex, func) case hex: { uint16_t next = pc + 2; ctx->programCounter = pc; func(ctx, vm_fast_data(ctx, pc, RELATIVE_ADR), RELATIVE_ADR); pc = ctx->programCounter; cyc += VM_DECODE_TABLE[hex].cycles + vm_branch_penalty(next, pc); } break;
+
+// ---------------------------------------------------------
+//  internal fast run loop. Starts at the current program
+//  counter and runs until the program counter reaches
+//  end, usually the end of the program, until a BRK,
+//  until maxInstructions have been executed, until at
+//  least maxCycles have been used or until the program
+//  counter reaches one of the breakpoints. Returns the
+//  number of executed instructions.
+//  With breakpoints, the profiler or the call graph
+//  codeSize is kept at 0, so every instruction takes the
+//  slow path at the end of the loop and the loop itself
+//  stays the same.
+// ---------------------------------------------------------
+PRIVATE uint64_t vm_run_fast_loop(vm_context* ctx, int end, uint64_t maxInstructions, uint64_t maxCycles, const uint64_t* breakpoints, vm_stop_reason* reason) {
+	uint16_t pc = ctx->programCounter;
+	uint64_t cnt = 0;
+	uint64_t cyc = ctx->cycles;
+	uint64_t cycleLimit = maxCycles > UINT64_MAX - cyc ? UINT64_MAX : cyc + maxCycles;
+	bool running = true;
+	int codeStart = vm_unshare_code(ctx, pc < end ? pc : end, pc < end ? end : pc + 1);
+	uint32_t codeSize = vm_fast_code_size(ctx, breakpoints, end, codeStart);
+	*reason = STOP_BRK;
+	ctx->stopRequested = false;
+	if (ctx->profile != nullptr) {
+		++ctx->profile[pc];
+	}
+	if (ctx->callGraph != nullptr) {
+		vm_call_graph_count(ctx->callGraph);
+	}
+	while (running) {
+		VM_STATS(++ctx->stats.opcodes[ctx->mem[pc]]);
+		switch (ctx->mem[pc]) {
+			VM_FAST_OP(0x69, vm_op_adc, IMMEDIDATE)
+			VM_FAST_OP(0x65, vm_op_adc, ZERO_PAGE)
+			VM_FAST_OP(0x75, vm_op_adc, ZERO_PAGE_X)
+			VM_FAST_OP(0x6D, vm_op_adc, ABSOLUTE_ADR)
+			VM_FAST_READ(0x7D, vm_op_adc, ABSOLUTE_X)
+			VM_FAST_READ(0x79, vm_op_adc, ABSOLUTE_Y)
+			VM_FAST_OP(0x61, vm_op_adc, INDIRECT_X)
+			VM_FAST_READ(0x71, vm_op_adc, INDIRECT_Y)
+			VM_FAST_OP(0x0A, vm_op_asl, ACCUMULATOR)
+			VM_FAST_OP(0x06, vm_op_asl, ZERO_PAGE)
+			VM_FAST_OP(0x16, vm_op_asl, ZERO_PAGE_X)
+			VM_FAST_OP(0x0E, vm_op_asl, ABSOLUTE_ADR)
+			VM_FAST_OP(0x1E, vm_op_asl, ABSOLUTE_X)
+			VM_FAST_OP(0x29, vm_op_and, IMMEDIDATE)
+			VM_FAST_OP(0x25, vm_op_and, ZERO_PAGE)
+			VM_FAST_OP(0x35, vm_op_and, ZERO_PAGE_X)
+			VM_FAST_OP(0x2D, vm_op_and, ABSOLUTE_ADR)
+			VM_FAST_READ(0x3D, vm_op_and, ABSOLUTE_X)
+			VM_FAST_READ(0x39, vm_op_and, ABSOLUTE_Y)
+			VM_FAST_OP(0x21, vm_op_and, INDIRECT_X)
+			VM_FAST_READ(0x31, vm_op_and, INDIRECT_Y)
+			VM_FAST_BRANCH(0x90, vm_op_bcc)
+			VM_FAST_BRANCH(0xB0, vm_op_bcs)
+			VM_FAST_BRANCH(0xF0, vm_op_beq)
+			VM_FAST_OP(0x2C, vm_op_bit, ABSOLUTE_ADR)
+			VM_FAST_OP(0x24, vm_op_bit, ZERO_PAGE)
+			VM_FAST_BRANCH(0x30, vm_op_bmi)
+			VM_FAST_BRANCH(0xD0, vm_op_bne)
+			VM_FAST_BRANCH(0x10, vm_op_bpl)
+			VM_FAST_BRANCH(0x50, vm_op_bvc)
+			VM_FAST_BRANCH(0x70, vm_op_bvs)
+			VM_FAST_OP(0x18, vm_op_clc, NONE)
+			VM_FAST_OP(0xD8, vm_op_cld, NONE)
+			VM_FAST_OP(0x58, vm_op_cli, NONE)
+			VM_FAST_OP(0xB8, vm_op_clv, NONE)
+			VM_FAST_OP(0xC9, vm_op_cmp, IMMEDIDATE)
+			VM_FAST_OP(0xC5, vm_op_cmp, ZERO_PAGE)
+			VM_FAST_OP(0xD5, vm_op_cmp, ZERO_PAGE_X)
+			VM_FAST_OP(0xCD, vm_op_cmp, ABSOLUTE_ADR)
+			VM_FAST_READ(0xDD, vm_op_cmp, ABSOLUTE_X)
+			VM_FAST_READ(0xD9, vm_op_cmp, ABSOLUTE_Y)
+			VM_FAST_OP(0xC1, vm_op_cmp, INDIRECT_X)
+			VM_FAST_READ(0xD1, vm_op_cmp, INDIRECT_Y)
+			VM_FAST_OP(0xE0, vm_op_cpx, IMMEDIDATE)
+			VM_FAST_OP(0xE4, vm_op_cpx, ZERO_PAGE)
+			VM_FAST_OP(0xEC, vm_op_cpx, ABSOLUTE_ADR)
+			VM_FAST_OP(0xC0, vm_op_cpy, IMMEDIDATE)
+			VM_FAST_OP(0xC4, vm_op_cpy, ZERO_PAGE)
+			VM_FAST_OP(0xCC, vm_op_cpy, ABSOLUTE_ADR)
+			VM_FAST_OP(0xC6, vm_op_dec, ZERO_PAGE)
+			VM_FAST_OP(0xD6, vm_op_dec, ZERO_PAGE_X)
+			VM_FAST_OP(0xCE, vm_op_dec, ABSOLUTE_ADR)
+			VM_FAST_OP(0xDE, vm_op_dec, ABSOLUTE_X)
+			VM_FAST_OP(0xCA, vm_op_dex, NONE)
+			VM_FAST_OP(0x88, vm_op_dey, NONE)
+			VM_FAST_OP(0x49, vm_op_eor, IMMEDIDATE)
+			VM_FAST_OP(0x45, vm_op_eor, ZERO_PAGE)
+			VM_FAST_OP(0x55, vm_op_eor, ZERO_PAGE_X)
+			VM_FAST_OP(0x4D, vm_op_eor, ABSOLUTE_ADR)
+			VM_FAST_READ(0x5D, vm_op_eor, ABSOLUTE_X)
+			VM_FAST_READ(0x59, vm_op_eor, ABSOLUTE_Y)
+			VM_FAST_OP(0x41, vm_op_eor, INDIRECT_X)
+			VM_FAST_READ(0x51, vm_op_eor, INDIRECT_Y)
+			VM_FAST_OP(0xE6, vm_op_inc, ZERO_PAGE)
+			VM_FAST_OP(0xF6, vm_op_inc, ZERO_PAGE_X)
+			VM_FAST_OP(0xEE, vm_op_inc, ABSOLUTE_ADR)
+			VM_FAST_OP(0xFE, vm_op_inc, ABSOLUTE_X)
+			VM_FAST_OP(0xE8, vm_op_inx, NONE)
+			VM_FAST_OP(0xC8, vm_op_iny, NONE)
+			VM_FAST_JUMP(0x4C, vm_op_jmp, JMP_ABSOLUTE)
+			VM_FAST_JUMP(0x6C, vm_op_jmp, JMP_INDIRECT)
+			VM_FAST_JUMP(0x20, vm_op_jsr, JMP_ABSOLUTE)
+			VM_FAST_OP(0xA9, vm_op_lda, IMMEDIDATE)
+			VM_FAST_OP(0xA5, vm_op_lda, ZERO_PAGE)
+			VM_FAST_OP(0xB5, vm_op_lda, ZERO_PAGE_X)
+			VM_FAST_OP(0xAD, vm_op_lda, ABSOLUTE_ADR)
+			VM_FAST_READ(0xBD, vm_op_lda, ABSOLUTE_X)
+			VM_FAST_READ(0xB9, vm_op_lda, ABSOLUTE_Y)
+			VM_FAST_OP(0xA1, vm_op_lda, INDIRECT_X)
+			VM_FAST_READ(0xB1, vm_op_lda, INDIRECT_Y)
+			VM_FAST_OP(0xA2, vm_op_ldx, IMMEDIDATE)
+			VM_FAST_OP(0xA6, vm_op_ldx, ZERO_PAGE)
+			VM_FAST_OP(0xB6, vm_op_ldx, ZERO_PAGE_Y)
+			VM_FAST_OP(0xAE, vm_op_ldx, ABSOLUTE_ADR)
+			VM_FAST_READ(0xBE, vm_op_ldx, ABSOLUTE_Y)
+			VM_FAST_OP(0xA0, vm_op_ldy, IMMEDIDATE)
+			VM_FAST_OP(0xA4, vm_op_ldy, ZERO_PAGE)
+			VM_FAST_OP(0xB4, vm_op_ldy, ZERO_PAGE_X)
+			VM_FAST_OP(0xAC, vm_op_ldy, ABSOLUTE_ADR)
+			VM_FAST_READ(0xBC, vm_op_ldy, ABSOLUTE_X)
+			VM_FAST_OP(0x4A, vm_op_lsr, ACCUMULATOR)
+			VM_FAST_OP(0x46, vm_op_lsr, ZERO_PAGE)
+			VM_FAST_OP(0x56, vm_op_lsr, ZERO_PAGE_X)
+			VM_FAST_OP(0x4E, vm_op_lsr, ABSOLUTE_ADR)
+			VM_FAST_OP(0x5E, vm_op_lsr, ABSOLUTE_X)
+			VM_FAST_OP(0x09, vm_op_ora, IMMEDIDATE)
+			VM_FAST_OP(0x05, vm_op_ora, ZERO_PAGE)
+			VM_FAST_OP(0x15, vm_op_ora, ZERO_PAGE_X)
+			VM_FAST_OP(0x0D, vm_op_ora, ABSOLUTE_ADR)
+			VM_FAST_READ(0x1D, vm_op_ora, ABSOLUTE_X)
+			VM_FAST_READ(0x19, vm_op_ora, ABSOLUTE_Y)
+			VM_FAST_OP(0x01, vm_op_ora, INDIRECT_X)
+			VM_FAST_READ(0x11, vm_op_ora, INDIRECT_Y)
+			VM_FAST_OP(0x48, vm_op_pha, NONE)
+			VM_FAST_OP(0x08, vm_op_php, NONE)
+			VM_FAST_OP(0x68, vm_op_pla, NONE)
+			VM_FAST_OP(0x28, vm_op_plp, NONE)
+			VM_FAST_OP(0x2A, vm_op_rol, ACCUMULATOR)
+			VM_FAST_OP(0x26, vm_op_rol, ZERO_PAGE)
+			VM_FAST_OP(0x36, vm_op_rol, ZERO_PAGE_X)
+			VM_FAST_OP(0x2E, vm_op_rol, ABSOLUTE_ADR)
+			VM_FAST_OP(0x3E, vm_op_rol, ABSOLUTE_X)
+			VM_FAST_OP(0x6A, vm_op_ror, ACCUMULATOR)
+			VM_FAST_OP(0x66, vm_op_ror, ZERO_PAGE)
+			VM_FAST_OP(0x76, vm_op_ror, ZERO_PAGE_X)
+			VM_FAST_OP(0x6E, vm_op_ror, ABSOLUTE_ADR)
+			VM_FAST_OP(0x7E, vm_op_ror, ABSOLUTE_X)
+			VM_FAST_JUMP(0x60, vm_op_rts, NONE)
+			VM_FAST_OP(0xE9, vm_op_sbc, IMMEDIDATE)
+			VM_FAST_OP(0xE5, vm_op_sbc, ZERO_PAGE)
+			VM_FAST_OP(0xF5, vm_op_sbc, ZERO_PAGE_X)
+			VM_FAST_OP(0xED, vm_op_sbc, ABSOLUTE_ADR)
+			VM_FAST_READ(0xFD, vm_op_sbc, ABSOLUTE_X)
+			VM_FAST_READ(0xF9, vm_op_sbc, ABSOLUTE_Y)
+			VM_FAST_OP(0xE1, vm_op_sbc, INDIRECT_X)
+			VM_FAST_READ(0xF1, vm_op_sbc, INDIRECT_Y)
+			VM_FAST_OP(0x38, vm_op_sec, NONE)
+			VM_FAST_OP(0xF8, vm_op_sed, NONE)
+			VM_FAST_OP(0x78, vm_op_sei, NONE)
+			VM_FAST_OP(0x85, vm_op_sta, ZERO_PAGE)
+			VM_FAST_OP(0x95, vm_op_sta, ZERO_PAGE_X)
+			VM_FAST_OP(0x8D, vm_op_sta, ABSOLUTE_ADR)
+			VM_FAST_OP(0x9D, vm_op_sta, ABSOLUTE_X)
+			VM_FAST_OP(0x99, vm_op_sta, ABSOLUTE_Y)
+			VM_FAST_OP(0x81, vm_op_sta, INDIRECT_X)
+			VM_FAST_OP(0x91, vm_op_sta, INDIRECT_Y)
+			VM_FAST_OP(0x86, vm_op_stx, ZERO_PAGE)
+			VM_FAST_OP(0x96, vm_op_stx, ZERO_PAGE_Y)
+			VM_FAST_OP(0x8E, vm_op_stx, ABSOLUTE_ADR)
+			VM_FAST_OP(0x84, vm_op_sty, ZERO_PAGE)
+			VM_FAST_OP(0x94, vm_op_sty, ZERO_PAGE_X)
+			VM_FAST_OP(0x8C, vm_op_sty, ABSOLUTE_ADR)
+			VM_FAST_OP(0xAA, vm_op_tax, NONE)
+			VM_FAST_OP(0xA8, vm_op_tay, NONE)
+			VM_FAST_OP(0xBA, vm_op_tsx, NONE)
+			VM_FAST_OP(0x8A, vm_op_txa, NONE)
+			VM_FAST_OP(0x9A, vm_op_txs, NONE)
+			VM_FAST_OP(0x98, vm_op_tya, NONE)
+			case 0x00:
+				running = vm_has_brk_handler(ctx);
+				ctx->programCounter = pc;
+				vm_brk(ctx, running);
+				pc = ctx->programCounter;
+				cyc += VM_DECODE_TABLE[0x00].cycles;
+				break;
+			case 0x40:
+				ctx->programCounter = pc;
+				vm_op_rti(ctx, 0, NONE);
+				pc = ctx->programCounter;
+				cyc += VM_DECODE_TABLE[0x40].cycles;
+				break;
+			default:
+				cyc += VM_DECODE_TABLE[ctx->mem[pc]].cycles;
+				pc += 1;
+				break;
+		}
+		++cnt;
+		// also true if pc is below codeStart
+		if (running && ((uint32_t)(pc - codeStart) >= codeSize || cnt >= maxInstructions || cyc >= cycleLimit || cyc >= ctx->nextEvent)) {
+			if (cyc >= ctx->nextEvent) {
+				ctx->programCounter = pc;
+				ctx->cycles = cyc;
+				vm_dispatch_events(ctx);
+				pc = ctx->programCounter;
+				cyc = ctx->cycles;
+			}
+			if (ctx->stopRequested) {
+				*reason = STOP_WATCHPOINT;
+				running = false;
+			}
+			else if (pc >= end) {
+				*reason = STOP_END;
+				running = false;
+			}
+			else if (cnt >= maxInstructions) {
+				*reason = STOP_INSTRUCTIONS;
+				running = false;
+			}
+			else if (cyc >= cycleLimit) {
+				*reason = STOP_CYCLES;
+				running = false;
+			}
+			else if (breakpoints != nullptr && ((breakpoints[pc >> 6] >> (pc & 63)) & 1) != 0) {
+				*reason = STOP_BREAKPOINT;
+				running = false;
+			}
+			else if (pc < codeStart) {
+				codeStart = vm_unshare_code(ctx, pc, codeStart);
+				codeSize = vm_fast_code_size(ctx, breakpoints, end, codeStart);
+			}
+			// counts the instruction about to be executed
+			if (running && ctx->profile != nullptr) {
+				++ctx->profile[pc];
+			}
+			if (running && ctx->callGraph != nullptr) {
+				vm_call_graph_count(ctx->callGraph);
+			}
+		}
+	}
+	ctx->programCounter = pc;
+	ctx->cycles = cyc;
+	VM_STATS(ctx->stats.instructions += cnt);
+	return cnt;
+}
+
+// ---------------------------------------------------------
+//  run program using the fast run loop
+// ---------------------------------------------------------
+void vm_run_fast(vm_context* ctx) {
+	ctx->programCounter = 0x600;
+	vm_stop_reason reason;
+	vm_run_fast_loop(ctx, 0x600 + ctx->numBytes, UINT64_MAX, UINT64_MAX, nullptr, &reason);
+}
+
+// ---------------------------------------------------------
+//  run from the current program counter until the budget
+//  of cycles is used up
+// ---------------------------------------------------------
+uint64_t vm_run_cycles(vm_context* ctx, uint64_t budget) {
+	uint64_t start = ctx->cycles;
+	if (budget > 0) {
+		vm_stop_reason reason;
+		vm_run_fast_loop(ctx, 0x600 + ctx->numBytes, UINT64_MAX, budget, nullptr, &reason);
+	}
+	return ctx->cycles - start;
+}
+
+// ---------------------------------------------------------
+//  set breakpoint
+// ---------------------------------------------------------
+void vm_breakpoint_set(vm_context* ctx, uint16_t address) {
+	if (ctx->breakpoints == nullptr) {
+		ctx->breakpoints = new uint64_t[1024];
+		memset(ctx->breakpoints, 0, 1024 * sizeof(uint64_t));
+	}
+	uint64_t bit = 1ull << (address & 63);
+	if ((ctx->breakpoints[address >> 6] & bit) == 0) {
+		ctx->breakpoints[address >> 6] |= bit;
+		++ctx->numBreakpoints;
+	}
+}
+
+// ---------------------------------------------------------
+//  set breakpoint in internal context
+// ---------------------------------------------------------
+void vm_breakpoint_set(uint16_t address) {
+	if (_internal_ctx != nullptr) {
+		vm_breakpoint_set(_internal_ctx, address);
+	}
+}
+
+// ---------------------------------------------------------
+//  clear breakpoint. The bitmap is freed together with the
+//  last breakpoint.
+// ---------------------------------------------------------
+void vm_breakpoint_clear(vm_context* ctx, uint16_t address) {
+	if (vm_is_breakpoint(ctx, address)) {
+		ctx->breakpoints[address >> 6] &= ~(1ull << (address & 63));
+		if (--ctx->numBreakpoints == 0) {
+			vm_breakpoint_clear_all(ctx);
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  clear all breakpoints
+// ---------------------------------------------------------
+void vm_breakpoint_clear_all(vm_context* ctx) {
+	delete[] ctx->breakpoints;
+	ctx->breakpoints = nullptr;
+	ctx->numBreakpoints = 0;
+}
+
+// ---------------------------------------------------------
+//  is breakpoint
+// ---------------------------------------------------------
+bool vm_is_breakpoint(const vm_context* ctx, uint16_t address) {
+	if (ctx->breakpoints == nullptr) {
+		return false;
+	}
+	return ((ctx->breakpoints[address >> 6] >> (address & 63)) & 1) != 0;
+}
+
+// ---------------------------------------------------------
+//  run from the current program counter until the program
+//  counter reaches a breakpoint
+// ---------------------------------------------------------
+vm_stop_reason vm_run_until_break(vm_context* ctx) {
+	if (ctx->programCounter >= 0x600 + ctx->numBytes) {
+		return STOP_END;
+	}
+	vm_stop_reason reason;
+	vm_run_fast_loop(ctx, 0x600 + ctx->numBytes, UINT64_MAX, UINT64_MAX, ctx->breakpoints, &reason);
+	return reason;
+}
+
+// ---------------------------------------------------------
+//  run internal context until the next breakpoint
+// ---------------------------------------------------------
+vm_stop_reason vm_run_until_break() {
+	if (_internal_ctx != nullptr) {
+		return vm_run_until_break(_internal_ctx);
+	}
+	return STOP_END;
+}
+
+// ---------------------------------------------------------
+//  internal step loop of vm_run_ex for the conditions that
+//  are checked after every instruction. depth counts the
+//  JSR and RTS since the start.
+// ---------------------------------------------------------
+PRIVATE vm_stop_reason vm_run_ex_steps(vm_context* ctx, int end, uint64_t maxInstructions, uint64_t maxCycles, const vm_run_options& options) {
+	uint64_t cnt = 0;
+	uint64_t cycleLimit = maxCycles > UINT64_MAX - ctx->cycles ? UINT64_MAX : ctx->cycles + maxCycles;
+	int depth = 0;
+	vm_stop_reason reason = STOP_BRK;
+	bool running = true;
+	ctx->stopRequested = false;
+	while (running) {
+		uint8_t opcode = ctx->fetch(ctx->programCounter);
+		running = vm_step(ctx);
+		++cnt;
+		if (running && ctx->cycles >= ctx->nextEvent) {
+			vm_dispatch_events(ctx);
+		}
+		if (opcode == 0x20) {
+			++depth;
+		}
+		else if (opcode == 0x60) {
+			--depth;
+		}
+		uint16_t pc = ctx->programCounter;
+		if (ctx->stopRequested) {
+			reason = STOP_WATCHPOINT;
+			running = false;
+		}
+		else if (!running) {
+			reason = STOP_BRK;
+		}
+		else if (pc >= end) {
+			reason = STOP_END;
+			running = false;
+		}
+		else if (cnt >= maxInstructions) {
+			reason = STOP_INSTRUCTIONS;
+			running = false;
+		}
+		else if (ctx->cycles >= cycleLimit) {
+			reason = STOP_CYCLES;
+			running = false;
+		}
+		else if (vm_is_breakpoint(ctx, pc)) {
+			reason = STOP_BREAKPOINT;
+			running = false;
+		}
+		else if (options.stopAtTarget && pc == options.target) {
+			reason = STOP_TARGET;
+			running = false;
+		}
+		else if (options.stopOnReturn && depth < 0) {
+			reason = STOP_RETURN;
+			running = false;
+		}
+		else if (options.predicate != nullptr && (*options.predicate)(ctx, options.data)) {
+			reason = STOP_PREDICATE;
+			running = false;
+		}
+	}
+	return reason;
+}
+
+// ---------------------------------------------------------
+//  run from the current program counter until one of the
+//  conditions is met
+// ---------------------------------------------------------
+vm_stop_reason vm_run_ex(vm_context* ctx, const vm_run_options& options) {
+	int end = 0x600 + ctx->numBytes;
+	// outside of the program there is no end
+	if (ctx->programCounter >= end) {
+		end = 0x10000;
+	}
+	uint64_t maxInstructions = options.maxInstructions > 0 ? options.maxInstructions : UINT64_MAX;
+	uint64_t maxCycles = options.maxCycles > 0 ? options.maxCycles : UINT64_MAX;
+	if (options.stopAtTarget || options.stopOnReturn || options.predicate != nullptr) {
+		return vm_run_ex_steps(ctx, end, maxInstructions, maxCycles, options);
+	}
+	vm_stop_reason reason;
+	vm_run_fast_loop(ctx, end, maxInstructions, maxCycles, ctx->breakpoints, &reason);
+	return reason;
+}
+
+// ---------------------------------------------------------
+//  run internal context until one of the conditions is met
+// ---------------------------------------------------------
+vm_stop_reason vm_run_ex(const vm_run_options& options) {
+	if (_internal_ctx != nullptr) {
+		return vm_run_ex(_internal_ctx, options);
+	}
+	return STOP_END;
+}
+
+#undef VM_FAST_OP
+#undef VM_FAST_READ
+#undef VM_FAST_JUMP
+#undef VM_FAST_BRANCH
+
+#if defined(VM_JIT_SUPPORTED)
+// ---------------------------------------------------------
+// JIT
+//
+// Translates blocks into x86-64 code. Inside of the code
+// the registers live in host registers:
+//   rbx = context, r12 = A, r13 = X, r14 = Y, r15 = SP
+//   and rbp = flags.
+// Loads, stores, transfers, increments, compares with a
+// constant, flag changes, branches and JMP are translated.
+// Every other instruction calls vm_step. Blocks ending with
+// a known target jump directly into the next block once it
+// has been translated.
+// ---------------------------------------------------------
+const static size_t VM_JIT_CODE_SIZE = 4 * 1024 * 1024;
+// space needed by the largest possible block
+const static size_t VM_JIT_BLOCK_RESERVE = 32 * 1024;
+const static int VM_JIT_MAX_OPS = 64;
+
+typedef enum vm_jit_register {
+	JIT_RAX = 0, JIT_RCX = 1, JIT_RDX = 2, JIT_RBX = 3, JIT_RSP = 4, JIT_RBP = 5, JIT_RSI = 6, JIT_RDI = 7,
+	JIT_R12 = 12, JIT_R13 = 13, JIT_R14 = 14, JIT_R15 = 15, JIT_NO_INDEX = -1
+} vm_jit_register;
+
+// the host register of every vm_registers entry
+const static int VM_JIT_REGISTERS[] = { JIT_R12, JIT_R13, JIT_R14 };
+
+// ALU extensions and opcodes
+const static int JIT_ADD = 0;
+const static int JIT_OR = 1;
+const static int JIT_AND = 4;
+const static int JIT_CMP = 7;
+const static int JIT_SHL = 4;
+const static int JIT_SHR = 5;
+const static uint8_t JIT_OR_RR = 0x09;
+const static uint8_t JIT_TEST_RR = 0x85;
+
+// condition codes
+const static int JIT_B = 2;
+const static int JIT_AE = 3;
+const static int JIT_E = 4;
+const static int JIT_NE = 5;
+
+typedef int(*vm_jit_entry)(vm_context* ctx, const uint8_t* code);
+
+typedef struct vm_jit_block {
+	uint16_t start;
+	int end;
+	uint32_t code;
+	std::vector<uint32_t> incoming;
+} vm_jit_block;
+
+// ---------------------------------------------------------
+// The code buffer starts with the entry and the exit code.
+// codePages counts the blocks on every page, so that the
+// translated stores only call vm_context::write when they
+// hit a page containing code. devicePages marks the pages
+// of memory mapped devices and watched pages which are
+// accessed through vm_context. Only when there are any the
+// indexed reads and writes check it. pending holds all exits
+// waiting for the block of their target.
+// ---------------------------------------------------------
+struct vm_jit {
+	uint8_t* code;
+	size_t used;
+	size_t blockStart;
+	uint32_t exitCommon;
+	uint32_t exitDynamic;
+	bool writable;
+	int end;
+	uint32_t generation;
+	std::vector<vm_jit_block*> blocks;
+	std::vector<vm_jit_block*> pages[256];
+	uint8_t codePages[256];
+	uint8_t devicePages[256];
+	bool devices;
+	std::map<uint16_t, std::vector<uint32_t> > pending;
+	std::vector<vm_jit_block*> invalidated;
+};
+
+// ---------------------------------------------------------
+//  x86-64 encoding
+// ---------------------------------------------------------
+PRIVATE void vm_jit_byte(vm_jit* jit, uint8_t v) {
+	jit->code[jit->used++] = v;
+}
+
+PRIVATE void vm_jit_int(vm_jit* jit, uint32_t v) {
+	memcpy(jit->code + jit->used, &v, sizeof(v));
+	jit->used += sizeof(v);
+}
+
+PRIVATE void vm_jit_rex(vm_jit* jit, bool wide, int reg, int index, int base, bool byteReg) {
+	uint8_t rex = 0x40;
+	if (wide) {
+		rex |= 8;
+	}
+	if (reg >= 8) {
+		rex |= 4;
+	}
+	if (index >= 8) {
+		rex |= 2;
+	}
+	if (base >= 8) {
+		rex |= 1;
+	}
+	if (rex != 0x40 || byteReg) {
+		vm_jit_byte(jit, rex);
+	}
+}
+
+// spl, bpl, sil and dil can only be used with a REX prefix
+PRIVATE bool vm_jit_byte_reg(int reg) {
+	return reg >= JIT_RSP && reg <= JIT_RDI;
+}
+
+PRIVATE void vm_jit_modrm_reg(vm_jit* jit, int reg, int rm) {
+	vm_jit_byte(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// always uses a 32 bit displacement
+PRIVATE void vm_jit_modrm_mem(vm_jit* jit, int reg, int base, int index, int disp) {
+	if (index != JIT_NO_INDEX || (base & 7) == JIT_RSP) {
+		vm_jit_byte(jit, 0x84 | ((reg & 7) << 3));
+		int idx = index != JIT_NO_INDEX ? index : JIT_RSP;
+		vm_jit_byte(jit, ((idx & 7) << 3) | (base & 7));
+	}
+	else {
+		vm_jit_byte(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+	}
+	vm_jit_int(jit, disp);
+}
+
+// movzx dst, byte [base + index + disp]
+PRIVATE void vm_jit_load8(vm_jit* jit, int dst, int base, int index, int disp) {
+	vm_jit_rex(jit, false, dst, index, base, false);
+	vm_jit_byte(jit, 0x0F);
+	vm_jit_byte(jit, 0xB6);
+	vm_jit_modrm_mem(jit, dst, base, index, disp);
+}
+
+// mov byte [base + index + disp], src
+PRIVATE void vm_jit_store8(vm_jit* jit, int src, int base, int index, int disp) {
+	vm_jit_rex(jit, false, src, index, base, vm_jit_byte_reg(src));
+	vm_jit_byte(jit, 0x88);
+	vm_jit_modrm_mem(jit, src, base, index, disp);
+}
+
+// movzx dst, src8
+PRIVATE void vm_jit_movzx(vm_jit* jit, int dst, int src) {
+	vm_jit_rex(jit, false, dst, 0, src, vm_jit_byte_reg(src));
+	vm_jit_byte(jit, 0x0F);
+	vm_jit_byte(jit, 0xB6);
+	vm_jit_modrm_reg(jit, dst, src);
+}
+
+PRIVATE void vm_jit_mov(vm_jit* jit, int dst, int src) {
+	vm_jit_rex(jit, false, src, 0, dst, false);
+	vm_jit_byte(jit, 0x89);
+	vm_jit_modrm_reg(jit, src, dst);
+}
+
+PRIVATE void vm_jit_mov64(vm_jit* jit, int dst, int src) {
+	vm_jit_rex(jit, true, src, 0, dst, false);
+	vm_jit_byte(jit, 0x89);
+	vm_jit_modrm_reg(jit, src, dst);
+}
+
+PRIVATE void vm_jit_mov_imm(vm_jit* jit, int dst, uint32_t imm) {
+	vm_jit_rex(jit, false, 0, 0, dst, false);
+	vm_jit_byte(jit, 0xB8 + (dst & 7));
+	vm_jit_int(jit, imm);
+}
+
+PRIVATE void vm_jit_mov_imm64(vm_jit* jit, int dst, const void* ptr) {
+	uint64_t imm = (uint64_t)(uintptr_t)ptr;
+	vm_jit_rex(jit, true, 0, 0, dst, false);
+	vm_jit_byte(jit, 0xB8 + (dst & 7));
+	memcpy(jit->code + jit->used, &imm, sizeof(imm));
+	jit->used += sizeof(imm);
+}
+
+PRIVATE void vm_jit_alu_imm(vm_jit* jit, bool wide, int ext, int dst, uint32_t imm) {
+	vm_jit_rex(jit, wide, 0, 0, dst, false);
+	vm_jit_byte(jit, 0x81);
+	vm_jit_modrm_reg(jit, ext, dst);
+	vm_jit_int(jit, imm);
+}
+
+PRIVATE void vm_jit_alu(vm_jit* jit, uint8_t op, int dst, int src) {
+	vm_jit_rex(jit, false, src, 0, dst, false);
+	vm_jit_byte(jit, op);
+	vm_jit_modrm_reg(jit, src, dst);
+}
+
+PRIVATE void vm_jit_shift(vm_jit* jit, int ext, int dst, uint8_t count) {
+	vm_jit_rex(jit, false, 0, 0, dst, false);
+	vm_jit_byte(jit, 0xC1);
+	vm_jit_modrm_reg(jit, ext, dst);
+	vm_jit_byte(jit, count);
+}
+
+PRIVATE void vm_jit_test_imm(vm_jit* jit, int dst, uint32_t imm) {
+	vm_jit_rex(jit, false, 0, 0, dst, false);
+	vm_jit_byte(jit, 0xF7);
+	vm_jit_modrm_reg(jit, 0, dst);
+	vm_jit_int(jit, imm);
+}
+
+PRIVATE void vm_jit_setcc(vm_jit* jit, int cc, int dst) {
+	vm_jit_rex(jit, false, 0, 0, dst, vm_jit_byte_reg(dst));
+	vm_jit_byte(jit, 0x0F);
+	vm_jit_byte(jit, 0x90 + cc);
+	vm_jit_modrm_reg(jit, 0, dst);
+}
+
+// inc (ext = 0) or dec (ext = 1) of the lower byte
+PRIVATE void vm_jit_incdec8(vm_jit* jit, int ext, int reg) {
+	vm_jit_rex(jit, false, 0, 0, reg, vm_jit_byte_reg(reg));
+	vm_jit_byte(jit, 0xFE);
+	vm_jit_modrm_reg(jit, ext, reg);
+}
+
+// cmp byte [base + index + disp], imm
+PRIVATE void vm_jit_cmp_mem8(vm_jit* jit, int base, int index, int disp, uint8_t imm) {
+	vm_jit_rex(jit, false, 0, index, base, false);
+	vm_jit_byte(jit, 0x80);
+	vm_jit_modrm_mem(jit, JIT_CMP, base, index, disp);
+	vm_jit_byte(jit, imm);
+}
+
+// mov dst, qword [base + disp]
+PRIVATE void vm_jit_load64(vm_jit* jit, int dst, int base, int disp) {
+	vm_jit_rex(jit, true, dst, JIT_NO_INDEX, base, false);
+	vm_jit_byte(jit, 0x8B);
+	vm_jit_modrm_mem(jit, dst, base, JIT_NO_INDEX, disp);
+}
+
+// cmp reg, qword [base + disp]
+PRIVATE void vm_jit_cmp_mem64(vm_jit* jit, int reg, int base, int disp) {
+	vm_jit_rex(jit, true, reg, JIT_NO_INDEX, base, false);
+	vm_jit_byte(jit, 0x3B);
+	vm_jit_modrm_mem(jit, reg, base, JIT_NO_INDEX, disp);
+}
+
+// or byte [base + index + disp], imm
+PRIVATE void vm_jit_or_mem8(vm_jit* jit, int base, int index, int disp, uint8_t imm) {
+	vm_jit_rex(jit, false, 0, index, base, false);
+	vm_jit_byte(jit, 0x80);
+	vm_jit_modrm_mem(jit, JIT_OR, base, index, disp);
+	vm_jit_byte(jit, imm);
+}
+
+// bts qword [base + disp], bit which sets bit number bit of
+// the bit string starting at base + disp
+PRIVATE void vm_jit_bts_mem(vm_jit* jit, int base, int disp, int bit) {
+	vm_jit_rex(jit, true, bit, JIT_NO_INDEX, base, false);
+	vm_jit_byte(jit, 0x0F);
+	vm_jit_byte(jit, 0xAB);
+	vm_jit_modrm_mem(jit, bit, base, JIT_NO_INDEX, disp);
+}
+
+PRIVATE void vm_jit_call(vm_jit* jit, const void* func) {
+	vm_jit_mov_imm64(jit, JIT_RAX, func);
+	vm_jit_byte(jit, 0xFF);
+	vm_jit_modrm_reg(jit, 2, JIT_RAX);
+}
+
+PRIVATE void vm_jit_push(vm_jit* jit, int reg) {
+	vm_jit_rex(jit, false, 0, 0, reg, false);
+	vm_jit_byte(jit, 0x50 + (reg & 7));
+}
+
+PRIVATE void vm_jit_pop(vm_jit* jit, int reg) {
+	vm_jit_rex(jit, false, 0, 0, reg, false);
+	vm_jit_byte(jit, 0x58 + (reg & 7));
+}
+
+PRIVATE void vm_jit_jmp(vm_jit* jit, uint32_t target) {
+	vm_jit_byte(jit, 0xE9);
+	vm_jit_int(jit, target - (uint32_t)(jit->used + 4));
+}
+
+PRIVATE void vm_jit_jcc(vm_jit* jit, int cc, uint32_t target) {
+	vm_jit_byte(jit, 0x0F);
+	vm_jit_byte(jit, 0x80 + cc);
+	vm_jit_int(jit, target - (uint32_t)(jit->used + 4));
+}
+
+// forward jumps return the position of the displacement
+PRIVATE uint32_t vm_jit_jmp_forward(vm_jit* jit) {
+	vm_jit_byte(jit, 0xE9);
+	vm_jit_int(jit, 0);
+	return (uint32_t)jit->used - 4;
+}
+
+PRIVATE uint32_t vm_jit_jcc_forward(vm_jit* jit, int cc) {
+	vm_jit_byte(jit, 0x0F);
+	vm_jit_byte(jit, 0x80 + cc);
+	vm_jit_int(jit, 0);
+	return (uint32_t)jit->used - 4;
+}
+
+PRIVATE void vm_jit_bind(vm_jit* jit, uint32_t at) {
+	uint32_t rel = (uint32_t)jit->used - (at + 4);
+	memcpy(jit->code + at, &rel, sizeof(rel));
+}
+
+// add qword [ctx + cycles], imm
+PRIVATE void vm_jit_add_cycles(vm_jit* jit, int cycles) {
+	if (cycles > 0) {
+		vm_jit_rex(jit, true, 0, 0, JIT_RBX, false);
+		vm_jit_byte(jit, 0x81);
+		vm_jit_modrm_mem(jit, JIT_ADD, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, cycles));
+		vm_jit_int(jit, cycles);
+	}
+}
+
+// add qword [ctx + cycles], src
+PRIVATE void vm_jit_add_cycles_reg(vm_jit* jit, int src) {
+	vm_jit_rex(jit, true, src, 0, JIT_RBX, false);
+	vm_jit_byte(jit, 0x01);
+	vm_jit_modrm_mem(jit, src, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, cycles));
+}
+
+// mov word [ctx + programCounter], pc. This is always 9 bytes.
+PRIVATE void vm_jit_store_pc(vm_jit* jit, uint16_t pc) {
+	vm_jit_byte(jit, 0x66);
+	vm_jit_byte(jit, 0xC7);
+	vm_jit_modrm_mem(jit, 0, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, programCounter));
+	vm_jit_byte(jit, low_value(pc));
+	vm_jit_byte(jit, high_value(pc));
+}
+
+PRIVATE void vm_jit_load_registers(vm_jit* jit) {
+	for (int i = 0; i < 3; ++i) {
+		vm_jit_load8(jit, VM_JIT_REGISTERS[i], JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, registers) + i);
+	}
+	vm_jit_load8(jit, JIT_R15, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, sp));
+	vm_jit_load8(jit, JIT_RBP, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, flags));
+}
+
+PRIVATE void vm_jit_save_registers(vm_jit* jit) {
+	for (int i = 0; i < 3; ++i) {
+		vm_jit_store8(jit, VM_JIT_REGISTERS[i], JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, registers) + i);
+	}
+	vm_jit_store8(jit, JIT_R15, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, sp));
+	vm_jit_store8(jit, JIT_RBP, JIT_RBX, JIT_NO_INDEX, offsetof(vm_context, flags));
+}
+
+// ---------------------------------------------------------
+//  make the code buffer either writable or executable
+// ---------------------------------------------------------
+PRIVATE void vm_jit_set_writable(vm_jit* jit, bool writable) {
+	if (jit->writable != writable) {
+		mprotect(jit->code, VM_JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC);
+		jit->writable = writable;
+	}
+}
+
+// ---------------------------------------------------------
+//  create the JIT and emit the entry and exit code. The
+//  entry is called as int entry(vm_context* ctx, code) and
+//  returns 1 if a BRK has been executed.
+// ---------------------------------------------------------
+PRIVATE vm_jit* vm_jit_create(const vm_context* ctx) {
+	void* code = mmap(nullptr, VM_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		return nullptr;
+	}
+	vm_jit* jit = new vm_jit;
+	jit->code = (uint8_t*)code;
+	jit->used = 0;
+	jit->writable = true;
+	jit->end = -1;
+	jit->generation = 0;
+	jit->blocks.resize(65536, nullptr);
+	memset(jit->codePages, 0, sizeof(jit->codePages));
+	jit->devices = false;
+	for (int i = 0; i < 256; ++i) {
+		jit->devicePages[i] = ctx->devices[i] != nullptr || ctx->pageTypes[i] == WATCHED_PAGE ? 1 : 0;
+		jit->devices |= jit->devicePages[i] != 0;
+	}
+	// entry
+	vm_jit_push(jit, JIT_RBX);
+	vm_jit_push(jit, JIT_RBP);
+	vm_jit_push(jit, JIT_R12);
+	vm_jit_push(jit, JIT_R13);
+	vm_jit_push(jit, JIT_R14);
+	vm_jit_push(jit, JIT_R15);
+	// keeps the stack aligned for calls
+	vm_jit_alu_imm(jit, true, 5, JIT_RSP, 8);
+	vm_jit_mov64(jit, JIT_RBX, JIT_RDI);
+	vm_jit_load_registers(jit);
+	vm_jit_byte(jit, 0xFF);
+	vm_jit_modrm_reg(jit, 4, JIT_RSI);
+	// exit with the program counter already stored
+	jit->exitDynamic = (uint32_t)jit->used;
+	vm_jit_mov_imm(jit, JIT_RAX, 0);
+	jit->exitCommon = (uint32_t)jit->used;
+	vm_jit_save_registers(jit);
+	vm_jit_alu_imm(jit, true, JIT_ADD, JIT_RSP, 8);
+	vm_jit_pop(jit, JIT_R15);
+	vm_jit_pop(jit, JIT_R14);
+	vm_jit_pop(jit, JIT_R13);
+	vm_jit_pop(jit, JIT_R12);
+	vm_jit_pop(jit, JIT_RBP);
+	vm_jit_pop(jit, JIT_RBX);
+	vm_jit_byte(jit, 0xC3);
+	jit->blockStart = jit->used;
+	return jit;
+}
+
+// ---------------------------------------------------------
+//  drop all blocks
+// ---------------------------------------------------------
+PRIVATE void vm_jit_flush(vm_jit* jit) {
+	for (size_t i = 0; i < jit->blocks.size(); ++i) {
+		delete jit->blocks[i];
+		jit->blocks[i] = nullptr;
+	}
+	for (size_t i = 0; i < jit->invalidated.size(); ++i) {
+		delete jit->invalidated[i];
+	}
+	jit->invalidated.clear();
+	for (int i = 0; i < 256; ++i) {
+		jit->pages[i].clear();
+	}
+	memset(jit->codePages, 0, sizeof(jit->codePages));
+	jit->pending.clear();
+	jit->used = jit->blockStart;
+	++jit->generation;
+}
+
+// ---------------------------------------------------------
+//  release JIT
+// ---------------------------------------------------------
+void vm_jit_release(vm_context* ctx) {
+	vm_jit* jit = ctx->jit;
+	if (jit != nullptr) {
+		vm_jit_flush(jit);
+		munmap(jit->code, VM_JIT_CODE_SIZE);
+		delete jit;
+		ctx->jit = nullptr;
+	}
+}
+
+// ---------------------------------------------------------
+//  invalidate all blocks covering the address. The code
+//  is left untouched until the next block is entered.
+// ---------------------------------------------------------
+void vm_jit_invalidate(vm_context* ctx, uint16_t address) {
+	vm_jit* jit = ctx->jit;
+	if (jit->codePages[address >> 8] == 0) {
+		return;
+	}
+	std::vector<vm_jit_block*>& page = jit->pages[address >> 8];
+	size_t i = 0;
+	while (i < page.size()) {
+		vm_jit_block* block = page[i];
+		if (address >= block->start && address < block->end) {
+			int last = (block->end - 1) >> 8;
+			for (int p = block->start >> 8; p <= last && p < 256; ++p) {
+				std::vector<vm_jit_block*>& blocks = jit->pages[p];
+				for (size_t j = 0; j < blocks.size(); ++j) {
+					if (blocks[j] == block) {
+						blocks.erase(blocks.begin() + j);
+						break;
+					}
+				}
+				--jit->codePages[p];
+			}
+			jit->blocks[block->start] = nullptr;
+			jit->invalidated.push_back(block);
+			++jit->generation;
+		}
+		else {
+			++i;
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  let an exit jump directly into a block
+// ---------------------------------------------------------
+PRIVATE void vm_jit_chain(vm_jit* jit, uint32_t exit, vm_jit_block* block) {
+	uint32_t rel = block->code - (exit + 5);
+	jit->code[exit] = 0xE9;
+	memcpy(jit->code + exit + 1, &rel, sizeof(rel));
+	block->incoming.push_back(exit);
+}
+
+// ---------------------------------------------------------
+//  unchain all exits jumping into invalidated blocks
+// ---------------------------------------------------------
+PRIVATE void vm_jit_release_invalidated(vm_jit* jit) {
+	for (size_t i = 0; i < jit->invalidated.size(); ++i) {
+		vm_jit_block* block = jit->invalidated[i];
+		for (size_t j = 0; j < block->incoming.size(); ++j) {
+			size_t used = jit->used;
+			jit->used = block->incoming[j];
+			vm_jit_store_pc(jit, block->start);
+			jit->used = used;
+			jit->pending[block->start].push_back(block->incoming[j]);
+		}
+		delete block;
+	}
+	jit->invalidated.clear();
+}
+
+// ---------------------------------------------------------
+//  exit to a known target
+// ---------------------------------------------------------
+PRIVATE void vm_jit_exit(vm_jit* jit, uint16_t target) {
+	uint32_t exit = (uint32_t)jit->used;
+	vm_jit_store_pc(jit, target);
+	vm_jit_jmp(jit, jit->exitDynamic);
+	if (target < jit->end) {
+		vm_jit_block* block = jit->blocks[target];
+		if (block != nullptr) {
+			vm_jit_chain(jit, exit, block);
+		}
+		else {
+			jit->pending[target].push_back(exit);
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  called by translated code to read from a device page
+// ---------------------------------------------------------
+PRIVATE uint32_t vm_jit_read(vm_context* ctx, uint32_t address) {
+	return ctx->read((uint16_t)address);
+}
+
+// ---------------------------------------------------------
+//  called by translated code. Writes the value and returns
+//  1 if this invalidated a block or hit a watchpoint.
+// ---------------------------------------------------------
+PRIVATE int vm_jit_write(vm_context* ctx, uint32_t address, uint32_t value) {
+	uint32_t generation = ctx->jit->generation;
+	ctx->write((uint16_t)address, (uint8_t)value);
+	return ctx->jit->generation != generation || ctx->stopRequested ? 1 : 0;
+}
+
+// ---------------------------------------------------------
+//  called by translated code for every instruction which
+//  is not translated. Returns 1 if a block was invalidated
+//  or a watchpoint stops the run.
+// ---------------------------------------------------------
+PRIVATE int vm_jit_step(vm_context* ctx) {
+	uint32_t generation = ctx->jit->generation;
+	vm_step(ctx);
+	ctx->syncFlags();
+	return ctx->jit->generation != generation || ctx->stopRequested ? 1 : 0;
+}
+
+// ---------------------------------------------------------
+//  called by translated code for a BRK. Returns 1 if there
+//  is no handler and the program ends.
+// ---------------------------------------------------------
+PRIVATE int vm_jit_brk(vm_context* ctx) {
+	bool running = vm_step(ctx);
+	ctx->syncFlags();
+	return running ? 0 : 1;
+}
+
+// ---------------------------------------------------------
+//  host register holding the index of the mode
+// ---------------------------------------------------------
+PRIVATE int vm_jit_index_register(vm_addressing_mode mode) {
+	if (mode == ABSOLUTE_Y || mode == ZERO_PAGE_Y) {
+		return JIT_R14;
+	}
+	return JIT_R13;
+}
+
+// ---------------------------------------------------------
+//  ecx = effective address of an indexed mode
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_address(vm_jit* jit, vm_addressing_mode mode, int operand) {
+	vm_jit_mov(jit, JIT_RCX, vm_jit_index_register(mode));
+	vm_jit_alu_imm(jit, false, JIT_ADD, JIT_RCX, operand);
+	bool zeroPage = mode == ZERO_PAGE_X || mode == ZERO_PAGE_Y;
+	vm_jit_alu_imm(jit, false, JIT_AND, JIT_RCX, zeroPage ? 0xFF : 0xFFFF);
+}
+
+// ---------------------------------------------------------
+//  jump forward if the page of the address in ecx belongs
+//  to a device
+// ---------------------------------------------------------
+PRIVATE uint32_t vm_jit_emit_device_check(vm_jit* jit) {
+	vm_jit_mov_imm64(jit, JIT_RDX, jit->devicePages);
+	vm_jit_mov(jit, JIT_RAX, JIT_RCX);
+	vm_jit_shift(jit, JIT_SHR, JIT_RAX, 8);
+	vm_jit_cmp_mem8(jit, JIT_RDX, JIT_RAX, 0, 0);
+	return vm_jit_jcc_forward(jit, JIT_NE);
+}
+
+// ---------------------------------------------------------
+//  store the live registers and the program counter, so
+//  device and watch callbacks see the current state
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_sync(vm_jit* jit, uint16_t pc) {
+	vm_jit_save_registers(jit);
+	vm_jit_store_pc(jit, pc);
+}
+
+// ---------------------------------------------------------
+//  eax = value of the operand. Device pages are read
+//  through vm_context::read.
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_read(vm_jit* jit, vm_addressing_mode mode, int operand, bool pageCross, uint16_t pc) {
+	int mem = offsetof(vm_context, mem);
+	if (mode == IMMEDIDATE) {
+		vm_jit_mov_imm(jit, JIT_RAX, operand);
+	}
+	else if (mode == ZERO_PAGE || mode == ABSOLUTE_ADR) {
+		if (jit->devicePages[operand >> 8] != 0) {
+			vm_jit_emit_sync(jit, pc);
+			vm_jit_mov_imm(jit, JIT_RSI, operand);
+			vm_jit_mov64(jit, JIT_RDI, JIT_RBX);
+			vm_jit_call(jit, (const void*)&vm_jit_read);
+		}
+		else {
+			vm_jit_load8(jit, JIT_RAX, JIT_RBX, JIT_NO_INDEX, mem + operand);
+		}
+	}
+	else {
+		vm_jit_emit_address(jit, mode, operand);
+		if (jit->devices) {
+			uint32_t slow = vm_jit_emit_device_check(jit);
+			vm_jit_load8(jit, JIT_RAX, JIT_RBX, JIT_RCX, mem);
+			uint32_t done = vm_jit_jmp_forward(jit);
+			vm_jit_bind(jit, slow);
+			vm_jit_emit_sync(jit, pc);
+			vm_jit_mov(jit, JIT_RSI, JIT_RCX);
+			vm_jit_mov64(jit, JIT_RDI, JIT_RBX);
+			vm_jit_call(jit, (const void*)&vm_jit_read);
+			vm_jit_bind(jit, done);
+		}
+		else {
+			vm_jit_load8(jit, JIT_RAX, JIT_RBX, JIT_RCX, mem);
+		}
+		if (pageCross) {
+			vm_jit_mov(jit, JIT_RDX, vm_jit_index_register(mode));
+			vm_jit_alu_imm(jit, false, JIT_ADD, JIT_RDX, operand & 0xFF);
+			vm_jit_shift(jit, JIT_SHR, JIT_RDX, 8);
+			vm_jit_add_cycles_reg(jit, JIT_RDX);
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  store register. Pages containing code or belonging to
+//  a device are written through vm_context::write. Direct
+//  stores mark the page as dirty themselves.
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_write(vm_jit* jit, int reg, vm_addressing_mode mode, int operand, uint16_t pc, uint16_t next) {
+	int mem = offsetof(vm_context, mem);
+	int dirty = offsetof(vm_context, dirtyPages);
+	uint32_t slow = 0;
+	uint32_t device = 0;
+	uint32_t done = 0;
+	if (mode == ZERO_PAGE || mode == ABSOLUTE_ADR) {
+		if (jit->devicePages[operand >> 8] == 0) {
+			vm_jit_mov_imm64(jit, JIT_RDX, jit->codePages);
+			vm_jit_cmp_mem8(jit, JIT_RDX, JIT_NO_INDEX, operand >> 8, 0);
+			slow = vm_jit_jcc_forward(jit, JIT_NE);
+			vm_jit_store8(jit, reg, JIT_RBX, JIT_NO_INDEX, mem + operand);
+			vm_jit_or_mem8(jit, JIT_RBX, JIT_NO_INDEX, dirty + (operand >> 11), 1 << ((operand >> 8) & 7));
+			done = vm_jit_jmp_forward(jit);
+			vm_jit_bind(jit, slow);
+		}
+		vm_jit_mov_imm(jit, JIT_RSI, operand);
+	}
+	else {
+		vm_jit_emit_address(jit, mode, operand);
+		if (jit->devices) {
+			device = vm_jit_emit_device_check(jit);
+		}
+		vm_jit_mov_imm64(jit, JIT_RDX, jit->codePages);
+		vm_jit_mov(jit, JIT_RAX, JIT_RCX);
+		vm_jit_shift(jit, JIT_SHR, JIT_RAX, 8);
+		vm_jit_cmp_mem8(jit, JIT_RDX, JIT_RAX, 0, 0);
+		slow = vm_jit_jcc_forward(jit, JIT_NE);
+		vm_jit_store8(jit, reg, JIT_RBX, JIT_RCX, mem);
+		vm_jit_bts_mem(jit, JIT_RBX, dirty, JIT_RAX);
+		done = vm_jit_jmp_forward(jit);
+		vm_jit_bind(jit, slow);
+		if (jit->devices) {
+			vm_jit_bind(jit, device);
+		}
+		vm_jit_mov(jit, JIT_RSI, JIT_RCX);
+	}
+	vm_jit_emit_sync(jit, pc);
+	vm_jit_mov(jit, JIT_RDX, reg);
+	vm_jit_mov64(jit, JIT_RDI, JIT_RBX);
+	vm_jit_call(jit, (const void*)&vm_jit_write);
+	vm_jit_alu(jit, JIT_TEST_RR, JIT_RAX, JIT_RAX);
+	uint32_t cont = vm_jit_jcc_forward(jit, JIT_E);
+	vm_jit_store_pc(jit, next);
+	vm_jit_jmp(jit, jit->exitDynamic);
+	vm_jit_bind(jit, cont);
+	if (done != 0) {
+		vm_jit_bind(jit, done);
+	}
+}
+
+// ---------------------------------------------------------
+//  set Z and N from eax
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_zn(vm_jit* jit) {
+	vm_jit_alu_imm(jit, false, JIT_AND, JIT_RBP, 0x7B);
+	vm_jit_mov(jit, JIT_RCX, JIT_RAX);
+	vm_jit_alu_imm(jit, false, JIT_AND, JIT_RCX, 0x80);
+	vm_jit_alu(jit, JIT_OR_RR, JIT_RBP, JIT_RCX);
+	vm_jit_alu(jit, JIT_TEST_RR, JIT_RAX, JIT_RAX);
+	vm_jit_setcc(jit, JIT_E, JIT_RCX);
+	vm_jit_movzx(jit, JIT_RCX, JIT_RCX);
+	vm_jit_shift(jit, JIT_SHL, JIT_RCX, vm_flags::Z);
+	vm_jit_alu(jit, JIT_OR_RR, JIT_RBP, JIT_RCX);
+}
+
+// ---------------------------------------------------------
+//  set one flag to the condition cc
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_flag(vm_jit* jit, int cc, int flag) {
+	vm_jit_setcc(jit, cc, JIT_RAX);
+	vm_jit_movzx(jit, JIT_RAX, JIT_RAX);
+	vm_jit_shift(jit, JIT_SHL, JIT_RAX, flag);
+	vm_jit_alu(jit, JIT_OR_RR, JIT_RBP, JIT_RAX);
+}
+
+// ---------------------------------------------------------
+//  compare a register with a constant like vm_op_cmp
+// ---------------------------------------------------------
+PRIVATE void vm_jit_emit_compare(vm_jit* jit, int reg, int value) {
+	vm_jit_alu_imm(jit, false, JIT_AND, JIT_RBP, 0xFF & ~((1 << vm_flags::Z) | (1 << vm_flags::C)));
+	if (value <= 255) {
+		vm_jit_alu_imm(jit, false, JIT_CMP, reg, value);
+		vm_jit_emit_flag(jit, JIT_E, vm_flags::Z);
+		vm_jit_alu_imm(jit, false, JIT_CMP, reg, value);
+		vm_jit_emit_flag(jit, JIT_AE, vm_flags::C);
+	}
+}
+
+// ---------------------------------------------------------
+//  translate a single instruction which does not end the
+//  block. Returns false if it is not supported.
+// ---------------------------------------------------------
+PRIVATE bool vm_jit_translate(vm_jit* jit, const vm_decode_entry& entry, int operand, uint16_t next, int* pending) {
+	vm_addressing_mode mode = entry.mode;
+	uint16_t pc = next - entry.dataSize - 1;
+	bool constant = mode == IMMEDIDATE || mode == ZERO_PAGE || mode == ABSOLUTE_ADR;
+	bool memory = mode == ZERO_PAGE || mode == ZERO_PAGE_X || mode == ZERO_PAGE_Y || mode == ABSOLUTE_ADR || mode == ABSOLUTE_X || mode == ABSOLUTE_Y;
+	int reg = 0;
+	switch (entry.op_code) {
+		case LDA: case LDX: case LDY:
+			if (!constant && !memory) {
+				return false;
+			}
+			reg = VM_JIT_REGISTERS[entry.op_code == LDA ? vm_registers::A : entry.op_code == LDX ? vm_registers::X : vm_registers::Y];
+			vm_jit_emit_read(jit, mode, operand, entry.pageCross, pc);
+			vm_jit_mov(jit, reg, JIT_RAX);
+			vm_jit_emit_zn(jit);
+			return true;
+		case STA: case STX: case STY:
+			if (!memory) {
+				return false;
+			}
+			reg = VM_JIT_REGISTERS[entry.op_code == STA ? vm_registers::A : entry.op_code == STX ? vm_registers::X : vm_registers::Y];
+			vm_jit_add_cycles(jit, *pending);
+			*pending = 0;
+			vm_jit_emit_write(jit, reg, mode, operand, pc, next);
+			return true;
+		case TAX: case TAY: case TXA: case TYA:
+			if (entry.op_code == TAX || entry.op_code == TAY) {
+				reg = VM_JIT_REGISTERS[entry.op_code == TAX ? vm_registers::X : vm_registers::Y];
+				vm_jit_mov(jit, reg, JIT_R12);
+			}
+			else {
+				reg = JIT_R12;
+				vm_jit_mov(jit, reg, entry.op_code == TXA ? JIT_R13 : JIT_R14);
+			}
+			vm_jit_mov(jit, JIT_RAX, reg);
+			vm_jit_emit_zn(jit);
+			return true;
+		case INX: case INY: case DEX: case DEY:
+			reg = entry.op_code == INX || entry.op_code == DEX ? JIT_R13 : JIT_R14;
+			vm_jit_incdec8(jit, entry.op_code == INX || entry.op_code == INY ? 0 : 1, reg);
+			vm_jit_mov(jit, JIT_RAX, reg);
+			vm_jit_emit_zn(jit);
+			return true;
+		case CMP: case CPX: case CPY:
+			if (!constant) {
+				return false;
+			}
+			reg = VM_JIT_REGISTERS[entry.op_code == CMP ? vm_registers::A : entry.op_code == CPX ? vm_registers::X : vm_registers::Y];
+			vm_jit_emit_compare(jit, reg, operand);
+			return true;
+		case CLC: case CLD: case CLV:
+			reg = entry.op_code == CLC ? vm_flags::C : entry.op_code == CLD ? vm_flags::D : vm_flags::V;
+			vm_jit_alu_imm(jit, false, JIT_AND, JIT_RBP, 0xFF & ~(1 << reg));
+			return true;
+		case SEC: case SED: case SEI:
+			reg = entry.op_code == SEC ? vm_flags::C : entry.op_code == SED ? vm_flags::D : vm_flags::I;
+			vm_jit_alu_imm(jit, false, JIT_OR, JIT_RBP, 1 << reg);
+			return true;
+		case NOP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// ---------------------------------------------------------
+//  translate the block starting at pc
+// ---------------------------------------------------------
+PRIVATE vm_jit_block* vm_jit_compile(vm_context* ctx, uint16_t start) {
+	vm_jit* jit = ctx->jit;
+	vm_jit_block* block = new vm_jit_block;
+	block->start = start;
+	block->code = (uint32_t)jit->used;
+	// leave for vm_run_jit once an event is due
+	vm_jit_load64(jit, JIT_RAX, JIT_RBX, offsetof(vm_context, cycles));
+	vm_jit_cmp_mem64(jit, JIT_RAX, JIT_RBX, offsetof(vm_context, nextEvent));
+	uint32_t body = vm_jit_jcc_forward(jit, JIT_B);
+	vm_jit_store_pc(jit, start);
+	vm_jit_jmp(jit, jit->exitDynamic);
+	vm_jit_bind(jit, body);
+	int pc = start;
+	int pending = 0;
+	int count = 0;
+	bool open = true;
+	while (open) {
+		uint8_t hex = ctx->fetch(pc);
+		const vm_decode_entry& entry = VM_DECODE_TABLE[hex];
+		int next = pc + entry.dataSize + 1;
+		int operand = vm_block_operand(ctx, pc, entry.mode);
+		pending += entry.cycles;
+		++count;
+		if (entry.op_code == BRK) {
+			// vm_step enters the handler or ends the program
+			vm_jit_add_cycles(jit, pending - entry.cycles);
+			vm_jit_save_registers(jit);
+			vm_jit_store_pc(jit, pc);
+			vm_jit_mov64(jit, JIT_RDI, JIT_RBX);
+			vm_jit_call(jit, (const void*)&vm_jit_brk);
+			vm_jit_load_registers(jit);
+			vm_jit_alu(jit, JIT_TEST_RR, JIT_RAX, JIT_RAX);
+			vm_jit_jcc(jit, JIT_E, jit->exitDynamic);
+			vm_jit_jmp(jit, jit->exitCommon);
+			open = false;
+		}
+		else if (entry.mode == RELATIVE_ADR) {
+			int flag = 0;
+			bool set = false;
+			vm_branch_condition(entry.op_code, &flag, &set);
+			uint16_t target = vm_relative_target(pc, operand);
+			vm_jit_add_cycles(jit, pending);
+			vm_jit_test_imm(jit, JIT_RBP, 1 << flag);
+			uint32_t taken = vm_jit_jcc_forward(jit, set ? JIT_NE : JIT_E);
+			vm_jit_exit(jit, pc + 2);
+			vm_jit_bind(jit, taken);
+			vm_jit_add_cycles(jit, vm_branch_penalty(pc + 2, target));
+			vm_jit_exit(jit, target);
+			open = false;
+		}
+		else if (entry.op_code == JMP && entry.mode == JMP_ABSOLUTE) {
+			vm_jit_add_cycles(jit, pending);
+			vm_jit_exit(jit, operand);
+			open = false;
+		}
+		else if (!vm_jit_translate(jit, entry, operand, next, &pending)) {
+			// vm_step counts the cycles of the instruction itself
+			vm_jit_add_cycles(jit, pending - entry.cycles);
+			pending = 0;
+			vm_jit_save_registers(jit);
+			vm_jit_store_pc(jit, pc);
+			vm_jit_mov64(jit, JIT_RDI, JIT_RBX);
+			vm_jit_call(jit, (const void*)&vm_jit_step);
+			vm_jit_load_registers(jit);
+			if (entry.modifyPC || entry.op_code == RTI) {
+				vm_jit_jmp(jit, jit->exitDynamic);
+				open = false;
+			}
+			else {
+				vm_jit_alu(jit, JIT_TEST_RR, JIT_RAX, JIT_RAX);
+				vm_jit_jcc(jit, JIT_NE, jit->exitDynamic);
+			}
+		}
+		if (open && (next >= jit->end || next > 0xFFFF || count >= VM_JIT_MAX_OPS)) {
+			vm_jit_add_cycles(jit, pending);
+			vm_jit_exit(jit, next);
+			open = false;
+		}
+		pc = next;
+	}
+	block->end = pc;
+	int last = (block->end - 1) >> 8;
+	for (int p = block->start >> 8; p <= last && p < 256; ++p) {
+		jit->pages[p].push_back(block);
+		++jit->codePages[p];
+	}
+	jit->blocks[start] = block;
+	std::map<uint16_t, std::vector<uint32_t> >::iterator it = jit->pending.find(start);
+	if (it != jit->pending.end()) {
+		for (size_t i = 0; i < it->second.size(); ++i) {
+			vm_jit_chain(jit, it->second[i], block);
+		}
+		jit->pending.erase(it);
+	}
+	return block;
+}
+
+// ---------------------------------------------------------
+//  run program using the JIT
+// ---------------------------------------------------------
+void vm_run_jit(vm_context* ctx) {
+	if (ctx->trace != nullptr || ctx->profile != nullptr || ctx->callGraph != nullptr) {
+		vm_run(ctx);
+		return;
+	}
+	if (ctx->jit == nullptr) {
+		ctx->jit = vm_jit_create(ctx);
+		if (ctx->jit == nullptr) {
+			vm_run_fast(ctx);
+			return;
+		}
+	}
+	vm_jit* jit = ctx->jit;
+	int end = 0x600 + ctx->numBytes;
+	if (jit->end != end) {
+		vm_jit_set_writable(jit, true);
+		vm_jit_flush(jit);
+		jit->end = end;
+	}
+	vm_jit_entry entry = (vm_jit_entry)(void*)jit->code;
+	ctx->programCounter = 0x600;
+	// translated code keeps N and Z in the flags register
+	ctx->syncFlags();
+	// and accesses mem directly
+	vm_unshare(ctx);
+	ctx->stopRequested = false;
+	while (ctx->programCounter < end) {
+		if (ctx->cycles >= ctx->nextEvent) {
+			vm_dispatch_events(ctx);
+			ctx->syncFlags();
+			if (ctx->stopRequested) {
+				break;
+			}
+			continue;
+		}
+		if (!jit->invalidated.empty()) {
+			vm_jit_set_writable(jit, true);
+			vm_jit_release_invalidated(jit);
+		}
+		vm_jit_block* block = jit->blocks[ctx->programCounter];
+		if (block == nullptr) {
+			vm_jit_set_writable(jit, true);
+			if (VM_JIT_CODE_SIZE - jit->used < VM_JIT_BLOCK_RESERVE) {
+				vm_jit_flush(jit);
+			}
+			block = vm_jit_compile(ctx, ctx->programCounter);
+		}
+		vm_jit_set_writable(jit, false);
+		if ((*entry)(ctx, jit->code + block->code) != 0) {
+			break;
+		}
+	}
+}
+
+#else
+// ---------------------------------------------------------
+//  without JIT support vm_run_jit uses the fast run loop
+// ---------------------------------------------------------
+void vm_run_jit(vm_context* ctx) {
+	if (ctx->trace != nullptr || ctx->profile != nullptr || ctx->callGraph != nullptr) {
+		vm_run(ctx);
+		return;
+	}
+	vm_run_fast(ctx);
+}
+
+void vm_jit_release(vm_context* ctx) {
+}
+
+void vm_jit_invalidate(vm_context* ctx, uint16_t address) {
+}
+#endif
+
+// ---------------------------------------------------------
+// Static recompiler
+//
+// Translates the program into a C++ translation unit. The
+// program is split into blocks starting at 0x600, at every
+// branch and jump target and after every branch. Every
+// block becomes one function keeping the registers in
+// locals and returning the next program counter or -1 after
+// a BRK. The entry function dispatches on the program
+// counter and uses vm_step for every address which is not
+// the start of a block, so computed targets still work.
+// ---------------------------------------------------------
+const static char* VM_AOT_HEADER =
+	"#include \"6502.h\"\n"
+	"\n"
+	"#define VM_AOT_LOAD ctx->syncFlags(); a = ctx->registers[0]; x = ctx->registers[1]; y = ctx->registers[2]; f = ctx->flags\n"
+	"#define VM_AOT_SAVE(pc) ctx->registers[0] = a; ctx->registers[1] = x; ctx->registers[2] = y; ctx->flags = f; ctx->cycles += cycles; cycles = 0; ctx->programCounter = (pc)\n"
+	"#define VM_AOT_EXIT(pc) do { VM_AOT_SAVE(pc); return (pc); } while (0)\n"
+	"#define VM_AOT_ZN(v) f = (uint8_t)((f & 0x7B) | ((v) & 0x80) | ((v) == 0 ? 0x04 : 0))\n"
+	"#define VM_AOT_ZN_INT(v) f = (uint8_t)((f & 0x7B) | ((v) > 127 ? 0x80 : 0) | ((v) == 0 ? 0x04 : 0))\n"
+	"#define VM_AOT_COMPARE(r, d) f = (uint8_t)((f & 0xF9) | ((r) == (d) ? 0x04 : 0) | ((r) >= (d) ? 0x02 : 0))\n"
+	"#define VM_AOT_ADD(t) f = (uint8_t)(((t) > 255 ? f | 0x02 : f) & 0xFB); a = (uint8_t)(t); if ((t) == 0) f |= 0x04; { int c = (t) > 255 ? 256 - (t) : (t); f = (uint8_t)(c <= -128 || c >= 127 ? f | 0x40 : f & 0xBF); }\n"
+	"\n";
+
+// ---------------------------------------------------------
+//  C++ expression of the data get_data returns
+// ---------------------------------------------------------
+PRIVATE void vm_aot_data(char* buffer, size_t size, vm_addressing_mode mode, int operand) {
+	switch (mode) {
+		case ZERO_PAGE_X: sprintf_s(buffer, size, "((0x%02X + x) & 0xFF)", operand); break;
+		case ZERO_PAGE_Y: sprintf_s(buffer, size, "((0x%02X + y) & 0xFF)", operand); break;
+		case ABSOLUTE_X: sprintf_s(buffer, size, "(0x%04X + x)", operand); break;
+		case ABSOLUTE_Y: sprintf_s(buffer, size, "(0x%04X + y)", operand); break;
+		case JMP_INDIRECT: sprintf_s(buffer, size, "ctx->readInt(0x%04X)", operand); break;
+		case ACCUMULATOR: sprintf_s(buffer, size, "-1"); break;
+		default: sprintf_s(buffer, size, "0x%X", operand); break;
+	}
+}
+
+// ---------------------------------------------------------
+//  C++ statement of a single instruction. Returns false if
+//  the instruction is not translated.
+// ---------------------------------------------------------
+PRIVATE bool vm_aot_translate(char* buffer, size_t size, const vm_decode_entry& entry, const char* data) {
+	const char* NAMES[] = { "a", "x", "y" };
+	vm_addressing_mode mode = entry.mode;
+	bool memory = mode != IMMEDIDATE && mode != NONE && mode != ACCUMULATOR && mode != RELATIVE_ADR;
+	// vm_step reads the pointer and adds the page penalty
+	if (mode == INDIRECT_X || mode == INDIRECT_Y) {
+		return false;
+	}
+	switch (entry.op_code) {
+		case LDA: case LDX: case LDY: {
+			const char* r = NAMES[entry.op_code - LDA];
+			if (mode == IMMEDIDATE) {
+				sprintf_s(buffer, size, "%s = (uint8_t)%s; VM_AOT_ZN(%s);", r, data, r);
+			}
+			else {
+				sprintf_s(buffer, size, "%s = ctx->read(%s); VM_AOT_ZN(%s);", r, data, r);
+			}
+			return true;
+		}
+		case STA: case STX: case STY:
+			if (!memory) {
+				return false;
+			}
+			sprintf_s(buffer, size, "ctx->write(%s, %s);", data, NAMES[entry.op_code - STA]);
+			return true;
+		case TAX: sprintf_s(buffer, size, "x = a; VM_AOT_ZN(x);"); return true;
+		case TAY: sprintf_s(buffer, size, "y = a; VM_AOT_ZN(y);"); return true;
+		case TXA: sprintf_s(buffer, size, "a = x; VM_AOT_ZN(a);"); return true;
+		case TYA: sprintf_s(buffer, size, "a = y; VM_AOT_ZN(a);"); return true;
+		case INX: sprintf_s(buffer, size, "++x; VM_AOT_ZN(x);"); return true;
+		case INY: sprintf_s(buffer, size, "++y; VM_AOT_ZN(y);"); return true;
+		case DEX: sprintf_s(buffer, size, "--x; VM_AOT_ZN(x);"); return true;
+		case DEY: sprintf_s(buffer, size, "--y; VM_AOT_ZN(y);"); return true;
+		case INC: case DEC:
+			if (!memory) {
+				return false;
+			}
+			sprintf_s(buffer, size, "{ int v = ctx->read(%s) %c 1; ctx->write(%s, (uint8_t)v); VM_AOT_ZN_INT(v); }", data, entry.op_code == INC ? '+' : '-', data);
+			return true;
+		case CMP: sprintf_s(buffer, size, "VM_AOT_COMPARE(a, %s);", data); return true;
+		case CPX: sprintf_s(buffer, size, "VM_AOT_COMPARE(x, %s);", data); return true;
+		case CPY: sprintf_s(buffer, size, "VM_AOT_COMPARE(y, %s);", data); return true;
+		case AND: sprintf_s(buffer, size, "{ int v = a & %s; VM_AOT_ZN_INT(v); }", data); return true;
+		case ORA: sprintf_s(buffer, size, "{ uint8_t v = ctx->read(%s) | a; VM_AOT_ZN(v); }", data); return true;
+		case EOR: sprintf_s(buffer, size, "{ uint8_t v = ctx->read(%s) ^ a; VM_AOT_ZN(v); }", data); return true;
+		case BIT: sprintf_s(buffer, size, "f = (uint8_t)((f & 0xFB) | ((ctx->read(%s) & a) == 0 ? 0x04 : 0));", data); return true;
+		case ADC: sprintf_s(buffer, size, memory ? "{ int t = a + ctx->read(%s) + ((f & 0x02) ? 1 : 0); VM_AOT_ADD(t); }" : "{ int t = a + %s + ((f & 0x02) ? 1 : 0); VM_AOT_ADD(t); }", data); return true;
+		case SBC: sprintf_s(buffer, size, memory ? "{ int t = a - (ctx->read(%s) - ((f & 0x02) ? 1 : 0)); VM_AOT_ADD(t); }" : "{ int t = a - (%s - ((f & 0x02) ? 1 : 0)); VM_AOT_ADD(t); }", data); return true;
+		case CLC: sprintf_s(buffer, size, "f &= 0xFD;"); return true;
+		case CLI: sprintf_s(buffer, size, "f &= 0xF7;"); return true;
+		case CLD: sprintf_s(buffer, size, "f &= 0xEF;"); return true;
+		case CLV: sprintf_s(buffer, size, "f &= 0xBF;"); return true;
+		case SEC: sprintf_s(buffer, size, "f |= 0x02;"); return true;
+		case SEI: sprintf_s(buffer, size, "f |= 0x08;"); return true;
+		case SED: sprintf_s(buffer, size, "f |= 0x10;"); return true;
+		case NOP: sprintf_s(buffer, size, ";"); return true;
+		default: return false;
+	}
+}
+
+// ---------------------------------------------------------
+//  find all block starts
+// ---------------------------------------------------------
+PRIVATE void vm_aot_find_blocks(const vm_context* ctx, std::vector<bool>& starts) {
+	int end = 0x600 + ctx->numBytes;
+	std::vector<bool> visited(65536, false);
+	std::vector<int> todo;
+	todo.push_back(0x600);
+	starts[0x600] = true;
+	while (!todo.empty()) {
+		int pc = todo.back();
+		todo.pop_back();
+		bool open = true;
+		while (open && !visited[pc]) {
+			visited[pc] = true;
+			const vm_decode_entry& entry = VM_DECODE_TABLE[ctx->fetch(pc)];
+			int next = pc + entry.dataSize + 1;
+			int target = -1;
+			if (entry.mode == RELATIVE_ADR) {
+				target = vm_relative_target(pc, ctx->fetch(pc + 1));
+				// branches always continue at pc + 2
+				if (pc + 2 < end) {
+					starts[pc + 2] = true;
+					todo.push_back(pc + 2);
+				}
+				open = false;
+			}
+			else if (entry.modifyPC || entry.op_code == BRK || entry.op_code == RTI) {
+				if (entry.mode == JMP_ABSOLUTE) {
+					target = ctx->fetchInt(pc + 1);
+				}
+				// RTS returns behind the JSR
+				if (entry.op_code == JSR && pc + 3 < end) {
+					starts[pc + 3] = true;
+					todo.push_back(pc + 3);
+				}
+				open = false;
+			}
+			if (target >= 0x600 && target < end) {
+				starts[target] = true;
+				todo.push_back(target);
+			}
+			if (next >= end) {
+				open = false;
+			}
+			pc = next;
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  recompile the program into C++
+// ---------------------------------------------------------
+bool vm_recompile(vm_context* ctx, const char* name, std::string& out) {
+	if (ctx->numBytes == 0) {
+		sprintf_s(ctx->debug, "No code to recompile");
+		return false;
+	}
+	int end = 0x600 + ctx->numBytes;
+	std::vector<bool> starts(65536, false);
+	vm_aot_find_blocks(ctx, starts);
+	char buffer[512];
+	char data[64];
+	char statement[384];
+	sprintf_s(buffer, "// generated by vm_recompile from %d bytes at 0x0600\n", ctx->numBytes);
+	out = buffer;
+	out += VM_AOT_HEADER;
+	int numBlocks = 0;
+	for (int start = 0x600; start < end; ++start) {
+		if (!starts[start]) {
+			continue;
+		}
+		++numBlocks;
+		sprintf_s(buffer, "static int %s_%04X(vm_context* ctx) {\n\tuint8_t a, x, y, f;\n\tuint64_t cycles = 0;\n\tVM_AOT_LOAD;\n", name, start);
+		out += buffer;
+		int pc = start;
+		bool open = true;
+		while (open) {
+			const vm_decode_entry& entry = VM_DECODE_TABLE[ctx->fetch(pc)];
+			int next = pc + entry.dataSize + 1;
+			int operand = vm_block_operand(ctx, pc, entry.mode);
+			vm_aot_data(data, sizeof(data), entry.mode, operand);
+			sprintf_s(buffer, "\t// %04X %s\n", pc, get_command_name(entry.op_code));
+			out += buffer;
+			if (entry.op_code == BRK) {
+				sprintf_s(buffer, "\tVM_AOT_SAVE(0x%04X);\n\treturn vm_step(ctx) ? ctx->programCounter : -1;\n", pc);
+				out += buffer;
+				open = false;
+			}
+			else if (entry.mode == RELATIVE_ADR) {
+				int flag = 0;
+				bool set = false;
+				vm_branch_condition(entry.op_code, &flag, &set);
+				uint16_t target = vm_relative_target(pc, operand);
+				sprintf_s(buffer, "\tcycles += %d;\n\tif (%s(f & 0x%02X)) {\n\t\tcycles += %d;\n\t\tVM_AOT_EXIT(0x%04X);\n\t}\n\tVM_AOT_EXIT(0x%04X);\n",
+					entry.cycles, set ? "" : "!", 1 << flag, vm_branch_penalty(pc + 2, target), target, (uint16_t)(pc + 2));
+				out += buffer;
+				open = false;
+			}
+			else if (entry.op_code == JMP && entry.mode == JMP_ABSOLUTE) {
+				sprintf_s(buffer, "\tcycles += %d;\n\tVM_AOT_EXIT(0x%04X);\n", entry.cycles, operand);
+				out += buffer;
+				open = false;
+			}
+			else if ((entry.op_code == ADC || entry.op_code == SBC) && vm_aot_translate(statement, sizeof(statement), entry, data)) {
+				// the decimal mode is only known at runtime
+				sprintf_s(buffer, "\tif (f & 0x10) {\n\t\tVM_AOT_SAVE(0x%04X);\n\t\tvm_step(ctx);\n\t\tVM_AOT_LOAD;\n\t}\n\telse {\n", pc);
+				out += buffer;
+				if (entry.pageCross && (entry.mode == ABSOLUTE_X || entry.mode == ABSOLUTE_Y)) {
+					sprintf_s(buffer, "\t\tcycles += (0x%02X + %c) >> 8;\n", operand & 0xFF, entry.mode == ABSOLUTE_X ? 'x' : 'y');
+					out += buffer;
+				}
+				sprintf_s(buffer, "\t\tcycles += %d;\n\t\t%s\n\t}\n", entry.cycles, statement);
+				out += buffer;
+			}
+			else if (vm_aot_translate(statement, sizeof(statement), entry, data)) {
+				if (entry.pageCross && (entry.mode == ABSOLUTE_X || entry.mode == ABSOLUTE_Y)) {
+					sprintf_s(buffer, "\tcycles += (0x%02X + %c) >> 8;\n", operand & 0xFF, entry.mode == ABSOLUTE_X ? 'x' : 'y');
+					out += buffer;
+				}
+				sprintf_s(buffer, "\tcycles += %d;\n\t%s\n", entry.cycles, statement);
+				out += buffer;
+			}
+			else if (entry.modifyPC || entry.op_code == RTI) {
+				sprintf_s(buffer, "\tVM_AOT_SAVE(0x%04X);\n\tvm_step(ctx);\n\treturn ctx->programCounter;\n", pc);
+				out += buffer;
+				open = false;
+			}
+			else {
+				sprintf_s(buffer, "\tVM_AOT_SAVE(0x%04X);\n\tvm_step(ctx);\n\tVM_AOT_LOAD;\n", pc);
+				out += buffer;
+			}
+			if (open && (next >= end || starts[next])) {
+				sprintf_s(buffer, "\tVM_AOT_EXIT(0x%04X);\n", (uint16_t)next);
+				out += buffer;
+				open = false;
+			}
+			pc = next;
+		}
+		out += "}\n\n";
+	}
+	sprintf_s(buffer, "void %s(vm_context* ctx) {\n\tint pc = 0x0600;\n\tctx->programCounter = 0x0600;\n\tdo {\n\t\tswitch (pc) {\n", name);
+	out += buffer;
+	for (int start = 0x600; start < end; ++start) {
+		if (starts[start]) {
+			sprintf_s(buffer, "\t\t\tcase 0x%04X: pc = %s_%04X(ctx); break;\n", start, name, start);
+			out += buffer;
+		}
+	}
+	sprintf_s(buffer, "\t\t\tdefault:\n\t\t\t\tctx->programCounter = pc;\n\t\t\t\tpc = vm_step(ctx) ? ctx->programCounter : -1;\n\t\t\t\tbreak;\n\t\t}\n\t} while (pc >= 0 && pc < 0x%04X);\n}\n", end);
+	out += buffer;
+	sprintf_s(ctx->debug, "Recompiled %d bytes into %d blocks", ctx->numBytes, numBlocks);
+	return true;
+}
+
+// ---------------------------------------------------------
+//  recompile the program into a C++ file
+// ---------------------------------------------------------
+bool vm_recompile_file(vm_context* ctx, const char* name, const char* fileName) {
+	std::string code;
+	if (!vm_recompile(ctx, name, code)) {
+		return false;
+	}
+	FILE* fp = fopen(fileName, "wb");
+	if (fp) {
+		fwrite(code.c_str(), 1, code.size(), fp);
+		fclose(fp);
+		return true;
+	}
+	sprintf_s(ctx->debug, "Cannot write file '%s'", fileName);
+	return false;
+}
+
+// ---------------------------------------------------------
+//  recompile the program into a C++ file
+// ---------------------------------------------------------
+bool vm_recompile_file(const char* name, const char* fileName) {
+	if (_internal_ctx != nullptr) {
+		return vm_recompile_file(_internal_ctx, name, fileName);
+	}
+	return false;
+}
+
+// ---------------------------------------------------------
+//  internal run a single batch job on the given context
+// ---------------------------------------------------------
+PRIVATE void vm_run_batch_job(vm_context* ctx, const vm_batch_job& job, vm_batch_result& result) {
+	vm_dirty_reset(ctx, nullptr);
+	vm_reset(ctx);
+	ctx->clearFlags();
+	// the binary is clamped to the memory behind 0x600
+	int numBytes = job.numBytes < 0x10000 - 0x600 ? job.numBytes : 0x10000 - 0x600;
+	memcpy(ctx->mem + 0x600, job.binary, numBytes);
+	for (int i = 0x600 >> 8; i <= (0x600 + numBytes - 1) >> 8; ++i) {
+		ctx->markDirty(i << 8);
+	}
+	ctx->numBytes = numBytes;
+	for (size_t i = 0; i < job.memory.size(); ++i) {
+		const vm_memory_block& block = job.memory[i];
+		for (size_t j = 0; j < block.data.size(); ++j) {
+			ctx->write(block.address + j, block.data[j]);
+		}
+	}
+	uint64_t max = job.maxInstructions == 0 ? UINT64_MAX : job.maxInstructions;
+	vm_stop_reason reason;
+	result.instructions = vm_run_fast_loop(ctx, 0x600 + ctx->numBytes, max, UINT64_MAX, nullptr, &reason);
+	result.registers[vm_registers::A] = ctx->registers[vm_registers::A];
+	result.registers[vm_registers::X] = ctx->registers[vm_registers::X];
+	result.registers[vm_registers::Y] = ctx->registers[vm_registers::Y];
+	result.programCounter = ctx->programCounter;
+	result.sp = ctx->sp;
+	result.flags = ctx->getFlags();
+	result.memory.clear();
+	for (size_t i = 0; i < job.ranges.size(); ++i) {
+		const vm_memory_range& range = job.ranges[i];
+		for (int j = 0; j < range.length; ++j) {
+			result.memory.push_back(ctx->read(range.address + j));
+		}
+	}
+}
+
+// ---------------------------------------------------------
+//  Work queue of one batch worker. The owner takes jobs
+//  from the front and idle workers steal from the back.
+// ---------------------------------------------------------
+typedef struct vm_batch_queue {
+	std::mutex mutex;
+	std::deque<size_t> jobs;
+
+	bool pop_front(size_t* idx) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (jobs.empty()) {
+			return false;
+		}
+		*idx = jobs.front();
+		jobs.pop_front();
+		return true;
+	}
+
+	bool pop_back(size_t* idx) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (jobs.empty()) {
+			return false;
+		}
+		*idx = jobs.back();
+		jobs.pop_back();
+		return true;
+	}
+} vm_batch_queue;
+
+// ---------------------------------------------------------
+//  internal batch worker. Every worker owns a private
+//  context which is reused for all of its jobs.
+// ---------------------------------------------------------
+PRIVATE void vm_batch_worker(int self, std::vector<vm_batch_queue>* queues, const std::vector<vm_batch_job>* jobs, std::vector<vm_batch_result>* results) {
+	vm_context* ctx = vm_create_context();
+	int num = (int)queues->size();
+	size_t idx = 0;
+	for (;;) {
+		bool found = (*queues)[self].pop_front(&idx);
+		for (int i = 1; i < num && !found; ++i) {
+			found = (*queues)[(self + i) % num].pop_back(&idx);
+		}
+		if (!found) {
+			break;
+		}
+		vm_run_batch_job(ctx, (*jobs)[idx], (*results)[idx]);
+	}
+	vm_release(ctx);
+}
+
+// ---------------------------------------------------------
+//  run a batch of jobs on a pool of worker threads
+// ---------------------------------------------------------
+void vm_run_batch(const std::vector<vm_batch_job>& jobs, std::vector<vm_batch_result>& results, int numThreads) {
+	if (numThreads <= 0) {
+		numThreads = std::thread::hardware_concurrency();
+		if (numThreads <= 0) {
+			numThreads = 1;
+		}
+	}
+	if ((size_t)numThreads > jobs.size()) {
+		numThreads = jobs.size() > 0 ? (int)jobs.size() : 1;
+	}
+	results.resize(jobs.size());
+	std::vector<vm_batch_queue> queues(numThreads);
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		queues[i % numThreads].jobs.push_back(i);
+	}
+	std::vector<std::thread> threads;
+	for (int i = 1; i < numThreads; ++i) {
+		threads.push_back(std::thread(vm_batch_worker, i, &queues, &jobs, &results));
+	}
+	vm_batch_worker(0, &queues, &jobs, &results);
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+}
+
+// ---------------------------------------------------------
+//  load binary file
+// ---------------------------------------------------------
+bool vm_load(vm_context* ctx, const char* fileName) {
+	int pc = 0x600;
+	FILE* fp = fopen(fileName, "rb");
+	if (fp) {
+		// number of bytes and commands are stored as int
+		int header[2] = { 0, 0 };
+		std::vector<uint8_t> data;
+		bool valid = fread(header, sizeof(int), 2, fp) == 2 && header[0] >= 0 && header[0] <= 0x10000 - pc;
+		if (valid) {
+			data.resize(header[0]);
+			valid = fread(data.data(), 1, data.size(), fp) == data.size();
+		}
+		fclose(fp);
+		if (!valid) {
+			sprintf_s(ctx->debug, "File '%s' is not a valid binary", fileName);
+			return false;
+		}
+		ctx->numBytes = header[0];
+		ctx->numCommands = header[1];
+		for (size_t i = 0; i < data.size(); ++i) {
+			ctx->write(pc + i, data[i]);
+		}
+		sprintf_s(ctx->debug, "File '%s' loaded bytes: %d commands: %d\n", fileName, ctx->numBytes, ctx->numCommands);
+		return true;
+	}
+	sprintf_s(ctx->debug, "File '%s' not found", fileName);
+	return false;
+}
+
+// ---------------------------------------------------------
+//  load binary file
+// ---------------------------------------------------------
+bool vm_load(const char* fileName) {
+	if (_internal_ctx != nullptr) {
+		return vm_load(_internal_ctx, fileName);
+	}
+	return false;
+}
+
+// ---------------------------------------------------------
+//  save binary file
+// ---------------------------------------------------------
+bool vm_save(vm_context* ctx, const char* fileName) {
+	FILE* fp = fopen(fileName, "wb");
+	if (fp) {
+		int pc = 0x600;
+		int header[2] = { ctx->numBytes, ctx->numCommands };
+		std::vector<uint8_t> data(ctx->numBytes);
+		for (int i = 0; i < ctx->numBytes; ++i) {
+			data[i] = ctx->read(pc + i);
+		}
+		fwrite(header, sizeof(int), 2, fp);
+		fwrite(data.data(), 1, data.size(), fp);
+		fclose(fp);
+		sprintf_s(ctx->debug, "File %s written with %d num bytes", fileName, ctx->numBytes);
+		return true;
+	}
+	sprintf_s(ctx->debug, "Cannot write file %s", fileName);
+	return false;
+}
+
+// ---------------------------------------------------------
+//  save binary file
+// ---------------------------------------------------------
+bool vm_save(const char* fileName) {
+	if (_internal_ctx != nullptr) {
+		return vm_save(_internal_ctx, fileName);
+	}
+	return false;
+}
+
+// ---------------------------------------------------------
+//  Save state format. All values are little endian.
+//
+//  magic "6502", version (16 bit)
+//  A, X, Y, SP, flags (8 bit each)
+//  program counter, numCommands, numBytes (16 bit each)
+//  cycles (64 bit)
+//  number of pages (16 bit) followed by every page:
+//    page number, encoding (8 bit each)
+//    VM_STATE_RAW: the 256 bytes of the page
+//    VM_STATE_RLE: pairs of run length - 1 and value
+//  Empty pages and pages of devices are not stored.
+// ---------------------------------------------------------
+const static uint8_t VM_STATE_MAGIC[] = { '6', '5', '0', '2' };
+const static uint16_t VM_STATE_VERSION = 1;
+const static size_t VM_STATE_HEADER_SIZE = 27;
+const static uint8_t VM_STATE_RAW = 0;
+const static uint8_t VM_STATE_RLE = 1;
+
+PRIVATE void vm_state_put16(std::vector<uint8_t>& data, uint16_t v) {
+	data.push_back(v & 0xFF);
+	data.push_back(v >> 8);
+}
+
+PRIVATE uint16_t vm_state_get16(const uint8_t* data) {
+	return data[0] | (data[1] << 8);
+}
+
+// ---------------------------------------------------------
+//  run length encode a page. Returns the size which is
+//  at most 512 bytes.
+// ---------------------------------------------------------
+PRIVATE int vm_state_encode(const uint8_t* page, uint8_t* out) {
+	int size = 0;
+	int i = 0;
+	while (i < 256) {
+		int j = i + 1;
+		while (j < 256 && page[j] == page[i]) {
+			++j;
+		}
+		out[size++] = j - i - 1;
+		out[size++] = page[i];
+		i = j;
+	}
+	return size;
+}
+
+// ---------------------------------------------------------
+//  walk the pages of a state. Without a context the pages
+//  are only validated. Returns false if the data is
+//  truncated or broken.
+// ---------------------------------------------------------
+PRIVATE bool vm_state_pages(vm_context* ctx, const uint8_t* data, size_t size) {
+	size_t pos = VM_STATE_HEADER_SIZE;
+	int numPages = vm_state_get16(data + pos - 2);
+	for (int i = 0; i < numPages; ++i) {
+		if (size - pos < 2) {
+			return false;
+		}
+		int page = data[pos];
+		uint8_t encoding = data[pos + 1];
+		pos += 2;
+		bool ram = ctx != nullptr && (ctx->pageTypes[page] == RAM_PAGE || ctx->pageTypes[page] == WATCHED_PAGE);
+		uint8_t* dest = ram ? ctx->mem + (page << 8) : nullptr;
+		if (encoding == VM_STATE_RAW) {
+			if (size - pos < 256) {
+				return false;
+			}
+			if (dest != nullptr) {
+				memcpy(dest, data + pos, 256);
+			}
+			pos += 256;
+		}
+		else if (encoding == VM_STATE_RLE) {
+			int filled = 0;
+			while (filled < 256) {
+				if (size - pos < 2) {
+					return false;
+				}
+				int length = data[pos] + 1;
+				if (filled + length > 256) {
+					return false;
+				}
+				if (dest != nullptr) {
+					memset(dest + filled, data[pos + 1], length);
+				}
+				filled += length;
+				pos += 2;
+			}
+		}
+		else {
+			return false;
+		}
+	}
+	return pos == size;
+}
+
+// ---------------------------------------------------------
+//  save state
+// ---------------------------------------------------------
+void vm_save_state(const vm_context* ctx, std::vector<uint8_t>& data) {
+	data.clear();
+	data.insert(data.end(), VM_STATE_MAGIC, VM_STATE_MAGIC + 4);
+	vm_state_put16(data, VM_STATE_VERSION);
+	data.push_back(ctx->registers[vm_registers::A]);
+	data.push_back(ctx->registers[vm_registers::X]);
+	data.push_back(ctx->registers[vm_registers::Y]);
+	data.push_back(ctx->sp);
+	data.push_back(ctx->getFlags());
+	vm_state_put16(data, ctx->programCounter);
+	vm_state_put16(data, ctx->numCommands);
+	vm_state_put16(data, ctx->numBytes);
+	for (int i = 0; i < 8; ++i) {
+		data.push_back((ctx->cycles >> (i * 8)) & 0xFF);
+	}
+	size_t numPages = data.size();
+	vm_state_put16(data, 0);
+	int num = 0;
+	uint8_t encoded[512];
+	for (int i = 0; i < 256; ++i) {
+		const uint8_t* page = ctx->mem + (i << 8);
+		if (ctx->pageTypes[i] == DEVICE_PAGE) {
+			continue;
+		}
+		if (ctx->pageTypes[i] == SHARED_PAGE) {
+			page = ctx->sharedPages[i];
+		}
+		if (memcmp(page, VM_EMPTY_PAGE, 256) == 0) {
+			continue;
+		}
+		int size = vm_state_encode(page, encoded);
+		data.push_back(i);
+		if (size < 256) {
+			data.push_back(VM_STATE_RLE);
+			data.insert(data.end(), encoded, encoded + size);
+		}
+		else {
+			data.push_back(VM_STATE_RAW);
+			data.insert(data.end(), page, page + 256);
+		}
+		++num;
+	}
+	data[numPages] = num & 0xFF;
+	data[numPages + 1] = num >> 8;
+}
+
+// ---------------------------------------------------------
+//  load state
+// ---------------------------------------------------------
+bool vm_load_state(vm_context* ctx, const uint8_t* data, size_t size) {
+	if (size < VM_STATE_HEADER_SIZE || memcmp(data, VM_STATE_MAGIC, 4) != 0) {
+		sprintf_s(ctx->debug, "Invalid state");
+		return false;
+	}
+	uint16_t version = vm_state_get16(data + 4);
+	if (version != VM_STATE_VERSION) {
+		sprintf_s(ctx->debug, "Unsupported state version %d", version);
+		return false;
+	}
+	if (!vm_state_pages(nullptr, data, size)) {
+		sprintf_s(ctx->debug, "Invalid state");
+		return false;
+	}
+	vm_unshare(ctx);
+	for (int i = 0; i < 256; ++i) {
+		if (ctx->pageTypes[i] == RAM_PAGE || ctx->pageTypes[i] == WATCHED_PAGE) {
+			memset(ctx->mem + (i << 8), 0, 256);
+			ctx->markDirty(i << 8);
+		}
+	}
+	vm_state_pages(ctx, data, size);
+	vm_block_cache_flush(ctx);
+	vm_jit_release(ctx);
+	ctx->registers[vm_registers::A] = data[6];
+	ctx->registers[vm_registers::X] = data[7];
+	ctx->registers[vm_registers::Y] = data[8];
+	ctx->sp = data[9];
+	ctx->setFlags(data[10]);
+	ctx->programCounter = vm_state_get16(data + 11);
+	ctx->numCommands = vm_state_get16(data + 13);
+	ctx->numBytes = vm_state_get16(data + 15);
+	ctx->cycles = 0;
+	for (int i = 0; i < 8; ++i) {
+		ctx->cycles |= (uint64_t)data[17 + i] << (i * 8);
+	}
+	// the loaded I flag may mask a pending IRQ
+	vm_update_next_event(ctx);
+	return true;
+}
+
+// ---------------------------------------------------------
+//  save state file
+// ---------------------------------------------------------
+bool vm_save_state_file(vm_context* ctx, const char* fileName) {
+	std::vector<uint8_t> data;
+	vm_save_state(ctx, data);
+	FILE* fp = fopen(fileName, "wb");
+	if (fp) {
+		size_t written = fwrite(data.data(), 1, data.size(), fp);
+		fclose(fp);
+		if (written == data.size()) {
+			sprintf_s(ctx->debug, "State %s written with %d bytes", fileName, (int)data.size());
+			return true;
+		}
+	}
+	sprintf_s(ctx->debug, "Cannot write file %s", fileName);
+	return false;
+}
+
+// ---------------------------------------------------------
+//  load state file
+// ---------------------------------------------------------
+bool vm_load_state_file(vm_context* ctx, const char* fileName) {
+	FILE* fp = fopen(fileName, "rb");
+	if (fp) {
+		std::vector<uint8_t> data;
+		fseek(fp, 0, SEEK_END);
+		long size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		bool valid = size > 0;
+		if (valid) {
+			data.resize(size);
+			valid = fread(data.data(), 1, data.size(), fp) == data.size();
+		}
+		fclose(fp);
+		if (valid) {
+			return vm_load_state(ctx, data.data(), data.size());
+		}
+	}
+	sprintf_s(ctx->debug, "File '%s' not found", fileName);
+	return false;
+}
+
+// ---------------------------------------------------------
+//  save state file of the internal context
+// ---------------------------------------------------------
+bool vm_save_state_file(const char* fileName) {
+	if (_internal_ctx != nullptr) {
+		return vm_save_state_file(_internal_ctx, fileName);
+	}
+	return false;
+}
+
+// ---------------------------------------------------------
+//  load state file into the internal context
+// ---------------------------------------------------------
+bool vm_load_state_file(const char* fileName) {
+	if (_internal_ctx != nullptr) {
+		return vm_load_state_file(_internal_ctx, fileName);
+	}
+	return false;
+}
+
+// ---------------------------------------------------------
+//  Lockstep validation
+// ---------------------------------------------------------
+const static int VM_LOCKSTEP_TRACE = 8;
+const static int VM_LOCKSTEP_MAX_BYTES = 8;
+
+// ---------------------------------------------------------
+//  internal memory of a page of a context
+// ---------------------------------------------------------
+PRIVATE const uint8_t* vm_lockstep_page(const vm_context* ctx, int page) {
+	if (ctx->pageTypes[page] == SHARED_PAGE) {
+		return ctx->sharedPages[page];
+	}
+	return ctx->mem + (page << 8);
+}
+
+// ---------------------------------------------------------
+//  internal compare the state of both contexts. Only the
+//  pages written since the last compare are checked.
+//  Appends the differences to out.
+// ---------------------------------------------------------
+PRIVATE bool vm_lockstep_compare(vm_context* ref, vm_context* test, std::string& out) {
+	size_t start = out.size();
+	char buffer[128];
+	const char* names[] = { "A", "X", "Y" };
+	for (int i = 0; i < 3; ++i) {
+		if (ref->registers[i] != test->registers[i]) {
+			sprintf_s(buffer, "%-10s $%02X       $%02X\n", names[i], ref->registers[i], test->registers[i]);
+			out += buffer;
+		}
+	}
+	if (ref->programCounter != test->programCounter) {
+		sprintf_s(buffer, "%-10s $%04X     $%04X\n", "PC", ref->programCounter, test->programCounter);
+		out += buffer;
+	}
+	if (ref->sp != test->sp) {
+		sprintf_s(buffer, "%-10s $%02X       $%02X\n", "SP", ref->sp, test->sp);
+		out += buffer;
+	}
+	if (ref->getFlags() != test->getFlags()) {
+		sprintf_s(buffer, "%-10s $%02X       $%02X\n", "P", ref->getFlags(), test->getFlags());
+		out += buffer;
+	}
+	if (ref->cycles != test->cycles) {
+		sprintf_s(buffer, "%-10s %-9llu %llu\n", "cycles", (unsigned long long)ref->cycles, (unsigned long long)test->cycles);
+		out += buffer;
+	}
+	int num = 0;
+	for (int i = 0; i < 256; ++i) {
+		if (!vm_is_dirty(ref, i) && !vm_is_dirty(test, i)) {
+			continue;
+		}
+		if (ref->pageTypes[i] == DEVICE_PAGE || test->pageTypes[i] == DEVICE_PAGE) {
+			continue;
+		}
+		const uint8_t* first = vm_lockstep_page(ref, i);
+		const uint8_t* second = vm_lockstep_page(test, i);
+		for (int j = 0; j < 256 && num < VM_LOCKSTEP_MAX_BYTES; ++j) {
+			if (first[j] != second[j]) {
+				sprintf_s(buffer, "$%04X      $%02X       $%02X\n", (i << 8) + j, first[j], second[j]);
+				out += buffer;
+				++num;
+			}
+		}
+	}
+	vm_dirty_clear(ref);
+	vm_dirty_clear(test);
+	return out.size() == start;
+}
+
+// ---------------------------------------------------------
+//  run vm_step and func side by side
+// ---------------------------------------------------------
+bool vm_lockstep(vm_context* ctx, vm_step_func func, uint64_t maxInstructions, std::string& out) {
+	std::vector<uint8_t> state;
+	vm_save_state(ctx, state);
+	vm_context* ref = vm_create_context();
+	vm_context* test = vm_create_context();
+	vm_load_state(ref, state.data(), state.size());
+	vm_load_state(test, state.data(), state.size());
+	vm_dirty_clear(ref);
+	vm_dirty_clear(test);
+	vm_trace_enable(ref, VM_LOCKSTEP_TRACE);
+	uint64_t max = maxInstructions == 0 ? UINT64_MAX : maxInstructions;
+	int end = 0x600 + ref->numBytes;
+	uint64_t instructions = 0;
+	bool running = true;
+	bool refRunning = true;
+	std::string diff;
+	// like vm_run both stop once the program counter leaves the program
+	while (running && instructions < max && test->programCounter < end) {
+		uint64_t cycles = test->cycles;
+		running = (*func)(test);
+		if (running && test->cycles == cycles) {
+			diff += "test step did not use any cycles\n";
+			break;
+		}
+		// vm_step catches up to the same number of cycles
+		while (refRunning && ref->cycles < test->cycles) {
+			if (ref->programCounter >= end) {
+				refRunning = false;
+				break;
+			}
+			refRunning = vm_step(ref);
+			++instructions;
+		}
+		if (!vm_lockstep_compare(ref, test, diff)) {
+			break;
+		}
+		if (!running && refRunning && ref->programCounter < end) {
+			diff += "test stopped before the end of the program\n";
+		}
+	}
+	bool same = diff.empty();
+	if (!same) {
+		char buffer[128];
+		sprintf_s(buffer, "diverged after %llu instructions\n", (unsigned long long)instructions);
+		out += buffer;
+		sprintf_s(buffer, "%-10s %-9s %s\n", "", "vm_step", "test");
+		out += buffer;
+		out += diff;
+		out += "last instructions of vm_step:\n";
+		vm_trace_format(ref, out);
+	}
+	vm_release(ref);
+	vm_release(test);
+	return same;
+}
+
+// ---------------------------------------------------------
+//  internal xorshift random numbers of the random programs
+// ---------------------------------------------------------
+PRIVATE uint32_t vm_lockstep_next(uint32_t* state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// ---------------------------------------------------------
+//  internal number of bytes the run loops step over
+// ---------------------------------------------------------
+PRIVATE int vm_lockstep_size(const vm_command_mapping& m) {
+	return VM_DATA_SIZE[m.mode] + 1;
+}
+
+// ---------------------------------------------------------
+//  internal build a random program. Data accesses stay
+//  below the program, so the code is never modified.
+//  JMP and JSR jump into the program and BRK ends it.
+// ---------------------------------------------------------
+PRIVATE void vm_lockstep_program(vm_context* ctx, uint32_t seed) {
+	const int NUM_INSTRUCTIONS = 48;
+	uint32_t state = seed * 2654435761u + 1;
+	if (state == 0) {
+		state = 1;
+	}
+	int numMappings = 0;
+	while (VM_COMMAND_MAPPING[numMappings].op_code != EOL) {
+		++numMappings;
+	}
+	for (int i = 0; i < 3; ++i) {
+		ctx->registers[i] = vm_lockstep_next(&state) & 0xFF;
+	}
+	ctx->sp = vm_lockstep_next(&state) & 0xFF;
+	ctx->setFlags(vm_lockstep_next(&state) & 0xFF);
+	ctx->programCounter = 0x600;
+	for (int i = 0; i < 0x300; ++i) {
+		ctx->write(i, vm_lockstep_next(&state) & 0xFF);
+	}
+	// the size of every instruction is known before the targets are chosen
+	std::vector<int> mappings(NUM_INSTRUCTIONS);
+	int numBytes = 0;
+	for (int i = 0; i < NUM_INSTRUCTIONS; ++i) {
+		mappings[i] = vm_lockstep_next(&state) % numMappings;
+		const vm_command_mapping& m = VM_COMMAND_MAPPING[mappings[i]];
+		numBytes += vm_lockstep_size(m);
+	}
+	uint16_t pc = 0x600;
+	for (int i = 0; i < NUM_INSTRUCTIONS; ++i) {
+		const vm_command_mapping& m = VM_COMMAND_MAPPING[mappings[i]];
+		int size = vm_lockstep_size(m);
+		uint16_t operand = vm_lockstep_next(&state) & 0x3FF;
+		if (m.mode == JMP_ABSOLUTE) {
+			operand = 0x600 + vm_lockstep_next(&state) % numBytes;
+		}
+		ctx->write(pc, m.hex);
+		for (int j = 1; j < size; ++j) {
+			ctx->write(pc + j, j == 1 ? operand & 0xFF : operand >> 8);
+		}
+		pc += size;
+	}
+	ctx->numBytes = numBytes;
+}
+
+// ---------------------------------------------------------
+//  internal worker of vm_lockstep_random
+// ---------------------------------------------------------
+PRIVATE void vm_lockstep_worker(vm_step_func func, uint32_t seed, std::atomic<int>* next, std::vector<std::string>* reports) {
+	const uint64_t MAX_INSTRUCTIONS = 1000;
+	for (int i = (*next)++; i < (int)reports->size(); i = (*next)++) {
+		vm_context* ctx = vm_create_context();
+		vm_lockstep_program(ctx, seed + i);
+		vm_lockstep(ctx, func, MAX_INSTRUCTIONS, (*reports)[i]);
+		vm_release(ctx);
+	}
+}
+
+// ---------------------------------------------------------
+//  check random programs on a pool of threads
+// ---------------------------------------------------------
+int vm_lockstep_random(vm_step_func func, int numPrograms, uint32_t seed, int numThreads, std::string& out) {
+	if (numThreads <= 0) {
+		numThreads = std::thread::hardware_concurrency();
+		if (numThreads <= 0) {
+			numThreads = 1;
+		}
+	}
+	std::vector<std::string> reports(numPrograms > 0 ? numPrograms : 0);
+	std::atomic<int> next(0);
+	std::vector<std::thread> threads;
+	for (int i = 1; i < numThreads; ++i) {
+		threads.push_back(std::thread(vm_lockstep_worker, func, seed, &next, &reports));
+	}
+	vm_lockstep_worker(func, seed, &next, &reports);
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i].join();
+	}
+	int failed = 0;
+	for (size_t i = 0; i < reports.size(); ++i) {
+		if (!reports[i].empty()) {
+			if (failed == 0) {
+				char buffer[64];
+				sprintf_s(buffer, "program %d seed %u\n", (int)i, seed + (uint32_t)i);
+				out += buffer;
+				out += reports[i];
+			}
+			++failed;
+		}
+	}
+	return failed;
 }
 
 #endif
\ No newline at end of file
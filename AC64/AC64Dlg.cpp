@@ -55,6 +55,7 @@ CAC64Dlg::CAC64Dlg(CWnd* pParent /*=NULL*/)
 {
 	m_hIcon = AfxGetApp()->LoadIcon(IDR_MAINFRAME);
 	_ctx = vm_create();
+	vm_trace_enable(_ctx, 256);
 }
 
 void CAC64Dlg::DoDataExchange(CDataExchange* pDX)
@@ -376,7 +377,7 @@ void CAC64Dlg::OnBnClickedStep() {
 	vm_step();
 	dumpMemory();
 	updateCPUState();
-	CString str(_ctx->debug);
+	CString str(vm_trace_last(_ctx));
 	_statucBarCtrl.SetText(str, 0, 0);
 }
 
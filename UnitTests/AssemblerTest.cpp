@@ -1,6 +1,8 @@
 #include "catch.hpp"
 #include "..\6502.h"
 
+void require_same_state(const vm_context* ctx, const vm_context* expected);
+
 TEST_CASE("Assemble1", "[ASM]") {
 	vm_context* ctx = vm_create();
 	int num = vm_assemble("LDA #$01\nSTA $0200\nLDA #$05\nSTA $0201\nLDA #$08\nSTA $0202\n");
@@ -92,4 +94,802 @@ TEST_CASE("ASSEMBLE_UNKNOWN", "[ASM]") {
 	printf("===> %s\n", ctx->debug);
 	REQUIRE(num == 100);
 	vm_release();
-}
\ No newline at end of file
+}
+
+TEST_CASE("TRACE", "[ASM]") {
+	vm_context* ctx = vm_create();
+	vm_assemble("LDX #$08\nINX\nSTX $0200\n");
+	vm_run();
+	REQUIRE(ctx->trace == nullptr);
+	vm_trace_enable(ctx, 2);
+	vm_run();
+	REQUIRE(ctx->trace->count == 3);
+	std::string out;
+	REQUIRE(vm_trace_format(ctx, out) == 2);
+	REQUIRE(out.find("INX") != std::string::npos);
+	REQUIRE(out.find("LDX") == std::string::npos);
+	std::string last = vm_trace_last(ctx);
+	REQUIRE(last.find("0603 STX (8E)") == 0);
+	vm_trace_enable(ctx, 0xFFFFFFFF);
+	REQUIRE(ctx->trace->capacity == VM_TRACE_MAX_CAPACITY);
+	vm_release();
+}
+
+TEST_CASE("MULTIPLE_CONTEXTS", "[ASM]") {
+	vm_context* first = vm_create_context();
+	vm_context* second = vm_create_context();
+	vm_assemble(first, "LDX #$08\nINX\nSTX $0200\n");
+	vm_assemble(second, "LDY #$20\nDEY\nSTY $0200\n");
+	vm_run(first);
+	vm_run(second);
+	REQUIRE(9 == (int)first->registers[vm_registers::X]);
+	REQUIRE(9 == (int)first->read(0x200));
+	REQUIRE(0 == (int)first->registers[vm_registers::Y]);
+	REQUIRE(0x1F == (int)second->registers[vm_registers::Y]);
+	REQUIRE(0x1F == (int)second->read(0x200));
+	REQUIRE(0 == (int)second->registers[vm_registers::X]);
+	vm_release(first);
+	vm_release(second);
+}
+
+TEST_CASE("BLOCK_CACHE", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	// the loop patches the operand of LDX inside its own block
+	vm_assemble(ctx, "LDY #$03\nloop:\nLDX #$01\nINX\nSTX $0603\nDEY\nBNE loop\nSTX $0200\n");
+	vm_block_cache_enable(ctx);
+	vm_run(ctx);
+	REQUIRE(4 == (int)ctx->read(0x200));
+	uint64_t cycles = ctx->cycles;
+	// run again with the already cached blocks
+	ctx->write(0x603, 1);
+	ctx->cycles = 0;
+	vm_run(ctx);
+	REQUIRE(4 == (int)ctx->read(0x200));
+	REQUIRE(cycles == ctx->cycles);
+	vm_block_cache_disable(ctx);
+	REQUIRE(ctx->blockCache == nullptr);
+	ctx->write(0x603, 1);
+	ctx->cycles = 0;
+	vm_run(ctx);
+	REQUIRE(4 == (int)ctx->read(0x200));
+	REQUIRE(cycles == ctx->cycles);
+	vm_release(ctx);
+}
+
+TEST_CASE("RUN_JIT", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_context* expected = vm_create_context();
+	const char* code = "LDY #$04\nouter:\nLDX #$00\ninner:\nDEX\nTXA\nSTA $0200,Y\nPHA\nPLA\nCPX #$80\nBNE inner\nDEY\nBNE outer\nINC $0210\nBRK\n";
+	vm_assemble(ctx, code);
+	vm_assemble(expected, code);
+	vm_run(expected);
+	vm_run_jit(ctx);
+	require_same_state(ctx, expected);
+	// run again with the translated blocks
+	vm_run_jit(ctx);
+	vm_run(expected);
+	require_same_state(ctx, expected);
+	vm_release(expected);
+	vm_release(ctx);
+}
+
+TEST_CASE("RUN_JIT_SELF_MODIFYING", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	// the loop patches the operand of LDX inside its own block
+	vm_assemble(ctx, "LDY #$03\nloop:\nLDX #$01\nINX\nSTX $0603\nDEY\nBNE loop\nSTX $0200\n");
+	vm_run_jit(ctx);
+	REQUIRE(4 == (int)ctx->read(0x200));
+	ctx->write(0x603, 1);
+	vm_run_jit(ctx);
+	REQUIRE(4 == (int)ctx->read(0x200));
+	vm_release(ctx);
+}
+
+TEST_CASE("RECOMPILE", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$08\ndecrement:\nDEX\nSTX $0200\nBNE decrement\n");
+	// JMP ($0300) is not known to the assembler
+	ctx->mem[0x608] = 0x6C;
+	ctx->mem[0x609] = 0x00;
+	ctx->mem[0x60A] = 0x03;
+	ctx->numBytes += 3;
+	std::string code;
+	REQUIRE(vm_recompile(ctx, "prog", code));
+	REQUIRE(code.find("#include \"6502.h\"") != std::string::npos);
+	REQUIRE(code.find("static int prog_0600(vm_context* ctx)") != std::string::npos);
+	REQUIRE(code.find("static int prog_0602(vm_context* ctx)") != std::string::npos);
+	REQUIRE(code.find("void prog(vm_context* ctx)") != std::string::npos);
+	// the indirect jump falls back to vm_step
+	REQUIRE(code.find("static int prog_0608(vm_context* ctx) {\n\tuint8_t a, x, y, f;\n\tuint64_t cycles = 0;\n\tVM_AOT_LOAD;\n\t// 0608 JMP\n\tVM_AOT_SAVE(0x0608);\n\tvm_step(ctx);\n\treturn ctx->programCounter;\n}") != std::string::npos);
+	REQUIRE(strncmp(ctx->debug, "Recompiled", 10) == 0);
+	vm_release(ctx);
+}
+
+TEST_CASE("RECOMPILE_JSR", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "JSR sub\nSTA $0200\nBRK\nsub:\nLDA #$07\nRTS\n");
+	std::string code;
+	REQUIRE(vm_recompile(ctx, "prog", code));
+	REQUIRE(code.find("static int prog_0603(vm_context* ctx)") != std::string::npos);
+	REQUIRE(code.find("case 0x0603: pc = prog_0603(ctx); break;") != std::string::npos);
+	REQUIRE(code.find("static int prog_0607(vm_context* ctx)") != std::string::npos);
+	// the code after the JSR is translated and not run by vm_step
+	REQUIRE(code.find("\t// 0603 STA\n\tcycles += 4;\n") != std::string::npos);
+	vm_release(ctx);
+}
+
+// ------------------------------------------------------
+// bench/loop_aot.cpp is the recompiled loop of the
+// benchmark. Regenerate it with bench -aot whenever
+// vm_recompile changes.
+// ------------------------------------------------------
+void loop_aot(vm_context* ctx);
+
+TEST_CASE("RECOMPILE_MATCHES_RUN", "[ASM]") {
+	const char* code = "LDY #$00\nouter:\nLDX #$00\ninner:\nDEX\nSTX $0200\nBNE inner\nDEY\nBNE outer\n";
+	vm_context* ctx = vm_create_context();
+	vm_context* expected = vm_create_context();
+	vm_assemble(ctx, code);
+	vm_assemble(expected, code);
+	vm_run(expected);
+	loop_aot(ctx);
+	require_same_state(ctx, expected);
+	vm_release(expected);
+	vm_release(ctx);
+}
+
+typedef struct TestDevice {
+	int reads;
+	int writes;
+	uint8_t last;
+} TestDevice;
+
+static uint8_t test_device_read(vm_device* device, uint16_t address) {
+	TestDevice* d = (TestDevice*)device->data;
+	++d->reads;
+	return address & 0xFF;
+}
+
+static void test_device_write(vm_device* device, uint16_t address, uint8_t value) {
+	TestDevice* d = (TestDevice*)device->data;
+	++d->writes;
+	d->last = value;
+}
+
+TEST_CASE("MEMORY_MAPPED_DEVICE", "[ASM]") {
+	void(*engines[])(vm_context*) = { vm_run, vm_run_fast, vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		TestDevice data = { 0, 0, 0 };
+		vm_device device = { test_device_read, test_device_write, &data };
+		vm_context* ctx = vm_create_context();
+		vm_assemble(ctx, "LDA $D005\nSTA $0200\nLDX #$03\nloop:\nLDA $D010,X\nSTA $D020,X\nSTA $0201\nDEX\nBNE loop\nSTA $D030\n");
+		vm_map_device(ctx, 0xD0, 1, &device);
+		engines[i](ctx);
+		INFO("engine " << i);
+		REQUIRE(5 == (int)ctx->read(0x200));
+		REQUIRE(0x11 == (int)ctx->read(0x201));
+		REQUIRE(data.reads == 4);
+		REQUIRE(data.writes == 4);
+		REQUIRE(data.last == 0x11);
+		REQUIRE(ctx->mem[0xD021] == 0);
+		vm_unmap_device(ctx, 0xD0, 1);
+		ctx->write(0xD005, 7);
+		REQUIRE(ctx->read(0xD005) == 7);
+		REQUIRE(data.writes == 4);
+		vm_release(ctx);
+	}
+}
+
+TEST_CASE("SNAPSHOT_FORK", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX $0300\nINX\nSTX $0200\n");
+	ctx->write(0x300, 5);
+	vm_context_snapshot* snapshot = vm_snapshot(ctx);
+	ctx->write(0x300, 9);
+	vm_context* a = vm_fork(snapshot);
+	vm_context* b = vm_fork(snapshot);
+	REQUIRE(a->pageTypes[0x03] == SHARED_PAGE);
+	b->write(0x300, 41);
+	REQUIRE(b->pageTypes[0x03] == RAM_PAGE);
+	REQUIRE(a->pageTypes[0x03] == SHARED_PAGE);
+	vm_run(a);
+	vm_run_jit(b);
+	REQUIRE(6 == (int)a->read(0x200));
+	REQUIRE(42 == (int)b->read(0x200));
+	REQUIRE(a->pageTypes[0x02] == RAM_PAGE);
+	REQUIRE(a->pageTypes[0x06] == SHARED_PAGE);
+	// a snapshot of a fork shares the pages the fork did not write
+	vm_context_snapshot* second = vm_snapshot(a);
+	vm_snapshot_release(snapshot);
+	vm_release(a);
+	vm_context* c = vm_fork(second);
+	REQUIRE(6 == (int)c->read(0x200));
+	REQUIRE(5 == (int)c->read(0x300));
+	REQUIRE(c->registers[vm_registers::X] == 6);
+	REQUIRE(c->numBytes == ctx->numBytes);
+	vm_snapshot_release(second);
+	vm_release(c);
+	vm_release(b);
+	vm_release(ctx);
+}
+
+TEST_CASE("DIRTY_PAGES", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$03\nLDA $0300\nSTA $0200\nSTA $0400,X\n");
+	ctx->write(0x300, 7);
+	REQUIRE(vm_is_dirty(ctx, 0x03));
+	REQUIRE(vm_is_dirty(ctx, 0x06));
+	vm_dirty_clear(ctx);
+	std::vector<uint8_t> image(ctx->mem, ctx->mem + 65536);
+	// the JIT stores into pages without code directly
+	vm_run_jit(ctx);
+	REQUIRE(7 == (int)ctx->read(0x200));
+	REQUIRE(7 == (int)ctx->read(0x403));
+	REQUIRE(vm_is_dirty(ctx, 0x02));
+	REQUIRE(vm_is_dirty(ctx, 0x04));
+	REQUIRE(!vm_is_dirty(ctx, 0x03));
+	REQUIRE(!vm_is_dirty(ctx, 0x06));
+	std::vector<uint8_t> data;
+	vm_dirty_save(ctx, data);
+	REQUIRE(data.size() == 2 * 257);
+	vm_dirty_reset(ctx, image.data());
+	REQUIRE(0 == (int)ctx->read(0x200));
+	REQUIRE(0 == (int)ctx->read(0x403));
+	REQUIRE(!vm_is_dirty(ctx, 0x02));
+	vm_reset(ctx);
+	vm_run(ctx);
+	REQUIRE(7 == (int)ctx->read(0x403));
+	vm_dirty_reset(ctx, nullptr);
+	REQUIRE(0 == (int)ctx->read(0x403));
+	REQUIRE(7 == (int)ctx->read(0x300));
+	REQUIRE(vm_dirty_load(ctx, data.data(), data.size()));
+	REQUIRE(7 == (int)ctx->read(0x200));
+	REQUIRE(7 == (int)ctx->read(0x403));
+	REQUIRE(!vm_dirty_load(ctx, data.data(), 100));
+	vm_release(ctx);
+}
+
+TEST_CASE("SAVE_STATE", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$04\nLDA #$11\nloop:\nSTA $0400,X\nDEX\nBNE loop\nLDY #$80\n");
+	ctx->write(0x2000, 0x42);
+	vm_run(ctx);
+	std::vector<uint8_t> data;
+	vm_save_state(ctx, data);
+	// pages 0x04 and 0x20 are run length encoded, the code page is stored as it is
+	REQUIRE(data.size() < 27 + 3 * 258);
+	vm_context* restored = vm_create_context();
+	restored->write(0x3000, 1);
+	REQUIRE(vm_load_state(restored, data.data(), data.size()));
+	int diff = 0;
+	for (int i = 0; i < 65536; ++i) {
+		if (ctx->read(i) != restored->read(i)) {
+			++diff;
+		}
+	}
+	REQUIRE(diff == 0);
+	REQUIRE(restored->registers[vm_registers::Y] == 0x80);
+	REQUIRE(restored->programCounter == ctx->programCounter);
+	REQUIRE(restored->sp == ctx->sp);
+	REQUIRE(restored->getFlags() == ctx->getFlags());
+	REQUIRE(restored->cycles == ctx->cycles);
+	REQUIRE(restored->numBytes == ctx->numBytes);
+	// broken data leaves the context untouched
+	restored->write(0x3000, 1);
+	REQUIRE(!vm_load_state(restored, data.data(), data.size() - 1));
+	data[4] = 2;
+	REQUIRE(!vm_load_state(restored, data.data(), data.size()));
+	REQUIRE(1 == (int)restored->read(0x3000));
+	// a pending IRQ is masked by the loaded I flag
+	ctx->setFlags(0x08);
+	std::vector<uint8_t> masked;
+	vm_save_state(ctx, masked);
+	vm_irq(restored);
+	REQUIRE(restored->nextEvent == 0);
+	REQUIRE(vm_load_state(restored, masked.data(), masked.size()));
+	REQUIRE(restored->nextEvent == UINT64_MAX);
+	vm_release(restored);
+	vm_release(ctx);
+}
+
+static void test_raise_irq(vm_context* ctx, void* data) {
+	++*(int*)data;
+	vm_irq(ctx);
+}
+
+static void test_raise_nmi(vm_context* ctx, void* data) {
+	++*(int*)data;
+	vm_nmi(ctx);
+}
+
+typedef void(*TestRunFunc)(vm_context*);
+
+TEST_CASE("INTERRUPTS", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	// the handler at 0x0608 counts the interrupts
+	vm_assemble(ctx, "LDY #$00\nloop:\nDEY\nBNE loop\nJMP done\nhandler:\nINC $0200\nRTI\ndone:\nNOP\n");
+	ctx->write(0xFFFA, 0x08);
+	ctx->write(0xFFFB, 0x06);
+	ctx->write(0xFFFE, 0x08);
+	ctx->write(0xFFFF, 0x06);
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast, &vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		int fired = 0;
+		ctx->write(0x200, 0);
+		vm_schedule(ctx, ctx->cycles + 300, &test_raise_nmi, &fired);
+		vm_schedule(ctx, ctx->cycles + 100, &test_raise_irq, &fired);
+		(*runs[i])(ctx);
+		REQUIRE(fired == 2);
+		REQUIRE(2 == (int)ctx->read(0x200));
+		REQUIRE(ctx->registers[vm_registers::Y] == 0);
+		REQUIRE(ctx->sp == 255);
+		REQUIRE(!ctx->isSet(vm_flags::I));
+	}
+	// a masked IRQ waits for CLI
+	vm_assemble(ctx, "SEI\nLDY #$00\nloop:\nDEY\nBNE loop\nCLI\nNOP\nJMP done\nhandler:\nINC $0200\nRTI\ndone:\nNOP\n");
+	ctx->write(0xFFFE, 0x0B);
+	ctx->write(0x200, 0);
+	int fired = 0;
+	vm_schedule(ctx, ctx->cycles + 100, &test_raise_irq, &fired);
+	vm_block_cache_enable(ctx);
+	vm_run(ctx);
+	REQUIRE(fired == 1);
+	REQUIRE(1 == (int)ctx->read(0x200));
+	vm_block_cache_disable(ctx);
+	// BRK continues after its padding byte
+	vm_assemble(ctx, "BRK\nNOP\nLDX #$07\nJMP done\nhandler:\nINC $0200\nRTI\ndone:\nNOP\n");
+	ctx->write(0xFFFE, 0x07);
+	for (int i = 0; i < 3; ++i) {
+		ctx->write(0x200, 0);
+		ctx->registers[vm_registers::X] = 0;
+		(*runs[i])(ctx);
+		REQUIRE(1 == (int)ctx->read(0x200));
+		REQUIRE(ctx->registers[vm_registers::X] == 7);
+	}
+	// a reset drops pending interrupts and events
+	fired = 0;
+	vm_schedule(ctx, 0, &test_raise_irq, &fired);
+	vm_nmi(ctx);
+	ctx->stopRequested = true;
+	vm_reset(ctx);
+	REQUIRE(ctx->pendingInterrupts == 0);
+	REQUIRE(ctx->nextEvent == UINT64_MAX);
+	REQUIRE(!ctx->stopRequested);
+	ctx->write(0x200, 0);
+	vm_run(ctx);
+	REQUIRE(fired == 0);
+	REQUIRE(1 == (int)ctx->read(0x200));
+	vm_release(ctx);
+}
+
+TEST_CASE("BREAKPOINTS", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$03\nloop:\nDEX\nSTX $0200\nBNE loop\nLDY #$05\nBRK\nNOP\n");
+	// STX inside of the loop
+	vm_breakpoint_set(ctx, 0x603);
+	REQUIRE(vm_is_breakpoint(ctx, 0x603));
+	REQUIRE(!vm_is_breakpoint(ctx, 0x602));
+	for (int i = 2; i >= 0; --i) {
+		REQUIRE(vm_run_until_break(ctx) == STOP_BREAKPOINT);
+		REQUIRE(ctx->programCounter == 0x603);
+		REQUIRE(ctx->registers[vm_registers::X] == i);
+		REQUIRE(ctx->read(0x200) == (i == 2 ? 0 : i + 1));
+	}
+	REQUIRE(vm_run_until_break(ctx) == STOP_BRK);
+	REQUIRE(ctx->registers[vm_registers::Y] == 5);
+	vm_breakpoint_clear(ctx, 0x603);
+	REQUIRE(!vm_is_breakpoint(ctx, 0x603));
+	REQUIRE(ctx->breakpoints == nullptr);
+	vm_reset(ctx);
+	REQUIRE(vm_run_until_break(ctx) == STOP_BRK);
+	REQUIRE(ctx->read(0x200) == 0);
+	REQUIRE(vm_run_until_break(ctx) == STOP_END);
+	vm_release(ctx);
+}
+
+static void test_count_access(vm_context* ctx, const vm_watch_hit* hit, void* data) {
+	int* counts = (int*)data;
+	++counts[hit->write ? 1 : 0];
+}
+
+TEST_CASE("WATCHPOINTS", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$08\nloop:\nTXA\nSTA $0300,X\nDEX\nBNE loop\nLDA $0305\nSTA $0200\n");
+	int id = vm_watch_add(ctx, 0x304, 0x304, WATCH_WRITE, nullptr, nullptr);
+	REQUIRE(ctx->pageTypes[0x03] == WATCHED_PAGE);
+	REQUIRE(ctx->pageTypes[0x02] == RAM_PAGE);
+	REQUIRE(vm_run_until_break(ctx) == STOP_WATCHPOINT);
+	REQUIRE(ctx->watchHit.address == 0x304);
+	REQUIRE(ctx->watchHit.oldValue == 0);
+	REQUIRE(ctx->watchHit.newValue == 4);
+	REQUIRE(ctx->watchHit.write);
+	REQUIRE(ctx->registers[vm_registers::X] == 4);
+	REQUIRE(vm_run_until_break(ctx) == STOP_END);
+	REQUIRE(ctx->read(0x200) == 5);
+	// every run function stops after the write
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast, &vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		ctx->write(0x200, 0);
+		ctx->write(0x304, 0);
+		(*runs[i])(ctx);
+		REQUIRE(ctx->stopRequested);
+		REQUIRE(ctx->read(0x200) == 0);
+		REQUIRE(ctx->read(0x304) == 4);
+	}
+	vm_watch_remove(ctx, id);
+	REQUIRE(ctx->pageTypes[0x03] == RAM_PAGE);
+	// callbacks see every access of the table
+	int counts[2] = { 0, 0 };
+	vm_watch_add(ctx, 0x300, 0x3FF, WATCH_ACCESS, &test_count_access, counts);
+	for (int i = 0; i < 3; ++i) {
+		counts[0] = 0;
+		counts[1] = 0;
+		(*runs[i])(ctx);
+		REQUIRE(!ctx->stopRequested);
+		REQUIRE(counts[0] == 1);
+		REQUIRE(counts[1] == 8);
+		REQUIRE(ctx->read(0x200) == 5);
+	}
+	vm_watch_clear_all(ctx);
+	REQUIRE(ctx->pageTypes[0x03] == RAM_PAGE);
+	vm_release(ctx);
+}
+
+// counts the accesses which see the wrong registers or program counter
+static void test_check_state(vm_context* ctx, const vm_watch_hit* hit, void* data) {
+	int* errors = (int*)data;
+	if (hit->write && (ctx->programCounter != 0x603 || ctx->registers[vm_registers::X] != hit->address - 0x300 || ctx->registers[vm_registers::A] != hit->newValue)) {
+		++*errors;
+	}
+	if (!hit->write && (ctx->programCounter != 0x609 || ctx->registers[vm_registers::X] != 0)) {
+		++*errors;
+	}
+}
+
+TEST_CASE("WATCH_STATE", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$08\nloop:\nTXA\nSTA $0300,X\nDEX\nBNE loop\nLDA $0305\nSTA $0200\n");
+	int errors = 0;
+	vm_watch_add(ctx, 0x300, 0x3FF, WATCH_ACCESS, &test_check_state, &errors);
+	// the fast loop keeps the program counter to itself
+	TestRunFunc runs[] = { &vm_run, &vm_run_jit };
+	for (int i = 0; i < 2; ++i) {
+		INFO("engine " << i);
+		errors = 0;
+		(*runs[i])(ctx);
+		REQUIRE(errors == 0);
+		REQUIRE(ctx->read(0x200) == 5);
+	}
+	vm_release(ctx);
+}
+
+TEST_CASE("BRK_VECTOR_WATCH", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "BRK\nNOP\nLDX #$07\nJMP done\nhandler:\nINC $0200\nRTI\ndone:\nNOP\n");
+	int counts[2] = { 0, 0 };
+	vm_watch_add(ctx, 0xFFFE, 0xFFFF, WATCH_READ, &test_count_access, counts);
+	// looking for a handler is no read of the vector
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast, &vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		counts[0] = 0;
+		(*runs[i])(ctx);
+		REQUIRE(counts[0] == 0);
+	}
+	// entering the handler reads both bytes of the vector once
+	ctx->mem[0xFFFE] = 0x07;
+	ctx->mem[0xFFFF] = 0x06;
+	for (int i = 0; i < 3; ++i) {
+		counts[0] = 0;
+		ctx->write(0x200, 0);
+		(*runs[i])(ctx);
+		REQUIRE(counts[0] == 2);
+		REQUIRE(1 == (int)ctx->read(0x200));
+	}
+	vm_block_cache_enable(ctx);
+	counts[0] = 0;
+	vm_run(ctx);
+	REQUIRE(counts[0] == 2);
+	vm_block_cache_disable(ctx);
+	vm_watch_clear_all(ctx);
+	vm_release(ctx);
+}
+
+TEST_CASE("BLOCK_CACHE_WATCH", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$08\nloop:\nTXA\nSTA $0300,X\nDEX\nBNE loop\nLDA $0305\nSTA $0200\n");
+	// decoding a block fetches the code and is no read of the program
+	int counts[2] = { 0, 0 };
+	vm_watch_add(ctx, 0x600, 0x6FF, WATCH_READ, &test_count_access, counts);
+	vm_run(ctx);
+	REQUIRE(counts[0] == 0);
+	vm_block_cache_enable(ctx);
+	vm_run(ctx);
+	REQUIRE(counts[0] == 0);
+	REQUIRE(ctx->read(0x200) == 5);
+	// without a callback a hit would stop the run
+	vm_watch_clear_all(ctx);
+	vm_watch_add(ctx, 0x600, 0x6FF, WATCH_READ, nullptr, nullptr);
+	vm_block_cache_disable(ctx);
+	vm_block_cache_enable(ctx);
+	ctx->write(0x200, 0);
+	vm_run(ctx);
+	REQUIRE(!ctx->stopRequested);
+	REQUIRE(ctx->read(0x200) == 5);
+	vm_block_cache_disable(ctx);
+	vm_release(ctx);
+}
+
+TEST_CASE("PROFILER", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$05\nloop:\nDEX\nBNE loop\nLDY #$01\ndone:\nNOP\n");
+	REQUIRE(ctx->labels.size() == 2);
+	REQUIRE(ctx->labels[0].name == "loop");
+	REQUIRE(ctx->labels[0].pc == 0x602);
+	REQUIRE(ctx->labels[1].name == "done");
+	vm_profile_enable(ctx);
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast, &vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		vm_profile_clear(ctx);
+		(*runs[i])(ctx);
+		REQUIRE(ctx->profile[0x600] == 1);
+		REQUIRE(ctx->profile[0x602] == 5);
+		REQUIRE(ctx->profile[0x603] == 5);
+		REQUIRE(ctx->profile[0x605] == 1);
+		REQUIRE(ctx->profile[0x607] == 1);
+		REQUIRE(ctx->profile[0x608] == 0);
+	}
+	std::string report;
+	REQUIRE(vm_profile_report(ctx, report, 2) == 2);
+	REQUIRE(report.find("          11   84.62  loop") != std::string::npos);
+	REQUIRE(report.find("$0602 loop+0 DEX") != std::string::npos);
+	REQUIRE(report.find("$0603 loop+1 BNE") != std::string::npos);
+	std::string code;
+	vm_disassemble(ctx, code);
+	REQUIRE(code.find("loop:\r\n           5  DEX") != std::string::npos);
+	vm_profile_disable(ctx);
+	REQUIRE(ctx->profile == nullptr);
+	vm_release(ctx);
+}
+
+TEST_CASE("DISASSEMBLE", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	// LDA ($10,X) / LDA ($12),Y / JMP ($0300) / JMP $0600 / NOP
+	uint8_t code[] = { 0xA1, 0x10, 0xB1, 0x12, 0x6C, 0x00, 0x03, 0x4C, 0x00, 0x06, 0xEA };
+	memcpy(ctx->mem + 0x600, code, sizeof(code));
+	ctx->numBytes = sizeof(code);
+	std::string out;
+	vm_disassemble(ctx, out);
+	REQUIRE(out == "LDA ($10,X)\r\nLDA ($12),Y\r\nJMP ($0300)\r\nJMP $0600\r\nNOP\r\n");
+	vm_release(ctx);
+}
+
+TEST_CASE("CALL_GRAPH", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$03\nagain:\nJSR work\nDEX\nBNE again\nJMP done\nwork:\nLDY #$02\ninner:\nJSR leaf\nDEY\nBNE inner\nRTS\nleaf:\nINX\nDEX\nRTS\ndone:\nLDA #$01\n");
+	vm_call_graph_enable(ctx);
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast, &vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		vm_call_graph_clear(ctx);
+		(*runs[i])(ctx);
+		REQUIRE(ctx->registers[vm_registers::X] == 0);
+		REQUIRE(ctx->registers[vm_registers::A] == 1);
+		REQUIRE(ctx->sp == 255);
+		std::string stacks;
+		vm_call_graph_folded(ctx, stacks);
+		REQUIRE(stacks == "main 12\nmain;work 24\nmain;work;leaf 18\n");
+	}
+	std::string report;
+	REQUIRE(vm_call_graph_report(ctx, report) == 2);
+	REQUIRE(report.find("          54           12          0  main") != std::string::npos);
+	REQUIRE(report.find("          42           24          3  work") != std::string::npos);
+	REQUIRE(report.find("          18           18          6  leaf") != std::string::npos);
+	vm_call_graph_disable(ctx);
+	REQUIRE(ctx->callGraph == nullptr);
+	vm_release(ctx);
+}
+
+// the Release configuration is built without VM_STATS_SUPPORT
+#if defined(VM_STATS_SUPPORT)
+TEST_CASE("STATS", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$03\npush:\nPHA\nDEX\nBNE push\nLDX #$03\npop:\nPLA\nDEX\nBNE pop\nSTA $0200\nLDA $0200\n");
+	REQUIRE(ctx->stats.writes == 0);
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast };
+	for (int i = 0; i < 2; ++i) {
+		vm_stats_reset(ctx);
+		(*runs[i])(ctx);
+		REQUIRE(ctx->stats.instructions == 22);
+		REQUIRE(ctx->stats.branchesTaken == 4);
+		REQUIRE(ctx->stats.branchesNotTaken == 2);
+		REQUIRE(ctx->stats.pushes == 3);
+		REQUIRE(ctx->stats.pops == 3);
+		REQUIRE(ctx->stats.maxStackDepth == 3);
+		REQUIRE(ctx->stats.writes == 4);
+		REQUIRE(ctx->stats.reads == 4);
+		REQUIRE(ctx->stats.opcodes[0xCA] == 6);
+		REQUIRE(ctx->stats.opcodes[0x48] == 3);
+	}
+	std::string out;
+	REQUIRE(vm_stats_format(ctx, out) == 7);
+	REQUIRE(out.find("branches taken                4") != std::string::npos);
+	REQUIRE(out.find("           6  $CA DEX") != std::string::npos);
+	vm_release(ctx);
+}
+#endif
+
+static bool test_counter_reached(const vm_context* ctx, void* data) {
+	return ctx->mem[0x200] == *(uint8_t*)data;
+}
+
+TEST_CASE("RUN_EX", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$00\nloop:\nINX\nSTX $0200\nJMP loop\nsub:\nJSR inner\nINY\nRTS\ninner:\nINY\nRTS\n");
+	vm_run_options options = {};
+	options.maxInstructions = 10;
+	REQUIRE(vm_run_ex(ctx, options) == STOP_INSTRUCTIONS);
+	REQUIRE(ctx->registers[vm_registers::X] == 3);
+	// continues where it stopped
+	REQUIRE(vm_run_ex(ctx, options) == STOP_INSTRUCTIONS);
+	REQUIRE(ctx->registers[vm_registers::X] == 7);
+	options.maxInstructions = 0;
+	options.maxCycles = 100;
+	uint64_t cycles = ctx->cycles;
+	REQUIRE(vm_run_ex(ctx, options) == STOP_CYCLES);
+	REQUIRE(ctx->cycles >= cycles + 100);
+	options.maxCycles = 0;
+	options.stopAtTarget = true;
+	options.target = 0x606;
+	REQUIRE(vm_run_ex(ctx, options) == STOP_TARGET);
+	REQUIRE(ctx->programCounter == 0x606);
+	options.stopAtTarget = false;
+	uint8_t value = 0x40;
+	options.predicate = &test_counter_reached;
+	options.data = &value;
+	REQUIRE(vm_run_ex(ctx, options) == STOP_PREDICATE);
+	REQUIRE(ctx->registers[vm_registers::X] == 0x40);
+	options.predicate = nullptr;
+	options.stopOnReturn = true;
+	ctx->programCounter = ctx->labels[1].pc;
+	REQUIRE(ctx->labels[1].name == "sub");
+	REQUIRE(vm_run_ex(ctx, options) == STOP_RETURN);
+	REQUIRE(ctx->registers[vm_registers::Y] == 2);
+	// code outside of the program runs until the BRK
+	options = {};
+	ctx->write(0xC000, 0xE8);
+	ctx->write(0xC001, 0xE8);
+	ctx->programCounter = 0xC000;
+	REQUIRE(vm_run_ex(ctx, options) == STOP_BRK);
+	REQUIRE(ctx->registers[vm_registers::X] == 0x42);
+	vm_release(ctx);
+}
+
+static bool test_step_fast(vm_context* ctx) {
+	vm_run_options options = {};
+	options.maxInstructions = 4;
+	return vm_run_ex(ctx, options) == STOP_INSTRUCTIONS;
+}
+
+static bool test_step_broken(vm_context* ctx) {
+	bool running = vm_step(ctx);
+	if (ctx->registers[vm_registers::X] == 5) {
+		ctx->write(0x0200, 0xFF);
+	}
+	return running;
+}
+
+TEST_CASE("LOCKSTEP", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "LDX #$08\nloop:\nDEX\nSTX $0200\nCPX #$03\nBNE loop\n");
+	std::string out;
+	REQUIRE(vm_lockstep(ctx, &test_step_fast, 0, out));
+	REQUIRE(out.empty());
+	REQUIRE(!vm_lockstep(ctx, &test_step_broken, 0, out));
+	REQUIRE(out.find("$0200      $06       $FF") != std::string::npos);
+	REQUIRE(out.find("STX") != std::string::npos);
+	// the context itself is not changed
+	REQUIRE(ctx->programCounter == 0x600);
+	REQUIRE(ctx->registers[vm_registers::X] == 0);
+	out.clear();
+	REQUIRE(vm_lockstep_random(&test_step_fast, 200, 1, 4, out) == 0);
+	REQUIRE(vm_lockstep_random(&test_step_broken, 200, 1, 4, out) > 0);
+	REQUIRE(out.find("program") == 0);
+	vm_release(ctx);
+}
+
+TEST_CASE("DECIMAL_MODE", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, "SED\nCLC\nLDA #$19\nADC #$28\nSTA $0200\nLDA #$99\nADC #$01\nSTA $0201\nLDA #$50\nSBC #$01\nSTA $0202\nCLC\nLDA #$00\nSBC #$00\nSTA $0203\nLDA #$45\nSTA $10\nSEC\nADC $10\nSTA $0204\nCLD\n");
+	vm_run(ctx);
+	REQUIRE(ctx->read(0x200) == 0x19 + 0x28 + 0x06);
+	REQUIRE(ctx->read(0x201) == 0x00);
+	// the carry of 99 + 01 is the missing borrow of 50 - 01
+	REQUIRE(ctx->read(0x202) == 0x49);
+	REQUIRE(ctx->read(0x203) == 0x99);
+	REQUIRE(ctx->read(0x204) == 0x91);
+	REQUIRE(!ctx->isSet(vm_flags::C));
+	REQUIRE(!ctx->isSet(vm_flags::D));
+	// all run loops use the same tables
+	vm_reset(ctx);
+	ctx->write(0x200, 0x00);
+	vm_run_fast(ctx);
+	REQUIRE(ctx->read(0x200) == 0x47);
+	REQUIRE(ctx->read(0x204) == 0x91);
+	vm_release(ctx);
+}
+
+TEST_CASE("RUN_ADC_MEMORY", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	// both modes add the value at $10 and $0310,X
+	vm_assemble(ctx, "LDA #$12\nSTA $10\nSTA $0313\nLDX #$03\nCLD\nCLC\nLDA #$05\nADC $10\nSTA $0200\nCLC\nLDA #$05\nADC $0310,X\nSTA $0201\nSED\nCLC\nLDA #$05\nADC $10\nSTA $0202\nCLD\n");
+	TestRunFunc runs[] = { &vm_run, &vm_run_fast, &vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		ctx->write(0x200, 0);
+		ctx->write(0x201, 0);
+		ctx->write(0x202, 0);
+		(*runs[i])(ctx);
+		REQUIRE(ctx->read(0x200) == 0x17);
+		REQUIRE(ctx->read(0x201) == 0x17);
+		REQUIRE(ctx->read(0x202) == 0x17);
+	}
+	std::string code;
+	REQUIRE(vm_recompile(ctx, "prog", code));
+	REQUIRE(code.find("int t = a + ctx->read(0x10) +") != std::string::npos);
+	REQUIRE(code.find("int t = a + ctx->read((0x0310 + x)) +") != std::string::npos);
+	vm_release(ctx);
+}
+
+TEST_CASE("RUN_BATCH", "[ASM]") {
+	vm_context* ctx = vm_create_context();
+	int num = vm_assemble(ctx, "LDX $0300\ndecrement:\nDEX\nSTX $0200\nBNE decrement\nLDY $0301\nINY\nSTY $0201\n");
+	std::vector<vm_batch_job> jobs(100);
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		vm_batch_job& job = jobs[i];
+		job.binary = ctx->mem + 0x600;
+		job.numBytes = num;
+		job.maxInstructions = 0;
+		vm_memory_block block;
+		block.address = 0x300;
+		block.data.push_back(i + 1);
+		block.data.push_back(i);
+		job.memory.push_back(block);
+		vm_memory_range range = { 0x200, 2 };
+		job.ranges.push_back(range);
+	}
+	jobs[99].maxInstructions = 4;
+	std::vector<vm_batch_result> results;
+	vm_run_batch(jobs, results, 4);
+	REQUIRE(results.size() == 100);
+	for (size_t i = 0; i < 99; ++i) {
+		REQUIRE(results[i].registers[vm_registers::X] == 0);
+		REQUIRE(results[i].registers[vm_registers::Y] == i + 1);
+		REQUIRE(results[i].memory.size() == 2);
+		REQUIRE(results[i].memory[0] == 0);
+		REQUIRE(results[i].memory[1] == i + 1);
+		REQUIRE(results[i].instructions == (i + 1) * 3 + 4);
+	}
+	REQUIRE(results[99].instructions == 4);
+	REQUIRE(results[99].registers[vm_registers::X] == 99);
+	vm_release(ctx);
+}
+
+TEST_CASE("RUN_BATCH_OVERSIZED", "[ASM]") {
+	// a binary longer than the memory behind 0x600 is cut off
+	std::vector<uint8_t> binary(0xFFFF, 0xE8);
+	binary[0x100] = 0x00;
+	// no IRQ vector, so the BRK ends the program
+	binary[0xFFFE - 0x600] = 0x00;
+	binary[0xFFFF - 0x600] = 0x00;
+	std::vector<vm_batch_job> jobs(1);
+	jobs[0].binary = binary.data();
+	jobs[0].numBytes = 0xFFFF;
+	jobs[0].maxInstructions = 0;
+	vm_memory_range range = { 0xFFFC, 2 };
+	jobs[0].ranges.push_back(range);
+	std::vector<vm_batch_result> results;
+	vm_run_batch(jobs, results, 1);
+	REQUIRE(results.size() == 1);
+	REQUIRE(results[0].registers[vm_registers::X] == 0x00);
+	REQUIRE(results[0].instructions <= 0x101);
+	REQUIRE(results[0].memory[0] == 0xE8);
+	REQUIRE(results[0].memory[1] == 0xE8);
+}
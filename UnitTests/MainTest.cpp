@@ -3,6 +3,32 @@
 #include "catch.hpp"
 #include "..\6502.h"
 
+// ------------------------------------------------------
+// the complete state of both contexts must be equal
+// ------------------------------------------------------
+void require_same_state(const vm_context* ctx, const vm_context* expected) {
+	REQUIRE(ctx->programCounter == expected->programCounter);
+	REQUIRE(ctx->registers[vm_registers::A] == expected->registers[vm_registers::A]);
+	REQUIRE(ctx->registers[vm_registers::X] == expected->registers[vm_registers::X]);
+	REQUIRE(ctx->registers[vm_registers::Y] == expected->registers[vm_registers::Y]);
+	REQUIRE(ctx->getFlags() == expected->getFlags());
+	REQUIRE(ctx->sp == expected->sp);
+	REQUIRE(ctx->cycles == expected->cycles);
+	REQUIRE(memcmp(ctx->mem, expected->mem, 65536) == 0);
+}
+
+// ------------------------------------------------------
+// the length of an instruction of the 6502
+// ------------------------------------------------------
+static int instruction_length(vm_addressing_mode mode) {
+	switch (mode) {
+		case NONE: case ACCUMULATOR: return 1;
+		case ABSOLUTE_ADR: case ABSOLUTE_X: case ABSOLUTE_Y:
+		case INDIRECT_ADR: case JMP_ABSOLUTE: case JMP_INDIRECT: return 3;
+		default: return 2;
+	}
+}
+
 TEST_CASE("HexTest", "[StringTests]") {
 	REQUIRE(vm_str_is_hex('0') == true);
 	REQUIRE(vm_str_is_hex('A') == true);
@@ -122,6 +148,31 @@ TEST_CASE("ROL", "[CommandTest]") {
 	vm_release();
 }
 
+TEST_CASE("LazyFlags", "[CommandTest]") {
+	vm_context* ctx = vm_create();
+	ctx->setFlags(0x01 << vm_flags::C);
+	vm_op_lda(ctx, 0x80, IMMEDIDATE);
+	REQUIRE(ctx->lazyFlags);
+	REQUIRE(ctx->isSet(vm_flags::N));
+	REQUIRE(!ctx->isSet(vm_flags::Z));
+	REQUIRE(ctx->getFlags() == 0x82);
+	// flags other than N and Z keep the evaluation pending
+	vm_op_clc(ctx, 0, NONE);
+	REQUIRE(ctx->lazyFlags);
+	REQUIRE(ctx->getFlags() == 0x80);
+	vm_op_php(ctx, 0, NONE);
+	REQUIRE(ctx->read(0x100 + ctx->sp + 1) == 0x80);
+	vm_op_ldx(ctx, 0, IMMEDIDATE);
+	REQUIRE(ctx->isSet(vm_flags::Z));
+	REQUIRE(!ctx->isSet(vm_flags::N));
+	// CMP sets Z directly and evaluates the pending N first
+	vm_op_lda(ctx, 0x90, IMMEDIDATE);
+	vm_op_cmp(ctx, 0x10, IMMEDIDATE);
+	REQUIRE(!ctx->lazyFlags);
+	REQUIRE(ctx->flags == 0x82);
+	vm_release();
+}
+
 TEST_CASE("GetData", "[ADR_MODE]") {
 	vm_context* ctx = vm_create();
 	ctx->programCounter = 0;
@@ -134,4 +185,159 @@ TEST_CASE("GetData", "[ADR_MODE]") {
 	tst = get_data(ctx, vm_addressing_mode::ZERO_PAGE_X);
 	REQUIRE(tst == 3);
 	vm_release();
-}
\ No newline at end of file
+}
+
+TEST_CASE("DecodeTable", "[DECODE]") {
+	int i = 0;
+	while (VM_COMMAND_MAPPING[i].op_code != EOL) {
+		const vm_command_mapping& m = VM_COMMAND_MAPPING[i];
+		const vm_decode_entry& entry = VM_DECODE_TABLE[m.hex];
+		REQUIRE(entry.op_code == m.op_code);
+		REQUIRE(entry.mode == m.mode);
+		REQUIRE(entry.function == VM_COMMANDS[m.op_code].function);
+		REQUIRE(entry.cycles == m.cycles);
+		REQUIRE(entry.pageCross == m.pageCross);
+		++i;
+	}
+	// instruction lengths of the 6502
+	REQUIRE(VM_DECODE_TABLE[0xEA].dataSize + 1 == 1);
+	REQUIRE(VM_DECODE_TABLE[0x0A].dataSize + 1 == 1);
+	REQUIRE(VM_DECODE_TABLE[0xA9].dataSize + 1 == 2);
+	REQUIRE(VM_DECODE_TABLE[0xB5].dataSize + 1 == 2);
+	REQUIRE(VM_DECODE_TABLE[0xA1].dataSize + 1 == 2);
+	REQUIRE(VM_DECODE_TABLE[0xB1].dataSize + 1 == 2);
+	REQUIRE(VM_DECODE_TABLE[0xD0].dataSize + 1 == 2);
+	REQUIRE(VM_DECODE_TABLE[0xAD].dataSize + 1 == 3);
+	REQUIRE(VM_DECODE_TABLE[0xBD].dataSize + 1 == 3);
+	REQUIRE(VM_DECODE_TABLE[0x4C].dataSize + 1 == 3);
+	REQUIRE(VM_DECODE_TABLE[0x6C].dataSize + 1 == 3);
+	REQUIRE(VM_DECODE_TABLE[0x20].dataSize + 1 == 3);
+	REQUIRE(VM_DECODE_TABLE[0xEA].op_code == NOP);
+	REQUIRE(VM_DECODE_TABLE[0x02].op_code == EOL);
+	REQUIRE(VM_DECODE_TABLE[0x02].function == &vm_op_nop);
+}
+
+TEST_CASE("RunFastMatchesStep", "[DECODE]") {
+	vm_context* ctx = vm_create();
+	vm_context* expected = new vm_context;
+	int i = 0;
+	while (VM_COMMAND_MAPPING[i].op_code != EOL) {
+		const vm_command_mapping& m = VM_COMMAND_MAPPING[i];
+		for (int j = 0; j < 65536; ++j) {
+			ctx->mem[j] = 0;
+		}
+		for (int j = 0; j < 256; ++j) {
+			ctx->mem[j] = (j * 7) & 0xFF;
+			ctx->mem[0x1200 + j] = (j * 13) & 0xFF;
+		}
+		ctx->mem[0x1F3] = 0x20;
+		ctx->mem[0x600] = m.hex;
+		ctx->mem[0x601] = 0x34;
+		ctx->mem[0x602] = 0x12;
+		ctx->numBytes = instruction_length(m.mode);
+		ctx->registers[vm_registers::A] = 0x81;
+		ctx->registers[vm_registers::X] = 0xF0;
+		ctx->registers[vm_registers::Y] = 0x22;
+		ctx->setFlags(0x43);
+		ctx->sp = 0xF0;
+		vm_context* initial = new vm_context(*ctx);
+		vm_run();
+		*expected = *ctx;
+		*ctx = *initial;
+		vm_run_fast(ctx);
+		INFO("opcode " << (int)m.hex);
+		require_same_state(ctx, expected);
+		*ctx = *initial;
+		vm_block_cache_enable(ctx);
+		vm_run(ctx);
+		vm_block_cache_disable(ctx);
+		require_same_state(ctx, expected);
+		*ctx = *initial;
+		vm_run_jit(ctx);
+		vm_jit_release(ctx);
+		require_same_state(ctx, expected);
+		delete initial;
+		++i;
+	}
+	delete expected;
+	vm_release();
+}
+
+TEST_CASE("Cycles", "[DECODE]") {
+	vm_context* ctx = vm_create_context();
+	// LDA $12F0,X with X = 0x20 crosses a page
+	uint8_t code[] = { 0xA2, 0x20, 0xBD, 0xF0, 0x12, 0xBD, 0x00, 0x12 };
+	memcpy(ctx->mem + 0x600, code, sizeof(code));
+	ctx->numBytes = sizeof(code);
+	vm_run(ctx);
+	REQUIRE(ctx->cycles == 2 + 5 + 4);
+	ctx->cycles = 0;
+	vm_run_fast(ctx);
+	REQUIRE(ctx->cycles == 2 + 5 + 4);
+	// LDA ($10),Y with $12F0 at $10 and Y = 0x20 crosses a page,
+	// LDA ($12),Y with $1200 at $12 does not
+	uint8_t indirect[] = { 0xA0, 0x20, 0xB1, 0x10, 0x8D, 0x00, 0x02, 0xB1, 0x12, 0x8D, 0x01, 0x02 };
+	memcpy(ctx->mem + 0x600, indirect, sizeof(indirect));
+	ctx->numBytes = sizeof(indirect);
+	ctx->mem[0x10] = 0xF0;
+	ctx->mem[0x11] = 0x12;
+	ctx->mem[0x12] = 0x00;
+	ctx->mem[0x13] = 0x12;
+	ctx->mem[0x1310] = 0x42;
+	ctx->mem[0x1220] = 0x24;
+	void(*runs[])(vm_context*) = { vm_run, vm_run_fast, vm_run_jit };
+	for (int i = 0; i < 3; ++i) {
+		ctx->cycles = 0;
+		ctx->mem[0x200] = 0;
+		ctx->mem[0x201] = 0;
+		(*runs[i])(ctx);
+		REQUIRE(ctx->cycles == 2 + 6 + 4 + 5 + 4);
+		REQUIRE(ctx->mem[0x200] == 0x42);
+		REQUIRE(ctx->mem[0x201] == 0x24);
+	}
+	ctx->cycles = 0;
+	vm_block_cache_enable(ctx);
+	vm_run(ctx);
+	vm_block_cache_disable(ctx);
+	REQUIRE(ctx->cycles == 2 + 6 + 4 + 5 + 4);
+	// LDA ($10,X) with X = 2 reads the pointer $1200 at $12
+	uint8_t indexed[] = { 0xA2, 0x02, 0xA1, 0x10, 0x8D, 0x00, 0x02 };
+	memcpy(ctx->mem + 0x600, indexed, sizeof(indexed));
+	ctx->numBytes = sizeof(indexed);
+	ctx->mem[0x1200] = 0x33;
+	for (int i = 0; i < 3; ++i) {
+		ctx->cycles = 0;
+		ctx->mem[0x200] = 0;
+		(*runs[i])(ctx);
+		REQUIRE(ctx->cycles == 2 + 6 + 4);
+		REQUIRE(ctx->programCounter == 0x607);
+		REQUIRE(ctx->mem[0x200] == 0x33);
+	}
+	ctx->cycles = 0;
+	ctx->mem[0x200] = 0;
+	vm_block_cache_enable(ctx);
+	vm_run(ctx);
+	vm_block_cache_disable(ctx);
+	REQUIRE(ctx->cycles == 2 + 6 + 4);
+	REQUIRE(ctx->mem[0x200] == 0x33);
+	memcpy(ctx->mem + 0x600, indirect, sizeof(indirect));
+	ctx->numBytes = sizeof(indirect);
+	// the recompiled code leaves the pointer to vm_step
+	std::string aot;
+	REQUIRE(vm_recompile(ctx, "prog", aot));
+	REQUIRE(aot.find("// 0602 LDA\n\tVM_AOT_SAVE(0x0602);\n\tvm_step(ctx);") != std::string::npos);
+	// LDX #3 / DEX / BNE back, taken twice on the same page
+	// adding one cycle each time
+	uint8_t loop[] = { 0xA2, 0x03, 0xCA, 0xD0, 0xFD };
+	memcpy(ctx->mem + 0x600, loop, sizeof(loop));
+	ctx->numBytes = sizeof(loop);
+	ctx->cycles = 0;
+	vm_run(ctx);
+	REQUIRE(ctx->cycles == 2 + 3 * (2 + 2) + 2);
+	// the budget stops the run after the first instruction
+	vm_reset(ctx);
+	REQUIRE(vm_run_cycles(ctx, 1) == 2);
+	REQUIRE(ctx->programCounter == 0x602);
+	REQUIRE(vm_run_cycles(ctx, 100) == 3 * (2 + 2) + 2);
+	vm_release(ctx);
+}
@@ -0,0 +1,82 @@
+// generated by vm_recompile from 13 bytes at 0x0600
+#include "6502.h"
+
+#define VM_AOT_LOAD ctx->syncFlags(); a = ctx->registers[0]; x = ctx->registers[1]; y = ctx->registers[2]; f = ctx->flags
+#define VM_AOT_SAVE(pc) ctx->registers[0] = a; ctx->registers[1] = x; ctx->registers[2] = y; ctx->flags = f; ctx->cycles += cycles; cycles = 0; ctx->programCounter = (pc)
+#define VM_AOT_EXIT(pc) do { VM_AOT_SAVE(pc); return (pc); } while (0)
+#define VM_AOT_ZN(v) f = (uint8_t)((f & 0x7B) | ((v) & 0x80) | ((v) == 0 ? 0x04 : 0))
+#define VM_AOT_ZN_INT(v) f = (uint8_t)((f & 0x7B) | ((v) > 127 ? 0x80 : 0) | ((v) == 0 ? 0x04 : 0))
+#define VM_AOT_COMPARE(r, d) f = (uint8_t)((f & 0xF9) | ((r) == (d) ? 0x04 : 0) | ((r) >= (d) ? 0x02 : 0))
+#define VM_AOT_ADD(t) f = (uint8_t)(((t) > 255 ? f | 0x02 : f) & 0xFB); a = (uint8_t)(t); if ((t) == 0) f |= 0x04; { int c = (t) > 255 ? 256 - (t) : (t); f = (uint8_t)(c <= -128 || c >= 127 ? f | 0x40 : f & 0xBF); }
+
+static int loop_aot_0600(vm_context* ctx) {
+	uint8_t a, x, y, f;
+	uint64_t cycles = 0;
+	VM_AOT_LOAD;
+	// 0600 LDY
+	cycles += 2;
+	y = (uint8_t)0x0; VM_AOT_ZN(y);
+	VM_AOT_EXIT(0x0602);
+}
+
+static int loop_aot_0602(vm_context* ctx) {
+	uint8_t a, x, y, f;
+	uint64_t cycles = 0;
+	VM_AOT_LOAD;
+	// 0602 LDX
+	cycles += 2;
+	x = (uint8_t)0x0; VM_AOT_ZN(x);
+	VM_AOT_EXIT(0x0604);
+}
+
+static int loop_aot_0604(vm_context* ctx) {
+	uint8_t a, x, y, f;
+	uint64_t cycles = 0;
+	VM_AOT_LOAD;
+	// 0604 DEX
+	cycles += 2;
+	--x; VM_AOT_ZN(x);
+	// 0605 STX
+	cycles += 4;
+	ctx->write(0x200, x);
+	// 0608 BNE
+	cycles += 2;
+	if (!(f & 0x04)) {
+		cycles += 1;
+		VM_AOT_EXIT(0x0604);
+	}
+	VM_AOT_EXIT(0x060A);
+}
+
+static int loop_aot_060A(vm_context* ctx) {
+	uint8_t a, x, y, f;
+	uint64_t cycles = 0;
+	VM_AOT_LOAD;
+	// 060A DEY
+	cycles += 2;
+	--y; VM_AOT_ZN(y);
+	// 060B BNE
+	cycles += 2;
+	if (!(f & 0x04)) {
+		cycles += 1;
+		VM_AOT_EXIT(0x0602);
+	}
+	VM_AOT_EXIT(0x060D);
+}
+
+void loop_aot(vm_context* ctx) {
+	int pc = 0x0600;
+	ctx->programCounter = 0x0600;
+	do {
+		switch (pc) {
+			case 0x0600: pc = loop_aot_0600(ctx); break;
+			case 0x0602: pc = loop_aot_0602(ctx); break;
+			case 0x0604: pc = loop_aot_0604(ctx); break;
+			case 0x060A: pc = loop_aot_060A(ctx); break;
+			default:
+				ctx->programCounter = pc;
+				pc = vm_step(ctx) ? ctx->programCounter : -1;
+				break;
+		}
+	} while (pc >= 0 && pc < 0x060D);
+}
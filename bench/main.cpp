@@ -0,0 +1,711 @@
+#include <chrono>
+#include <algorithm>
+#define VM_IMPLEMENTATION
+#include "..\6502.h"
+
+// ------------------------------------------------------
+// Nested loop which stores the inner counter. It runs
+// roughly 200k instructions.
+// ------------------------------------------------------
+const char* LOOP_CODE =
+	"LDY #$00\n"
+	"outer:\n"
+	"LDX #$00\n"
+	"inner:\n"
+	"DEX\n"
+	"STX $0200\n"
+	"BNE inner\n"
+	"DEY\n"
+	"BNE outer\n";
+
+typedef void(*runFunc)(vm_context*);
+
+// ------------------------------------------------------
+// LOOP_CODE translated by vm_recompile. Regenerate it
+// by running the benchmark with -aot.
+// ------------------------------------------------------
+void loop_aot(vm_context* ctx);
+
+// ------------------------------------------------------
+// count the instructions of one run using vm_step
+// ------------------------------------------------------
+uint64_t count_instructions(vm_context* ctx) {
+	uint64_t cnt = 0;
+	ctx->programCounter = 0x600;
+	int end = ctx->programCounter + ctx->numBytes;
+	bool running = true;
+	while (running) {
+		running = vm_step(ctx);
+		++cnt;
+		if (ctx->programCounter >= end) {
+			running = false;
+		}
+	}
+	return cnt;
+}
+
+// ------------------------------------------------------
+// measure MIPS of a run function
+// ------------------------------------------------------
+double measure(vm_context* ctx, runFunc func, uint64_t instructions, int runs) {
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		(*func)(ctx);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return (double)(instructions * runs) / seconds / 1000000.0;
+}
+
+// ------------------------------------------------------
+// measure MIPS of the batch runner
+// ------------------------------------------------------
+double measure_batch(vm_context* ctx, uint64_t instructions, int runs, int numThreads) {
+	std::vector<vm_batch_job> jobs(runs);
+	for (int i = 0; i < runs; ++i) {
+		jobs[i].binary = ctx->mem + 0x600;
+		jobs[i].numBytes = ctx->numBytes;
+		jobs[i].maxInstructions = 0;
+	}
+	std::vector<vm_batch_result> results;
+	auto start = std::chrono::high_resolution_clock::now();
+	vm_run_batch(jobs, results, numThreads);
+	auto end = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+	return (double)(instructions * runs) / seconds / 1000000.0;
+}
+
+// ------------------------------------------------------
+// compare the setup cost of a copied context with a fork
+// of a snapshot. Returns the microseconds per context.
+// ------------------------------------------------------
+double measure_copy(vm_context* ctx, int runs) {
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		vm_context* copy = new vm_context(*ctx);
+		copy->write(0x200, i);
+		delete copy;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count() / runs;
+}
+
+double measure_fork(vm_context* ctx, int runs) {
+	vm_context_snapshot* snapshot = vm_snapshot(ctx);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		vm_context* fork = vm_fork(snapshot);
+		fork->write(0x200, i);
+		vm_release(fork);
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	vm_snapshot_release(snapshot);
+	return std::chrono::duration<double, std::micro>(end - start).count() / runs;
+}
+
+// ------------------------------------------------------
+// compare restoring the whole memory after a run with
+// resetting only the dirty pages. Returns the microseconds
+// per reset.
+// ------------------------------------------------------
+double measure_reset(vm_context* ctx, bool dirty, int runs) {
+	std::vector<uint8_t> image(ctx->mem, ctx->mem + 65536);
+	vm_dirty_clear(ctx);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		ctx->write(0x200, i);
+		ctx->write(0x1FF, i);
+		if (dirty) {
+			vm_dirty_reset(ctx, image.data());
+		}
+		else {
+			memcpy(ctx->mem, image.data(), image.size());
+		}
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count() / runs;
+}
+
+// ------------------------------------------------------
+// save and restore the complete state. Returns the
+// microseconds per save and load.
+// ------------------------------------------------------
+void measure_state(vm_context* ctx, int runs, double* save, double* load, size_t* size) {
+	std::vector<uint8_t> data;
+	vm_context* restored = vm_create_context();
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		vm_save_state(ctx, data);
+	}
+	auto middle = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < runs; ++i) {
+		vm_load_state(restored, data.data(), data.size());
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	vm_release(restored);
+	*save = std::chrono::duration<double, std::micro>(middle - start).count() / runs;
+	*load = std::chrono::duration<double, std::micro>(end - middle).count() / runs;
+	*size = data.size();
+}
+
+// ------------------------------------------------------
+// compare vm_run and vm_run_jit on all programs in the
+// prog directory
+// ------------------------------------------------------
+void measure_programs(const char* directory, int runs) {
+	const char* PROGRAMS[] = { "basic.txt", "branching.txt", "first.txt", "second.txt", "test.txt" };
+	for (int i = 0; i < 5; ++i) {
+		char fileName[256];
+		sprintf_s(fileName, "%s/%s", directory, PROGRAMS[i]);
+		vm_context* ctx = vm_create_context();
+		if (vm_assemble_file(ctx, fileName) > 0) {
+			uint64_t instructions = count_instructions(ctx);
+			double step = measure(ctx, &vm_run, instructions, runs);
+			double jit = measure(ctx, &vm_run_jit, instructions, runs);
+			printf("%-14s: vm_run %8.2f MIPS vm_run_jit %8.2f MIPS (%.2fx)\n", PROGRAMS[i], step, jit, jit / step);
+		}
+		else {
+			printf("%-14s: %s\n", PROGRAMS[i], ctx->debug);
+		}
+		vm_release(ctx);
+	}
+}
+
+// ------------------------------------------------------
+// Workloads of the suite. The code only uses backward
+// branches and forward jumps. The results are not
+// checked, only the time is measured.
+// ------------------------------------------------------
+typedef struct Workload {
+	const char* name;
+	const char* code;
+} Workload;
+
+// copies 32 pages from $1000 to $2000
+const char* MEMCPY_CODE =
+	"LDY #$20\n"
+	"page:\n"
+	"LDX #$00\n"
+	"copy:\n"
+	"LDA $1000,X\n"
+	"STA $2000,X\n"
+	"INX\n"
+	"BNE copy\n"
+	"DEY\n"
+	"BNE page\n";
+
+// shift and add multiply of $1234 and $5678 done 256 times
+const char* MULTIPLY_CODE =
+	"LDY #$00\n"
+	"again:\n"
+	"LDA #$34\n"
+	"STA $10\n"
+	"LDA #$12\n"
+	"STA $11\n"
+	"LDA #$78\n"
+	"STA $12\n"
+	"LDA #$56\n"
+	"STA $13\n"
+	"LDA #$00\n"
+	"STA $14\n"
+	"STA $15\n"
+	"LDX #$10\n"
+	"JMP shift\n"
+	"add:\n"
+	"CLC\n"
+	"LDA $14\n"
+	"ADC $10\n"
+	"STA $14\n"
+	"LDA $15\n"
+	"ADC $11\n"
+	"STA $15\n"
+	"JMP next\n"
+	"shift:\n"
+	"LSR $13\n"
+	"ROR $12\n"
+	"BCS add\n"
+	"next:\n"
+	"ASL $10\n"
+	"ROL $11\n"
+	"DEX\n"
+	"BNE shift\n"
+	"DEY\n"
+	"BNE again\n";
+
+// counting sort of the 256 bytes at $1000 into $2000
+const char* SORT_CODE =
+	"LDY #$00\n"
+	"count:\n"
+	"LDX $1000,Y\n"
+	"INC $0400,X\n"
+	"INY\n"
+	"BNE count\n"
+	"LDX #$00\n"
+	"LDY #$00\n"
+	"JMP check\n"
+	"emit:\n"
+	"TXA\n"
+	"STA $2000,Y\n"
+	"INY\n"
+	"DEC $0400,X\n"
+	"check:\n"
+	"LDA $0400,X\n"
+	"BNE emit\n"
+	"INX\n"
+	"BNE check\n";
+
+const Workload WORKLOADS[] = {
+	{ "loop", LOOP_CODE },
+	{ "memcpy", MEMCPY_CODE },
+	{ "multiply", MULTIPLY_CODE },
+	{ "sort", SORT_CODE }
+};
+
+typedef struct Engine {
+	const char* name;
+	runFunc func;
+} Engine;
+
+const Engine ENGINES[] = {
+	{ "vm_run", &vm_run },
+	{ "vm_run_fast", &vm_run_fast },
+	{ "vm_run_jit", &vm_run_jit }
+};
+
+typedef struct SuiteResult {
+	std::string workload;
+	std::string engine;
+	double mips;
+} SuiteResult;
+
+// ------------------------------------------------------
+// run the program again and again for the given time.
+// Returns the MIPS.
+// ------------------------------------------------------
+double measure_time(vm_context* ctx, runFunc func, uint64_t instructions, double seconds) {
+	uint64_t runs = 0;
+	double elapsed = 0.0;
+	auto start = std::chrono::high_resolution_clock::now();
+	while (elapsed < seconds) {
+		(*func)(ctx);
+		++runs;
+		elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+	return (double)(instructions * runs) / elapsed / 1000000.0;
+}
+
+// ------------------------------------------------------
+// the same random bytes at $1000 for every workload
+// ------------------------------------------------------
+void fill_random(vm_context* ctx) {
+	uint32_t seed = 1;
+	for (int i = 0; i < 256; ++i) {
+		seed = seed * 1103515245 + 12345;
+		ctx->write(0x1000 + i, (seed >> 16) & 0xFF);
+	}
+}
+
+// ------------------------------------------------------
+// measure all engines on one assembled workload
+// ------------------------------------------------------
+void measure_workload(vm_context* ctx, const char* name, double seconds, std::vector<SuiteResult>& results) {
+	fill_random(ctx);
+	uint64_t instructions = count_instructions(ctx);
+	for (int i = 0; i < 3; ++i) {
+		SuiteResult result = { name, ENGINES[i].name, measure_time(ctx, ENGINES[i].func, instructions, seconds) };
+		results.push_back(result);
+	}
+}
+
+// ------------------------------------------------------
+// read a baseline written by -save
+// ------------------------------------------------------
+bool load_baseline(const char* fileName, std::vector<SuiteResult>& baseline) {
+	FILE* fp = fopen(fileName, "r");
+	if (fp == nullptr) {
+		return false;
+	}
+	char workload[256];
+	char engine[64];
+	double mips = 0.0;
+	while (fscanf(fp, "%255s %63s %lf", workload, engine, &mips) == 3) {
+		SuiteResult result = { workload, engine, mips };
+		baseline.push_back(result);
+	}
+	fclose(fp);
+	return true;
+}
+
+// ------------------------------------------------------
+// run the suite. Every workload runs the given time per
+// engine.
+//   -time seconds    time per workload and engine (1.0)
+//   -prog directory  directory of the programs (prog)
+//   -save file       write the results as baseline
+//   -compare file    compare with a saved baseline
+// ------------------------------------------------------
+int run_suite(int argc, char* argv[]) {
+	double seconds = 1.0;
+	const char* directory = "prog";
+	const char* saveFile = nullptr;
+	const char* compareFile = nullptr;
+	for (int i = 0; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "-time") == 0) {
+			seconds = atof(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-prog") == 0) {
+			directory = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "-save") == 0) {
+			saveFile = argv[i + 1];
+		}
+		else if (strcmp(argv[i], "-compare") == 0) {
+			compareFile = argv[i + 1];
+		}
+	}
+	std::vector<SuiteResult> baseline;
+	if (compareFile != nullptr && !load_baseline(compareFile, baseline)) {
+		printf("Cannot read baseline '%s'\n", compareFile);
+		return 1;
+	}
+	std::vector<SuiteResult> results;
+	for (int i = 0; i < 4; ++i) {
+		vm_context* ctx = vm_create_context();
+		vm_assemble(ctx, WORKLOADS[i].code);
+		measure_workload(ctx, WORKLOADS[i].name, seconds, results);
+		vm_release(ctx);
+	}
+	const char* PROGRAMS[] = { "basic.txt", "branching.txt", "first.txt", "second.txt", "test.txt" };
+	for (int i = 0; i < 5; ++i) {
+		char fileName[256];
+		sprintf_s(fileName, "%s/%s", directory, PROGRAMS[i]);
+		vm_context* ctx = vm_create_context();
+		if (vm_assemble_file(ctx, fileName) > 0) {
+			measure_workload(ctx, PROGRAMS[i], seconds, results);
+		}
+		else {
+			printf("%-14s: %s\n", PROGRAMS[i], ctx->debug);
+		}
+		vm_release(ctx);
+	}
+	printf("%-14s %-12s %10s %10s %9s\n", "workload", "engine", "MIPS", "ns/instr", "baseline");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const SuiteResult& r = results[i];
+		printf("%-14s %-12s %10.2f %10.2f", r.workload.c_str(), r.engine.c_str(), r.mips, 1000.0 / r.mips);
+		for (size_t j = 0; j < baseline.size(); ++j) {
+			if (baseline[j].workload == r.workload && baseline[j].engine == r.engine) {
+				printf(" %+8.1f%%", (r.mips / baseline[j].mips - 1.0) * 100.0);
+			}
+		}
+		printf("\n");
+	}
+	if (saveFile != nullptr) {
+		FILE* fp = fopen(saveFile, "w");
+		if (fp == nullptr) {
+			printf("Cannot write baseline '%s'\n", saveFile);
+			return 1;
+		}
+		for (size_t i = 0; i < results.size(); ++i) {
+			fprintf(fp, "%s %s %.3f\n", results[i].workload.c_str(), results[i].engine.c_str(), results[i].mips);
+		}
+		fclose(fp);
+	}
+	return 0;
+}
+
+// ------------------------------------------------------
+// Per opcode microbenchmark. Every entry of
+// VM_COMMAND_MAPPING is unrolled into a straight line of
+// elements and run with vm_run and vm_run_fast. Running
+// count and 2 * count elements and taking the difference
+// removes the cost of the run loop itself.
+// Branches are measured not taken. RTS and RTI push their
+// return address first, the same elements without the
+// opcode are measured and subtracted. BRK returns with a
+// RTI and the cost of the RTI is subtracted.
+// ------------------------------------------------------
+const uint16_t OPS_DATA = 0x7000;
+const uint16_t OPS_POINTERS = 0x7100;
+// below the program, the run loops stop at every address behind it
+const uint16_t OPS_HANDLER = 0x0500;
+
+// flags which let the branch fall through
+uint8_t ops_flags(const vm_command_mapping& m) {
+	uint8_t all = (1 << vm_flags::C) | (1 << vm_flags::Z) | (1 << vm_flags::N) | (1 << vm_flags::V);
+	if (m.op_code == BCC || m.op_code == BNE || m.op_code == BPL || m.op_code == BVC) {
+		return all;
+	}
+	return 0;
+}
+
+// number of helper instructions in front of the opcode
+int ops_helpers(const vm_command_mapping& m) {
+	if (m.op_code == RTS) {
+		return 4;
+	}
+	if (m.op_code == RTI) {
+		return 6;
+	}
+	return 0;
+}
+
+// ------------------------------------------------------
+// write one element at pc. Returns the address of the
+// next element. Without opcode only the helpers are
+// written.
+// ------------------------------------------------------
+uint16_t ops_element(vm_context* ctx, const vm_command_mapping& m, uint16_t pc, int index, bool opcode) {
+	int size = VM_DATA_SIZE[m.mode] + 1;
+	// BRK skips a padding byte
+	if (m.op_code == BRK) {
+		size = 2;
+	}
+	uint16_t next = pc + ops_helpers(m) / 2 * 3 + size;
+	uint16_t pushed[3] = { (uint16_t)(next - 1), 0, 0 };
+	if (m.op_code == RTI) {
+		pushed[0] = next;
+	}
+	uint8_t values[3] = { (uint8_t)(pushed[0] >> 8), (uint8_t)(pushed[0] & 0xFF), 0 };
+	for (int i = 0; i < ops_helpers(m) / 2; ++i) {
+		ctx->write(pc++, 0xA9);
+		ctx->write(pc++, values[i]);
+		ctx->write(pc++, 0x48);
+	}
+	if (!opcode) {
+		return pc;
+	}
+	ctx->write(pc, m.hex);
+	uint16_t operand = 0;
+	switch (m.mode) {
+		case IMMEDIDATE: case RELATIVE_ADR: operand = 0; break;
+		case ZERO_PAGE: case ZERO_PAGE_X: case ZERO_PAGE_Y: case INDIRECT_X: case INDIRECT_Y: operand = 0x80; break;
+		case JMP_ABSOLUTE: operand = next; break;
+		case JMP_INDIRECT:
+			operand = OPS_POINTERS + index * 2;
+			ctx->write(operand, next & 0xFF);
+			ctx->write(operand + 1, next >> 8);
+			break;
+		default: operand = OPS_DATA; break;
+	}
+	for (int i = 1; i < size; ++i) {
+		ctx->write(pc + i, i == 1 ? operand & 0xFF : operand >> 8);
+	}
+	return next;
+}
+
+// ------------------------------------------------------
+// unroll count elements at 0x600. Returns the number of
+// instructions of one run.
+// ------------------------------------------------------
+int ops_build(vm_context* ctx, const vm_command_mapping& m, int count, bool opcode) {
+	memset(ctx->mem, 0, 65536);
+	ctx->write(OPS_HANDLER, 0x40);
+	ctx->write(0xFFFE, OPS_HANDLER & 0xFF);
+	ctx->write(0xFFFF, OPS_HANDLER >> 8);
+	ctx->write(0x80, OPS_DATA & 0xFF);
+	ctx->write(0x81, OPS_DATA >> 8);
+	uint16_t pc = 0x600;
+	for (int i = 0; i < count; ++i) {
+		pc = ops_element(ctx, m, pc, i, opcode);
+	}
+	ctx->numBytes = pc - 0x600;
+	vm_block_cache_flush(ctx);
+	if (!opcode) {
+		return count * ops_helpers(m);
+	}
+	return count * (1 + ops_helpers(m) + (m.op_code == BRK ? 1 : 0));
+}
+
+void ops_reset(vm_context* ctx, const vm_command_mapping& m) {
+	ctx->registers[vm_registers::A] = 0;
+	ctx->registers[vm_registers::X] = 0;
+	ctx->registers[vm_registers::Y] = 0;
+	ctx->sp = 0xFF;
+	ctx->setFlags(ops_flags(m));
+}
+
+// ------------------------------------------------------
+// step through one run and check that all instructions
+// are executed in a straight line
+// ------------------------------------------------------
+bool ops_valid(vm_context* ctx, const vm_command_mapping& m, int instructions) {
+	ops_reset(ctx, m);
+	ctx->programCounter = 0x600;
+	int end = 0x600 + ctx->numBytes;
+	int cnt = 0;
+	while (cnt < instructions) {
+		if (!vm_step(ctx)) {
+			return false;
+		}
+		++cnt;
+	}
+	return cnt == instructions && ctx->programCounter == end;
+}
+
+// ------------------------------------------------------
+// nanoseconds of one run. The time is split into a few
+// slices and the fastest average is used.
+// ------------------------------------------------------
+double ops_time(vm_context* ctx, const vm_command_mapping& m, runFunc func, double seconds) {
+	const int SLICES = 5;
+	double best = 0.0;
+	for (int i = 0; i < SLICES; ++i) {
+		uint64_t runs = 0;
+		double elapsed = 0.0;
+		auto start = std::chrono::high_resolution_clock::now();
+		while (elapsed < seconds / SLICES) {
+			ops_reset(ctx, m);
+			(*func)(ctx);
+			++runs;
+			elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		double ns = elapsed * 1000000000.0 / runs;
+		if (i == 0 || ns < best) {
+			best = ns;
+		}
+	}
+	return best;
+}
+
+// ------------------------------------------------------
+// nanoseconds of one element. The difference between
+// count and 2 * count elements removes the cost of the
+// run itself.
+// ------------------------------------------------------
+double ops_measure(vm_context* ctx, const vm_command_mapping& m, runFunc func, double seconds, int count, bool opcode) {
+	ops_build(ctx, m, count, opcode);
+	double first = ops_time(ctx, m, func, seconds);
+	ops_build(ctx, m, count * 2, opcode);
+	double second = ops_time(ctx, m, func, seconds);
+	return (second - first) / count;
+}
+
+// ------------------------------------------------------
+// run the microbenchmark. Prints ns per opcode for
+// vm_run and vm_run_fast and marks every opcode taking
+// more than twice the median with a *.
+//   -time seconds  time per opcode, count and engine
+// ------------------------------------------------------
+int run_ops(int argc, char* argv[]) {
+	double seconds = 0.02;
+	if (argc > 1 && strcmp(argv[0], "-time") == 0) {
+		seconds = atof(argv[1]);
+	}
+	const int COUNT = 256;
+	const runFunc FUNCS[] = { &vm_run, &vm_run_fast };
+	int num = 0;
+	while (VM_COMMAND_MAPPING[num].op_code != EOL) {
+		++num;
+	}
+	std::vector<double> ns(num * 2, 0.0);
+	std::vector<bool> valid(num, false);
+	int rti = -1;
+	vm_context* ctx = vm_create_context();
+	for (int i = 0; i < num; ++i) {
+		const vm_command_mapping& m = VM_COMMAND_MAPPING[i];
+		int single = ops_build(ctx, m, COUNT, true);
+		if (!ops_valid(ctx, m, single)) {
+			continue;
+		}
+		valid[i] = true;
+		for (int j = 0; j < 2; ++j) {
+			ns[i * 2 + j] = ops_measure(ctx, m, FUNCS[j], seconds, COUNT, true);
+			if (ops_helpers(m) > 0) {
+				ns[i * 2 + j] -= ops_measure(ctx, m, FUNCS[j], seconds, COUNT, false);
+			}
+		}
+		if (m.op_code == RTI) {
+			rti = i;
+		}
+	}
+	vm_release(ctx);
+	for (int i = 0; i < num; ++i) {
+		if (VM_COMMAND_MAPPING[i].op_code == BRK && rti >= 0) {
+			ns[i * 2] -= ns[rti * 2];
+			ns[i * 2 + 1] -= ns[rti * 2 + 1];
+		}
+	}
+	double median[2];
+	for (int j = 0; j < 2; ++j) {
+		std::vector<double> sorted;
+		for (int i = 0; i < num; ++i) {
+			if (valid[i]) {
+				sorted.push_back(ns[i * 2 + j]);
+			}
+		}
+		std::sort(sorted.begin(), sorted.end());
+		median[j] = sorted.empty() ? 0.0 : sorted[sorted.size() / 2];
+	}
+	printf("hex opcode mode         %10s   %10s\n", "vm_run ns", "fast ns");
+	for (int i = 0; i < num; ++i) {
+		const vm_command_mapping& m = VM_COMMAND_MAPPING[i];
+		printf("$%02X %-6s %-12s", m.hex, get_command_name(m.op_code), translate_addressing_mode(m.mode));
+		if (!valid[i]) {
+			printf(" skipped, does not run in a straight line\n");
+			continue;
+		}
+		for (int j = 0; j < 2; ++j) {
+			printf(" %10.2f %c", ns[i * 2 + j], ns[i * 2 + j] > median[j] * 2.0 ? '*' : ' ');
+		}
+		printf("\n");
+	}
+	printf("median           %10.2f   %10.2f\n", median[0], median[1]);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	int runs = 50;
+	vm_context* ctx = vm_create_context();
+	vm_assemble(ctx, LOOP_CODE);
+	if (argc > 1 && strcmp(argv[1], "-suite") == 0) {
+		vm_release(ctx);
+		return run_suite(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "-ops") == 0) {
+		vm_release(ctx);
+		return run_ops(argc - 2, argv + 2);
+	}
+	if (argc > 1 && strcmp(argv[1], "-aot") == 0) {
+		vm_recompile_file(ctx, "loop_aot", "loop_aot.cpp");
+		printf("%s\n", ctx->debug);
+		vm_release(ctx);
+		return 0;
+	}
+	if (argc > 1) {
+		runs = atoi(argv[1]);
+	}
+	uint64_t instructions = count_instructions(ctx);
+	printf("instructions per run: %llu runs: %d\n", (unsigned long long)instructions, runs);
+	double step = measure(ctx, &vm_run, instructions, runs);
+	printf("vm_run      : %8.2f MIPS\n", step);
+	double fast = measure(ctx, &vm_run_fast, instructions, runs);
+	printf("vm_run_fast : %8.2f MIPS\n", fast);
+	printf("speedup     : %8.2fx\n", fast / step);
+	vm_block_cache_enable(ctx);
+	double cached = measure(ctx, &vm_run, instructions, runs);
+	vm_block_cache_disable(ctx);
+	printf("block cache : %8.2f MIPS (%.2fx)\n", cached, cached / step);
+	double jit = measure(ctx, &vm_run_jit, instructions, runs);
+	printf("vm_run_jit  : %8.2f MIPS (%.2fx)\n", jit, jit / step);
+	double aot = measure(ctx, &loop_aot, instructions, runs);
+	printf("recompiled  : %8.2f MIPS (%.2fx)\n", aot, aot / step);
+	int cores = std::thread::hardware_concurrency();
+	double single = measure_batch(ctx, instructions, runs * 4, 1);
+	printf("batch 1 thread   : %8.2f MIPS\n", single);
+	double multi = measure_batch(ctx, instructions, runs * 4, cores);
+	printf("batch %d threads : %8.2f MIPS (%.2fx)\n", cores, multi, multi / single);
+	double copy = measure_copy(ctx, runs * 1000);
+	double fork = measure_fork(ctx, runs * 1000);
+	printf("copy context : %8.3f us fork : %8.3f us (%.2fx)\n", copy, fork, copy / fork);
+	double full = measure_reset(ctx, false, runs * 1000);
+	double dirty = measure_reset(ctx, true, runs * 1000);
+	printf("reset memory : %8.3f us dirty: %8.3f us (%.2fx)\n", full, dirty, full / dirty);
+	double save = 0.0;
+	double load = 0.0;
+	size_t size = 0;
+	measure_state(ctx, runs * 100, &save, &load, &size);
+	printf("save state   : %8.3f us load : %8.3f us (%d bytes)\n", save, load, (int)size);
+	vm_release(ctx);
+	measure_programs(argc > 2 ? argv[2] : "prog", runs * 2000);
+	return 0;
+}
@@ -31,6 +31,9 @@ enum CommandType {
 	TOK_LOAD,
 	TOK_SAVE,
 	TOK_SET_PC,
+	TOK_RECOMPILE,
+	TOK_BREAKPOINT,
+	TOK_CONTINUE,
 	TOK_HELP
 };
 
@@ -159,6 +162,34 @@ public:
 	}
 };
 
+// ------------------------------------------------------
+// Recompile
+// ------------------------------------------------------
+class ShellRecompile : public ShellCommand {
+
+public:
+	ShellRecompile() {}
+	void execute(const TextLine& line) {
+		char name[128];
+		char fileName[128];
+		line.get_string(1, name);
+		line.get_string(2, fileName);
+		vm_recompile_file(name, fileName);
+	}
+	void write_syntax() {
+		printf("aot - write the program as C++ function to file\n");
+	}
+	CommandType get_token_type() const {
+		return TOK_RECOMPILE;
+	}
+	const char* get_command() const {
+		return "aot";
+	}
+	int num_params() {
+		return 2;
+	}
+};
+
 // ------------------------------------------------------
 // Dump memory
 // ------------------------------------------------------
@@ -261,6 +292,58 @@ public:
 	}
 };
 
+// ------------------------------------------------------
+// Breakpoint
+// ------------------------------------------------------
+class ShellBreakpoint : public ShellCommand {
+
+public:
+	ShellBreakpoint() {}
+	void execute(const TextLine& line) {
+		char buffer[128];
+		line.get_string(1, buffer);
+		vm_breakpoint_set(hex2int(buffer));
+	}
+	void write_syntax() {
+		printf("break - set breakpoint {adr}\n");
+	}
+	CommandType get_token_type() const {
+		return TOK_BREAKPOINT;
+	}
+	const char* get_command() const {
+		return "break";
+	}
+	int num_params() {
+		return 1;
+	}
+};
+
+// ------------------------------------------------------
+// Continue
+// ------------------------------------------------------
+class ShellContinue : public ShellCommand {
+
+public:
+	ShellContinue() {}
+	void execute(const TextLine& line) {
+		if (vm_run_until_break() == STOP_BREAKPOINT) {
+			vm_dump_registers();
+		}
+	}
+	void write_syntax() {
+		printf("cont - run until the next breakpoint\n");
+	}
+	CommandType get_token_type() const {
+		return TOK_CONTINUE;
+	}
+	const char* get_command() const {
+		return "cont";
+	}
+	int num_params() {
+		return 0;
+	}
+};
+
 // ------------------------------------------------------
 // Quit
 // ------------------------------------------------------
@@ -323,10 +406,13 @@ public:
 		_commands[TOK_ASSEMBLE] = new ShellAssemble();
 		_commands[TOK_SAVE] = new ShellSave();
 		_commands[TOK_LOAD] = new ShellLoad();
+		_commands[TOK_RECOMPILE] = new ShellRecompile();
 		_commands[TOK_DUMP_MEMORY] = new ShellDumpMemory();
 		_commands[TOK_DISASSEMBLE] = new ShellDisassemble();
 		_commands[TOK_RUN] = new ShellRun();
 		_commands[TOK_SET_PC] = new ShellSetProgramCounter();
+		_commands[TOK_BREAKPOINT] = new ShellBreakpoint();
+		_commands[TOK_CONTINUE] = new ShellContinue();
 		_commands[TOK_HELP] = new ShellHelp();
 	}
 